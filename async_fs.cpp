@@ -0,0 +1,66 @@
+#include "async_fs.h"
+
+AsyncFileSystem::AsyncFileSystem(FileSystem &fs, size_t threads, size_t max_pending)
+    : fs(fs), pool(threads, max_pending)
+{
+}
+
+AsyncFileSystem::~AsyncFileSystem()
+{
+    pool.wait_idle();
+}
+
+std::future<uint32_t> AsyncFileSystem::lookup(const std::string &path)
+{
+    return run([this, path]
+               { return fs.lookup(path); });
+}
+
+std::future<bool> AsyncFileSystem::create(const std::string &path)
+{
+    return run([this, path]
+               { return fs.create_file(path); });
+}
+
+std::future<bool> AsyncFileSystem::make_directory(const std::string &path)
+{
+    return run([this, path]
+               { return fs.create_directory(path); });
+}
+
+std::future<std::optional<std::vector<char>>> AsyncFileSystem::read(const std::string &path)
+{
+    return run([this, path]() -> std::optional<std::vector<char>>
+               {
+                   std::vector<char> data;
+                   if (!fs.read_file(path, data))
+                   {
+                       return std::nullopt;
+                   }
+                   return data; });
+}
+
+std::future<bool> AsyncFileSystem::write(const std::string &path, std::vector<char> data)
+{
+    // The buffer moves into the job, so the caller need not keep it alive
+    return run([this, path, data = std::move(data)]
+               { return fs.write_file(path, data.data(), data.size()); });
+}
+
+std::future<bool> AsyncFileSystem::append(const std::string &path, std::vector<char> data)
+{
+    return run([this, path, data = std::move(data)]
+               { return fs.append_to_file(path, data.data(), data.size()); });
+}
+
+std::future<std::vector<std::pair<std::string, uint32_t>>> AsyncFileSystem::list(const std::string &path)
+{
+    return run([this, path]
+               { return fs.list_directory(path); });
+}
+
+std::future<bool> AsyncFileSystem::remove(const std::string &path)
+{
+    return run([this, path]
+               { return fs.remove_file(path); });
+}
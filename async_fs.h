@@ -0,0 +1,57 @@
+#ifndef ASYNC_FS_H
+#define ASYNC_FS_H
+
+#include "filesystem.h"
+#include "thread_pool.h"
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Future-returning front end to a mounted FileSystem. Each call queues the
+// operation on a pool of I/O threads and returns at once, so one thread can
+// keep many operations in flight and collect the results later, or poll
+// them with wait_for(0) from an event loop. Operations on different files
+// run in parallel under the FileSystem's own locking.
+class AsyncFileSystem
+{
+private:
+    FileSystem &fs;
+    ThreadPool pool;
+
+    template <typename Operation>
+    auto run(Operation operation) -> std::future<decltype(operation())>
+    {
+        // ThreadPool jobs must be copyable, packaged_task is not
+        auto task = std::make_shared<std::packaged_task<decltype(operation())()>>(std::move(operation));
+        auto result = task->get_future();
+        pool.submit([task]
+                    { (*task)(); });
+        return result;
+    }
+
+public:
+    // threads == 0 picks one I/O thread per hardware thread. Submitting
+    // blocks once max_pending operations are queued.
+    explicit AsyncFileSystem(FileSystem &fs, size_t threads = 0, size_t max_pending = 4096);
+    ~AsyncFileSystem(); // Finishes every queued operation
+
+    AsyncFileSystem(const AsyncFileSystem &) = delete;
+    AsyncFileSystem &operator=(const AsyncFileSystem &) = delete;
+
+    std::future<uint32_t> lookup(const std::string &path); // Inode number, 0 if missing
+    std::future<bool> create(const std::string &path);     // Empty regular file
+    std::future<bool> make_directory(const std::string &path);
+    std::future<std::optional<std::vector<char>>> read(const std::string &path); // Empty on failure
+    std::future<bool> write(const std::string &path, std::vector<char> data); // Replaces the contents
+    std::future<bool> append(const std::string &path, std::vector<char> data);
+    std::future<std::vector<std::pair<std::string, uint32_t>>> list(const std::string &path);
+    std::future<bool> remove(const std::string &path);
+
+    // Waits until nothing is queued or running
+    void drain() { pool.wait_idle(); }
+};
+
+#endif // ASYNC_FS_H
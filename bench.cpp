@@ -0,0 +1,656 @@
+#include "filesystem.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Microbenchmarks of the FileSystem operations. Each one runs on a fresh
+// image in the work directory, times every operation on its own and reports
+// throughput with the median and 99th percentile latency. Setup and cleanup
+// between operations are not timed.
+//
+// vfs_bench [--filter <text>] [--threads <n>] [work_dir]
+
+using Clock = std::chrono::steady_clock;
+
+// Directories keep their entries in the direct blocks, less "." and ".."
+constexpr size_t DIR_CAPACITY = DIRECT_BLOCKS * (BLOCK_SIZE / sizeof(DirEntry)) - 2;
+constexpr size_t DIR_FANOUT = 100; // Entries per parent where a benchmark needs more than fit in one
+
+static std::string work_dir = ".";
+static std::string filter;
+static int failures = 0;
+static int max_threads = std::max(1u, std::thread::hardware_concurrency()); // Top of the thread scaling runs
+
+static std::string image_path()
+{
+    return work_dir + "/vfs_bench.img";
+}
+
+static std::string host_path(const std::string &name)
+{
+    return work_dir + "/vfs_bench." + name;
+}
+
+// A freshly formatted and mounted image of size bytes
+static std::unique_ptr<FileSystem> fresh_disk(size_t size)
+{
+    std::unique_ptr<FileSystem> fs(new FileSystem(image_path()));
+    if (!fs->create_disk(size) || !fs->mount_disk())
+    {
+        return nullptr;
+    }
+    return fs;
+}
+
+static bool write_host_file(const std::string &path, const std::vector<char> &data)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    return out.good();
+}
+
+static bool write_host_file(const std::string &path, size_t size)
+{
+    std::vector<char> data(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        data[i] = static_cast<char>(i * 7 + (i >> 12));
+    }
+    return write_host_file(path, data);
+}
+
+// Words drawn at random from a small vocabulary, like log or source text
+static std::vector<char> text_data(size_t size)
+{
+    static const char *words[] = {"the", "file", "system", "block", "inode", "error", "request", "cache",
+                                  "journal", "commit", "read", "write", "directory", "0x1f3a", "12:04:55", "\n"};
+    std::mt19937 rng(1);
+    std::vector<char> data;
+    while (data.size() < size)
+    {
+        const char *word = words[rng() % 16];
+        data.insert(data.end(), word, word + strlen(word));
+        data.push_back(' ');
+    }
+    data.resize(size);
+    return data;
+}
+
+static std::vector<char> random_data(size_t size)
+{
+    std::mt19937 rng(2);
+    std::vector<char> data(size);
+    for (char &c : data)
+    {
+        c = static_cast<char>(rng());
+    }
+    return data;
+}
+
+static std::string size_label(size_t bytes)
+{
+    if (bytes >= (1 << 20) && bytes % (1 << 20) == 0)
+    {
+        return std::to_string(bytes >> 20) + "M";
+    }
+    if (bytes >= 1024 && bytes % 1024 == 0)
+    {
+        return std::to_string(bytes >> 10) + "K";
+    }
+    return std::to_string(bytes);
+}
+
+static bool wanted(const std::string &name)
+{
+    return filter.empty() || name.find(filter) != std::string::npos;
+}
+
+static void print_header()
+{
+    std::cout << std::left << std::setw(36) << "benchmark" << std::right << std::setw(8) << "ops" << std::setw(14)
+              << "ops/s" << std::setw(11) << "MB/s" << std::setw(12) << "p50 (us)" << std::setw(12) << "p99 (us)"
+              << "\n";
+}
+
+// bytes is what one operation moves, 0 when throughput in MB/s means nothing.
+// Throughput is over seconds of wall time, or over the summed latencies
+// when that is 0. note goes at the end of the line.
+static void report(const std::string &name, std::vector<double> &latencies, size_t bytes, double seconds = 0,
+                   const std::string &note = "")
+{
+    double total = 0;
+    for (double latency : latencies)
+    {
+        total += latency;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    double p50 = latencies[latencies.size() / 2];
+    double p99 = latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)];
+    if (seconds == 0)
+    {
+        seconds = total / 1e6;
+    }
+
+    std::cout << std::left << std::setw(36) << name << std::right << std::setw(8) << latencies.size() << std::fixed
+              << std::setprecision(1) << std::setw(14) << latencies.size() / seconds << std::setw(11);
+    if (bytes > 0)
+    {
+        std::cout << bytes * latencies.size() / seconds / (1024.0 * 1024.0);
+    }
+    else
+    {
+        std::cout << "-";
+    }
+    std::cout << std::setprecision(2) << std::setw(12) << p50 << std::setw(12) << p99 << note << std::endl;
+}
+
+static void report_failure(const std::string &name, const std::string &what)
+{
+    std::cout << std::left << std::setw(36) << name << " failed: " << what << std::endl;
+    failures++;
+}
+
+// Times op(i) for i in [0, count), then runs the untimed after(i). Stops at
+// the first step that fails.
+template <typename Op, typename After>
+static bool measure(size_t count, std::vector<double> &latencies, Op op, After after)
+{
+    latencies.clear();
+    latencies.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        Clock::time_point start = Clock::now();
+        bool ok = op(i);
+        latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        if (!ok || !after(i))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename Op>
+static bool measure(size_t count, std::vector<double> &latencies, Op op)
+{
+    return measure(count, latencies, op, [](size_t)
+                   { return true; });
+}
+
+// Runs op(thread, i) for i in [0, count) on threads threads at once, and
+// gives the wall time they took in seconds
+template <typename Op>
+static bool measure_parallel(int threads, size_t count, std::vector<double> &latencies, double &seconds, Op op)
+{
+    std::vector<std::vector<double>> per_thread(threads);
+    std::atomic<bool> ok(true);
+    std::vector<std::thread> workers;
+    Clock::time_point start = Clock::now();
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]
+                             {
+                                 if (!measure(count, per_thread[t], [&](size_t i)
+                                              { return op(t, i); }))
+                                 {
+                                     ok = false;
+                                 } });
+    }
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+    seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    latencies.clear();
+    for (const std::vector<double> &part : per_thread)
+    {
+        latencies.insert(latencies.end(), part.begin(), part.end());
+    }
+    return ok;
+}
+
+// Runs one benchmark on a fresh image of disk_size bytes
+template <typename Body>
+static void run(const std::string &name, size_t disk_size, size_t bytes, Body body)
+{
+    if (!wanted(name))
+    {
+        return;
+    }
+    std::unique_ptr<FileSystem> fs = fresh_disk(disk_size);
+    std::vector<double> latencies;
+    if (!fs)
+    {
+        report_failure(name, "cannot create the image");
+    }
+    else if (!body(*fs, latencies))
+    {
+        report_failure(name, "operation failed after " + std::to_string(latencies.size()) + " ops");
+    }
+    else
+    {
+        report(name, latencies, bytes);
+    }
+}
+
+// Path of the i-th of many entries, DIR_FANOUT to a parent under root
+static std::string spread_path(size_t i)
+{
+    return "/p" + std::to_string(i / DIR_FANOUT) + "/e" + std::to_string(i % DIR_FANOUT);
+}
+
+// The parent of spread_path(i) is made untimed before its first entry
+static bool make_parent(FileSystem &fs, size_t i)
+{
+    return i % DIR_FANOUT != 0 || fs.create_directory("/p" + std::to_string(i / DIR_FANOUT));
+}
+
+static void bench_create_directory()
+{
+    run("create_directory", 256 << 20, 0, [](FileSystem &fs, std::vector<double> &latencies)
+        { return make_parent(fs, 0) &&
+                 measure(5000, latencies, [&](size_t i)
+                         { return fs.create_directory(spread_path(i)); },
+                         [&](size_t i)
+                         { return make_parent(fs, i + 1); }); });
+}
+
+// find_inode_by_path, through the public lookup
+static void bench_lookup()
+{
+    for (size_t depth : {1, 4, 16, 64})
+    {
+        run("find_inode_by_path/depth:" + std::to_string(depth), 64 << 20, 0,
+            [depth](FileSystem &fs, std::vector<double> &latencies)
+            {
+                std::string path;
+                for (size_t d = 0; d < depth; d++)
+                {
+                    path += "/dir" + std::to_string(d);
+                    if (!fs.create_directory(path))
+                    {
+                        return false;
+                    }
+                }
+                return measure(20000, latencies, [&](size_t)
+                               { return fs.lookup(path) != 0; });
+            });
+    }
+}
+
+static void bench_list_directory()
+{
+    for (size_t entries : {size_t(10), size_t(50), DIR_CAPACITY})
+    {
+        run("list_directory/entries:" + std::to_string(entries), 64 << 20, 0,
+            [entries](FileSystem &fs, std::vector<double> &latencies)
+            {
+                if (!fs.create_directory("/list"))
+                {
+                    return false;
+                }
+                for (size_t e = 0; e < entries; e++)
+                {
+                    if (!fs.create_file("/list/entry" + std::to_string(e)))
+                    {
+                        return false;
+                    }
+                }
+                return measure(20000, latencies, [&](size_t)
+                               { return fs.list_directory("/list").size() == entries; });
+            });
+    }
+}
+
+// Sizes up to the 4MB a file can hold
+static const size_t COPY_SIZES[] = {4 << 10, 64 << 10, 1 << 20, 4 << 20};
+
+static size_t copy_count(size_t size)
+{
+    return std::max<size_t>(20, std::min<size_t>(2000, (128 << 20) / size));
+}
+
+static void bench_copy_from_system()
+{
+    for (size_t size : COPY_SIZES)
+    {
+        run("copy_from_system/size:" + size_label(size), 256 << 20, size,
+            [size](FileSystem &fs, std::vector<double> &latencies)
+            {
+                // Each copy goes to a new file; the image holds them all
+                std::string source = host_path("in");
+                bool ok = write_host_file(source, size) && make_parent(fs, 0) &&
+                          measure(copy_count(size), latencies, [&](size_t i)
+                                  { return fs.copy_from_system(source, spread_path(i)); },
+                                  [&](size_t i)
+                                  { return make_parent(fs, i + 1); });
+                remove(source.c_str());
+                return ok;
+            });
+    }
+}
+
+static void bench_copy_to_system()
+{
+    for (size_t size : COPY_SIZES)
+    {
+        run("copy_to_system/size:" + size_label(size), 64 << 20, size,
+            [size](FileSystem &fs, std::vector<double> &latencies)
+            {
+                std::string source = host_path("in"), target = host_path("out");
+                bool ok = write_host_file(source, size) && fs.copy_from_system(source, "/file") &&
+                          measure(copy_count(size), latencies, [&](size_t)
+                                  { return fs.copy_to_system("/file", target); });
+                remove(source.c_str());
+                remove(target.c_str());
+                return ok;
+            });
+    }
+}
+
+// The file starts over before it reaches the 4MB limit. Freed blocks are
+// only reused once their free is committed, hence the syncs.
+static void bench_append_to_file()
+{
+    for (size_t size : {512, 4 << 10, 64 << 10})
+    {
+        run("append_to_file/size:" + size_label(size), 64 << 20, size,
+            [size](FileSystem &fs, std::vector<double> &latencies)
+            {
+                size_t length = 0;
+                return fs.create_file("/append") &&
+                       measure(std::min<size_t>(20000, (64 << 20) / size), latencies, [&](size_t)
+                               { return fs.append_to_file("/append", size); },
+                               [&](size_t)
+                               {
+                                   length += size;
+                                   if (length + size <= (2 << 20))
+                                   {
+                                       return true;
+                                   }
+                                   length = 0;
+                                   return fs.truncate_to_size("/append", 0) && fs.sync();
+                               });
+            });
+    }
+}
+
+// Cuts size bytes off the end of a 4MB file, refilling it once it runs out
+// after a sync that hands the freed blocks back
+static void bench_truncate_file()
+{
+    for (size_t size : {4 << 10, 64 << 10})
+    {
+        run("truncate_file/size:" + size_label(size), 64 << 20, size,
+            [size](FileSystem &fs, std::vector<double> &latencies)
+            {
+                const size_t full = 4 << 20;
+                size_t length = full;
+                return fs.create_file("/truncate") && fs.append_to_file("/truncate", full) &&
+                       measure(std::min<size_t>(20000, (256 << 20) / size), latencies, [&](size_t)
+                               { return fs.truncate_file("/truncate", size); },
+                               [&](size_t)
+                               {
+                                   length -= size;
+                                   if (length >= size)
+                                   {
+                                       return true;
+                                   }
+                                   length = full;
+                                   return fs.sync() && fs.truncate_to_size("/truncate", 0) &&
+                                          fs.append_to_file("/truncate", full);
+                               });
+            });
+    }
+}
+
+// Fills the disk with 32KB files, then frees every few of them so that the
+// free blocks left are scattered over the whole bitmap. Each timed append
+// allocates one of them.
+static void bench_allocation_nearly_full()
+{
+    for (unsigned percent : {50, 90, 99})
+    {
+        run("allocation/full:" + std::to_string(percent) + "%", 64 << 20, BLOCK_SIZE,
+            [percent](FileSystem &fs, std::vector<double> &latencies)
+            {
+                const size_t file_size = 32 << 10;
+                std::vector<char> data(file_size, 'x');
+                size_t files = 0;
+                while (make_parent(fs, files) && fs.write_file(spread_path(files), data.data(), data.size()))
+                {
+                    files++;
+                }
+
+                // Remove one file in every stride, spread evenly
+                size_t to_free = files * (100 - percent) / 100;
+                size_t stride = to_free > 0 ? files / to_free : files + 1;
+                size_t freed_blocks = 0;
+                for (size_t f = 0; f < files; f += stride)
+                {
+                    if (!fs.remove_file(spread_path(f)))
+                    {
+                        return false;
+                    }
+                    freed_blocks += file_size / BLOCK_SIZE;
+                }
+                if (!fs.sync() || !fs.create_file("/probe"))
+                {
+                    return false;
+                }
+
+                // Leave room for the probe's indirect block and the metadata
+                // that writes along the way
+                size_t count = std::min<size_t>(MAX_FILE_BLOCKS - 16, freed_blocks / 2);
+                return count > 0 && measure(count, latencies, [&](size_t)
+                                            { return fs.append_to_file("/probe", BLOCK_SIZE); });
+            });
+    }
+}
+
+// Compressed imports, and reads that decompress, of text that LZ4 shrinks
+// and of random bytes that it cannot, which are then stored as is. Lines
+// end with the ratio of logical to stored bytes.
+static void bench_compression()
+{
+    const size_t size = 1 << 20, count = 64;
+    for (bool text : {true, false})
+    {
+        std::string input = text ? "text" : "random";
+        std::string import_name = "compressed_import/" + input, read_name = "compressed_read/" + input;
+        if (!wanted(import_name) && !wanted(read_name))
+        {
+            continue;
+        }
+
+        std::unique_ptr<FileSystem> fs = fresh_disk(256 << 20);
+        std::string source = host_path("in");
+        std::vector<double> latencies;
+        if (!fs || !write_host_file(source, text ? text_data(size) : random_data(size)))
+        {
+            report_failure(import_name, "cannot create the image or the input");
+            continue;
+        }
+        fs->set_compress(true);
+
+        bool ok = make_parent(*fs, 0) && measure(count, latencies, [&](size_t i)
+                                                 { return fs->copy_from_system(source, spread_path(i)); },
+                                                 [&](size_t i)
+                                                 { return make_parent(*fs, i + 1); });
+        remove(source.c_str());
+        CompressionInfo info;
+        if (!ok || !fs->get_compression_info(spread_path(0), info) || info.stored_blocks == 0)
+        {
+            report_failure(import_name, "import failed");
+            continue;
+        }
+        std::ostringstream note;
+        note << std::fixed << std::setprecision(2) << "  ratio "
+             << info.logical_bytes / (static_cast<double>(info.stored_blocks) * BLOCK_SIZE);
+        if (wanted(import_name))
+        {
+            report(import_name, latencies, size, 0, note.str());
+        }
+
+        if (!wanted(read_name))
+        {
+            continue;
+        }
+        if (measure(count * 4, latencies, [&](size_t i)
+                    {
+                        std::vector<char> data;
+                        return fs->read_file(spread_path(i % count), data) && data.size() == size;
+                    }))
+        {
+            report(read_name, latencies, size, 0, note.str());
+        }
+        else
+        {
+            report_failure(read_name, "read failed");
+        }
+    }
+}
+
+// Lookups and whole-file reads on a read-only mount, which takes no locks
+// on either path, from one thread up to max_threads. Every thread does the
+// same work, so with linear scaling ops/s grows with the thread count.
+static void bench_read_only()
+{
+    const size_t files = 64, file_size = 64 << 10;
+    std::vector<std::string> paths;
+    for (size_t f = 0; f < files; f++)
+    {
+        paths.push_back("/ro/a/b/c/d/e/f/g/file" + std::to_string(f));
+    }
+    std::vector<int> thread_counts;
+    for (int threads = 1; threads < max_threads; threads *= 2)
+    {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    bool any = false;
+    for (int threads : thread_counts)
+    {
+        any = any || wanted("ro_find_inode_by_path/threads:" + std::to_string(threads)) ||
+              wanted("ro_read_file/threads:" + std::to_string(threads));
+    }
+    if (!any)
+    {
+        return;
+    }
+
+    // Build the tree read-write, then mount it read-only
+    {
+        std::unique_ptr<FileSystem> fs = fresh_disk(64 << 20);
+        std::vector<char> data(file_size, 'r');
+        bool ok = fs != nullptr;
+        for (const char *dir : {"/ro", "/ro/a", "/ro/a/b", "/ro/a/b/c", "/ro/a/b/c/d", "/ro/a/b/c/d/e",
+                                "/ro/a/b/c/d/e/f", "/ro/a/b/c/d/e/f/g"})
+        {
+            ok = ok && fs->create_directory(dir);
+        }
+        for (size_t f = 0; ok && f < files; f++)
+        {
+            ok = fs->write_file(paths[f], data.data(), data.size());
+        }
+        if (!ok)
+        {
+            report_failure("ro_*", "cannot build the tree");
+            return;
+        }
+    }
+    FileSystem fs(image_path());
+    if (!fs.mount_disk(true))
+    {
+        report_failure("ro_*", "cannot mount read-only");
+        return;
+    }
+
+    auto scale = [&](const std::string &name, size_t count, size_t bytes, auto op)
+    {
+        double base = 0;
+        for (int threads : thread_counts)
+        {
+            std::string full_name = name + "/threads:" + std::to_string(threads);
+            std::vector<double> latencies;
+            double seconds;
+            if (!wanted(full_name))
+            {
+                continue;
+            }
+            if (!measure_parallel(threads, count, latencies, seconds, op))
+            {
+                report_failure(full_name, "operation failed");
+                continue;
+            }
+
+            double rate = latencies.size() / seconds;
+            base = base == 0 ? rate : base;
+            std::ostringstream note;
+            note << std::fixed << std::setprecision(2) << "  x" << rate / base;
+            report(full_name, latencies, bytes, seconds, note.str());
+        }
+    };
+
+    scale("ro_find_inode_by_path", 20000, 0, [&](int thread, size_t i)
+          { return fs.lookup(paths[(thread * 7 + i) % files]) != 0; });
+    scale("ro_read_file", 2000, file_size, [&](int thread, size_t i)
+          {
+              std::vector<char> data;
+              return fs.read_file(paths[(thread * 7 + i) % files], data) && data.size() == file_size;
+          });
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc)
+        {
+            filter = argv[++i];
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            max_threads = std::max(1, atoi(argv[++i]));
+        }
+        else if (i == argc - 1 && arg[0] != '-')
+        {
+            work_dir = arg;
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--filter <text>] [--threads <n>] [work_dir]\n";
+            return 1;
+        }
+    }
+
+    print_header();
+    bench_create_directory();
+    bench_lookup();
+    bench_list_directory();
+    bench_copy_from_system();
+    bench_copy_to_system();
+    bench_append_to_file();
+    bench_truncate_file();
+    bench_allocation_nearly_full();
+    bench_compression();
+    bench_read_only();
+
+    remove(image_path().c_str());
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,257 @@
+#include "client.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// False for a path too long for the protocol
+static bool path_payload(const std::string &path, std::vector<char> &payload)
+{
+    payload.clear();
+    return put_string(payload, path);
+}
+
+VfsClient::VfsClient() : fd(-1), next_id(1)
+{
+}
+
+VfsClient::~VfsClient()
+{
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+bool VfsClient::connect(const std::string &socket_path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+    {
+        return false;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return false;
+    }
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+uint32_t VfsClient::send(Op op, const std::vector<char> &payload)
+{
+    if (fd < 0 || payload.size() > PROTOCOL_MAX_PAYLOAD)
+    {
+        return 0;
+    }
+
+    RequestHeader header = {};
+    header.length = payload.size();
+    header.id = next_id++;
+    header.op = static_cast<uint8_t>(op);
+    if (next_id == 0)
+    {
+        next_id = 1; // 0 is the failure value
+    }
+
+    // One send per request, so small requests are not split into packets
+    std::vector<char> message(sizeof(header) + payload.size());
+    memcpy(message.data(), &header, sizeof(header));
+    std::copy(payload.begin(), payload.end(), message.begin() + sizeof(header));
+    return send_exact(fd, message.data(), message.size()) ? header.id : 0;
+}
+
+uint32_t VfsClient::send(Op op, const std::string &path, const char *data, size_t size)
+{
+    std::vector<char> payload;
+    if (!path_payload(path, payload))
+    {
+        return 0;
+    }
+    payload.insert(payload.end(), data, data + size);
+    return send(op, payload);
+}
+
+bool VfsClient::receive(ClientResponse &response)
+{
+    if (!early.empty())
+    {
+        response = std::move(early.begin()->second);
+        early.erase(early.begin());
+        return true;
+    }
+
+    ResponseHeader header;
+    if (fd < 0 || !recv_exact(fd, &header, sizeof(header)) || header.length > PROTOCOL_MAX_PAYLOAD)
+    {
+        return false;
+    }
+
+    response.id = header.id;
+    response.ok = header.status == 0;
+    response.payload.resize(header.length);
+    return header.length == 0 || recv_exact(fd, response.payload.data(), header.length);
+}
+
+bool VfsClient::wait(uint32_t id, ClientResponse &response)
+{
+    auto found = early.find(id);
+    if (found != early.end())
+    {
+        response = std::move(found->second);
+        early.erase(found);
+        return true;
+    }
+
+    // Answers to other pipelined requests are kept for later
+    while (true)
+    {
+        ResponseHeader header;
+        if (fd < 0 || !recv_exact(fd, &header, sizeof(header)) || header.length > PROTOCOL_MAX_PAYLOAD)
+        {
+            return false;
+        }
+
+        ClientResponse &target = header.id == id ? response : early[header.id];
+        target.id = header.id;
+        target.ok = header.status == 0;
+        target.payload.resize(header.length);
+        if (header.length > 0 && !recv_exact(fd, target.payload.data(), header.length))
+        {
+            return false;
+        }
+        if (header.id == id)
+        {
+            return true;
+        }
+    }
+}
+
+bool VfsClient::call(Op op, const std::vector<char> &payload, ClientResponse &response)
+{
+    uint32_t id = send(op, payload);
+    return id != 0 && wait(id, response) && response.ok;
+}
+
+uint32_t VfsClient::lookup(const std::string &path)
+{
+    std::vector<char> payload;
+    ClientResponse response;
+    uint32_t inode_num = 0;
+    if (path_payload(path, payload) && call(Op::LOOKUP, payload, response))
+    {
+        const char *in = response.payload.data();
+        get_u32(in, in + response.payload.size(), inode_num);
+    }
+    return inode_num;
+}
+
+bool VfsClient::create(const std::string &path)
+{
+    std::vector<char> payload;
+    ClientResponse response;
+    return path_payload(path, payload) && call(Op::CREATE, payload, response);
+}
+
+bool VfsClient::make_directory(const std::string &path)
+{
+    std::vector<char> payload;
+    ClientResponse response;
+    return path_payload(path, payload) && call(Op::MKDIR, payload, response);
+}
+
+bool VfsClient::read(const std::string &path, std::vector<char> &data)
+{
+    std::vector<char> payload;
+    ClientResponse response;
+    if (!path_payload(path, payload) || !call(Op::READ, payload, response))
+    {
+        return false;
+    }
+    data = std::move(response.payload);
+    return true;
+}
+
+bool VfsClient::write(const std::string &path, const char *data, size_t size)
+{
+    std::vector<char> payload;
+    if (!path_payload(path, payload))
+    {
+        return false;
+    }
+    payload.insert(payload.end(), data, data + size);
+    ClientResponse response;
+    return call(Op::WRITE, payload, response);
+}
+
+bool VfsClient::append(const std::string &path, const char *data, size_t size)
+{
+    std::vector<char> payload;
+    if (!path_payload(path, payload))
+    {
+        return false;
+    }
+    payload.insert(payload.end(), data, data + size);
+    ClientResponse response;
+    return call(Op::APPEND, payload, response);
+}
+
+bool VfsClient::list(const std::string &path, std::vector<std::pair<std::string, uint32_t>> &entries)
+{
+    std::vector<char> payload;
+    ClientResponse response;
+    if (!path_payload(path, payload) || !call(Op::LIST, payload, response))
+    {
+        return false;
+    }
+
+    entries.clear();
+    const char *in = response.payload.data();
+    const char *end = in + response.payload.size();
+    while (in < end)
+    {
+        uint32_t size;
+        std::string name;
+        if (!get_u32(in, end, size) || !get_string(in, end, name))
+        {
+            return false;
+        }
+        entries.emplace_back(name, size);
+    }
+    return true;
+}
+
+bool VfsClient::remove(const std::string &path)
+{
+    std::vector<char> payload;
+    ClientResponse response;
+    return path_payload(path, payload) && call(Op::REMOVE, payload, response);
+}
+
+bool VfsClient::remove_directory(const std::string &path)
+{
+    std::vector<char> payload;
+    ClientResponse response;
+    return path_payload(path, payload) && call(Op::RMDIR, payload, response);
+}
+
+bool VfsClient::rename(const std::string &old_path, const std::string &new_path)
+{
+    std::vector<char> payload;
+    ClientResponse response;
+    return put_string(payload, old_path) && put_string(payload, new_path) && call(Op::RENAME, payload, response);
+}
+
+bool VfsClient::sync()
+{
+    ClientResponse response;
+    return call(Op::SYNC, {}, response);
+}
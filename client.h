@@ -0,0 +1,59 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include "protocol.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct ClientResponse
+{
+    uint32_t id;
+    bool ok;
+    std::vector<char> payload;
+};
+
+// Client side of `vfs serve`. The blocking calls send one request and wait
+// for its answer; send / receive pipeline any number of requests over the
+// one connection. A client is used by one thread at a time.
+class VfsClient
+{
+private:
+    int fd;
+    uint32_t next_id;
+    std::unordered_map<uint32_t, ClientResponse> early; // Arrived while waiting for another id
+
+    bool call(Op op, const std::vector<char> &payload, ClientResponse &response);
+
+public:
+    VfsClient();
+    ~VfsClient();
+
+    VfsClient(const VfsClient &) = delete;
+    VfsClient &operator=(const VfsClient &) = delete;
+
+    bool connect(const std::string &socket_path);
+
+    // Pipelining. send returns the request id, 0 on failure; receive
+    // returns the next response, wait the one for a given id.
+    uint32_t send(Op op, const std::vector<char> &payload);
+    uint32_t send(Op op, const std::string &path, const char *data = nullptr, size_t size = 0);
+    bool receive(ClientResponse &response);
+    bool wait(uint32_t id, ClientResponse &response);
+
+    uint32_t lookup(const std::string &path); // Inode number, 0 if missing
+    bool create(const std::string &path);
+    bool make_directory(const std::string &path);
+    bool read(const std::string &path, std::vector<char> &data);
+    bool write(const std::string &path, const char *data, size_t size);
+    bool append(const std::string &path, const char *data, size_t size);
+    bool list(const std::string &path, std::vector<std::pair<std::string, uint32_t>> &entries); // <name, size>
+    bool remove(const std::string &path);
+    bool remove_directory(const std::string &path);
+    bool rename(const std::string &old_path, const std::string &new_path);
+    bool sync();
+};
+
+#endif // CLIENT_H
@@ -0,0 +1,170 @@
+#include "client.h"
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+// Command line client for `vfs serve`: one command per invocation
+
+void print_usage(const char *program)
+{
+    std::cerr << "Usage: " << program << " <socket> <command> [args]\n"
+              << "Commands:\n"
+              << "  ls <path>                - List directory contents\n"
+              << "  stat <path>              - Show the inode number of a path\n"
+              << "  mkdir <path>             - Create a directory\n"
+              << "  rmdir <path>             - Remove a directory\n"
+              << "  touch <path>             - Create an empty file\n"
+              << "  rm <path>                - Remove a file or link\n"
+              << "  mv <old_path> <new_path> - Rename or move a file or directory\n"
+              << "  cat <path>               - Write a file to stdout\n"
+              << "  get <virt_path> <sys_path> - Copy a file from the disk to the system\n"
+              << "  put <sys_path> <virt_path> - Copy a system file (or - for stdin) to the disk\n"
+              << "  append <sys_path> <virt_path> - Append a system file (or - for stdin) to a file\n"
+              << "  sync                     - Write cached changes to the disk file\n";
+}
+
+static bool read_source(const std::string &sys_path, std::vector<char> &data)
+{
+    int fd = sys_path == "-" ? STDIN_FILENO : open(sys_path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    char buffer[65536];
+    ssize_t got;
+    while ((got = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        data.insert(data.end(), buffer, buffer + got);
+    }
+    if (fd != STDIN_FILENO)
+    {
+        close(fd);
+    }
+    return got == 0;
+}
+
+static bool write_target(int fd, const std::vector<char> &data)
+{
+    size_t done = 0;
+    while (done < data.size())
+    {
+        ssize_t put = write(fd, data.data() + done, data.size() - done);
+        if (put <= 0)
+        {
+            return false;
+        }
+        done += put;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::string cmd = argv[2];
+    std::string arg1 = argc > 3 ? argv[3] : "";
+    std::string arg2 = argc > 4 ? argv[4] : "";
+    bool needs_two = cmd == "mv" || cmd == "get" || cmd == "put" || cmd == "append";
+    if ((cmd != "sync" && arg1.empty()) || (needs_two && arg2.empty()))
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    VfsClient client;
+    if (!client.connect(argv[1]))
+    {
+        std::cerr << "Error: Cannot connect to " << argv[1] << "\n";
+        return 1;
+    }
+
+    bool ok = false;
+    if (cmd == "ls")
+    {
+        std::vector<std::pair<std::string, uint32_t>> entries;
+        ok = client.list(arg1, entries);
+        for (const auto &[name, size] : entries)
+        {
+            std::cout << name << " " << size << " bytes\n";
+        }
+    }
+    else if (cmd == "stat")
+    {
+        uint32_t inode_num = client.lookup(arg1);
+        ok = inode_num != 0;
+        if (ok)
+        {
+            std::cout << arg1 << ": inode " << inode_num << "\n";
+        }
+    }
+    else if (cmd == "mkdir")
+    {
+        ok = client.make_directory(arg1);
+    }
+    else if (cmd == "rmdir")
+    {
+        ok = client.remove_directory(arg1);
+    }
+    else if (cmd == "touch")
+    {
+        ok = client.create(arg1);
+    }
+    else if (cmd == "rm")
+    {
+        ok = client.remove(arg1);
+    }
+    else if (cmd == "mv")
+    {
+        ok = client.rename(arg1, arg2);
+    }
+    else if (cmd == "cat")
+    {
+        std::vector<char> data;
+        ok = client.read(arg1, data) && write_target(STDOUT_FILENO, data);
+    }
+    else if (cmd == "get")
+    {
+        std::vector<char> data;
+        ok = client.read(arg1, data);
+        if (ok)
+        {
+            int fd = open(arg2.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            ok = fd >= 0 && write_target(fd, data);
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+    }
+    else if (cmd == "put" || cmd == "append")
+    {
+        std::vector<char> data;
+        ok = read_source(arg1, data) &&
+             (cmd == "put" ? client.write(arg2, data.data(), data.size())
+                           : client.append(arg2, data.data(), data.size()));
+    }
+    else if (cmd == "sync")
+    {
+        ok = client.sync();
+    }
+    else
+    {
+        std::cerr << "Unknown command: " << cmd << "\n";
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (!ok)
+    {
+        std::cerr << "Error: " << cmd << " failed\n";
+        return 1;
+    }
+    return 0;
+}
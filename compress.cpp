@@ -0,0 +1,221 @@
+#include "compress.h"
+#include <cstdint>
+#include <cstring>
+
+namespace
+{
+    constexpr size_t MIN_MATCH = 4;
+    constexpr size_t LAST_LITERALS = 5; // The block must end with literals
+    constexpr size_t MATCH_LIMIT = 12;  // No match may start this close to the end
+    constexpr size_t MAX_OFFSET = 65535;
+    constexpr int HASH_BITS = 12;
+
+    inline uint32_t read32(const unsigned char *p)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline uint32_t hash_sequence(uint32_t sequence)
+    {
+        return (sequence * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    // Writes the 255-run continuation of a length whose nibble saturated
+    inline bool put_length(unsigned char *&op, unsigned char *oend, size_t length)
+    {
+        while (length >= 255)
+        {
+            if (op >= oend)
+            {
+                return false;
+            }
+            *op++ = 255;
+            length -= 255;
+        }
+        if (op >= oend)
+        {
+            return false;
+        }
+        *op++ = static_cast<unsigned char>(length);
+        return true;
+    }
+
+    inline bool put_sequence(unsigned char *&op, unsigned char *oend, const unsigned char *literals,
+                             size_t literal_length, size_t offset, size_t match_length)
+    {
+        if (op >= oend)
+        {
+            return false;
+        }
+
+        unsigned char *token = op++;
+        *token = static_cast<unsigned char>((literal_length >= 15 ? 15 : literal_length) << 4);
+        if (literal_length >= 15 && !put_length(op, oend, literal_length - 15))
+        {
+            return false;
+        }
+
+        if (static_cast<size_t>(oend - op) < literal_length)
+        {
+            return false;
+        }
+        memcpy(op, literals, literal_length);
+        op += literal_length;
+
+        if (match_length == 0)
+        {
+            return true; // Final literal-only sequence
+        }
+
+        if (oend - op < 2)
+        {
+            return false;
+        }
+        *op++ = static_cast<unsigned char>(offset & 0xFF);
+        *op++ = static_cast<unsigned char>(offset >> 8);
+
+        size_t code = match_length - MIN_MATCH;
+        *token |= static_cast<unsigned char>(code >= 15 ? 15 : code);
+        return code < 15 || put_length(op, oend, code - 15);
+    }
+}
+
+size_t lz4_compress(const char *src, size_t src_size, char *dst, size_t dst_capacity)
+{
+    const unsigned char *base = reinterpret_cast<const unsigned char *>(src);
+    const unsigned char *ip = base;
+    const unsigned char *anchor = base;
+    const unsigned char *iend = base + src_size;
+    unsigned char *op = reinterpret_cast<unsigned char *>(dst);
+    unsigned char *oend = op + dst_capacity;
+
+    if (src_size > MATCH_LIMIT)
+    {
+        // Positions + 1 of the last occurrence of each hashed 4-byte sequence
+        uint32_t table[1 << HASH_BITS] = {0};
+        const unsigned char *mflimit = iend - MATCH_LIMIT;
+        const unsigned char *matchlimit = iend - LAST_LITERALS;
+
+        while (ip < mflimit)
+        {
+            uint32_t sequence = read32(ip);
+            uint32_t h = hash_sequence(sequence);
+            uint32_t candidate = table[h];
+            table[h] = static_cast<uint32_t>(ip - base) + 1;
+
+            const unsigned char *ref = base + candidate - 1;
+            if (candidate == 0 || ip - ref > static_cast<ptrdiff_t>(MAX_OFFSET) || read32(ref) != sequence)
+            {
+                ip++;
+                continue;
+            }
+
+            const unsigned char *match_end = ip + MIN_MATCH;
+            const unsigned char *ref_end = ref + MIN_MATCH;
+            while (match_end < matchlimit && *match_end == *ref_end)
+            {
+                match_end++;
+                ref_end++;
+            }
+
+            if (!put_sequence(op, oend, anchor, ip - anchor, ip - ref, match_end - ip))
+            {
+                return 0;
+            }
+            ip = match_end;
+            anchor = ip;
+        }
+    }
+
+    if (!put_sequence(op, oend, anchor, iend - anchor, 0, 0))
+    {
+        return 0;
+    }
+    return op - reinterpret_cast<unsigned char *>(dst);
+}
+
+bool lz4_decompress(const char *src, size_t src_size, char *dst, size_t out_size)
+{
+    const unsigned char *ip = reinterpret_cast<const unsigned char *>(src);
+    const unsigned char *iend = ip + src_size;
+    unsigned char *op = reinterpret_cast<unsigned char *>(dst);
+    unsigned char *ostart = op;
+    unsigned char *oend = op + out_size;
+
+    while (ip < iend)
+    {
+        unsigned token = *ip++;
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15)
+        {
+            unsigned char b;
+            do
+            {
+                if (ip >= iend)
+                {
+                    return false;
+                }
+                b = *ip++;
+                literal_length += b;
+            } while (b == 255);
+        }
+
+        if (static_cast<size_t>(iend - ip) < literal_length || static_cast<size_t>(oend - op) < literal_length)
+        {
+            return false;
+        }
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+
+        if (ip >= iend)
+        {
+            break; // Last sequence has no match
+        }
+
+        if (iend - ip < 2)
+        {
+            return false;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > static_cast<size_t>(op - ostart))
+        {
+            return false;
+        }
+
+        size_t match_length = token & 15;
+        if (match_length == 15)
+        {
+            unsigned char b;
+            do
+            {
+                if (ip >= iend)
+                {
+                    return false;
+                }
+                b = *ip++;
+                match_length += b;
+            } while (b == 255);
+        }
+        match_length += MIN_MATCH;
+
+        if (static_cast<size_t>(oend - op) < match_length)
+        {
+            return false;
+        }
+
+        // Byte copy: the source may overlap the bytes being produced
+        const unsigned char *match = op - offset;
+        for (size_t i = 0; i < match_length; i++)
+        {
+            op[i] = match[i];
+        }
+        op += match_length;
+    }
+
+    return op == oend;
+}
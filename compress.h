@@ -0,0 +1,17 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <cstddef>
+
+// LZ4 block format codec (no frame header, no checksum). Output is
+// readable by any LZ4 block decoder, e.g. LZ4_decompress_safe.
+
+// Compresses src into dst. Returns the compressed length, or 0 if the
+// result would not fit in dst_capacity.
+size_t lz4_compress(const char *src, size_t src_size, char *dst, size_t dst_capacity);
+
+// Decompresses exactly out_size bytes into dst. Returns false on corrupt
+// input or a size mismatch.
+bool lz4_decompress(const char *src, size_t src_size, char *dst, size_t out_size);
+
+#endif // COMPRESS_H
@@ -0,0 +1,215 @@
+#include "delta.h"
+#include "compress.h"
+#include "filesystem.h"
+#include "hash.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+
+static bool read_fully(int fd, void *buffer, size_t length)
+{
+    char *out = static_cast<char *>(buffer);
+    while (length > 0)
+    {
+        ssize_t got = read(fd, out, length);
+        if (got <= 0)
+        {
+            return false;
+        }
+        out += got;
+        length -= got;
+    }
+    return true;
+}
+
+static bool pwrite_fully(int fd, const char *buffer, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t put = pwrite(fd, buffer, length, offset);
+        if (put <= 0)
+        {
+            return false;
+        }
+        buffer += put;
+        length -= put;
+        offset += put;
+    }
+    return true;
+}
+
+DeltaWriter::DeltaWriter() : fd(-1), header(), hash_state(0), bytes(0), blocks(0)
+{
+}
+
+DeltaWriter::~DeltaWriter()
+{
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+bool DeltaWriter::put(const void *data, size_t length)
+{
+    if (!pwrite_fully(fd, static_cast<const char *>(data), length, bytes))
+    {
+        return false;
+    }
+    hash_state = xxhash64(data, length, hash_state);
+    bytes += length;
+    return true;
+}
+
+// The header is written last, once the number of runs is known
+bool DeltaWriter::open(const std::string &path, uint32_t blocks_count, uint32_t base_generation, uint32_t generation)
+{
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    header = {DELTA_MAGIC, static_cast<uint32_t>(BLOCK_SIZE), blocks_count, base_generation, generation, 0};
+    hash_state = 0;
+    bytes = sizeof(header);
+    blocks = 0;
+    return true;
+}
+
+bool DeltaWriter::add_run(uint32_t first, uint32_t count, const char *data)
+{
+    size_t length = static_cast<size_t>(count) * BLOCK_SIZE;
+    std::vector<char> packed(length);
+    size_t packed_length = lz4_compress(data, length, packed.data(), length - 1);
+
+    DeltaRun run = {first, count, static_cast<uint32_t>(packed_length != 0 ? packed_length : length), 0};
+    if (!put(&run, sizeof(run)) || !put(packed_length != 0 ? packed.data() : data, run.stored))
+    {
+        return false;
+    }
+    header.runs++;
+    blocks += count;
+    return true;
+}
+
+bool DeltaWriter::finish(DeltaSummary &summary)
+{
+    uint64_t checksum = xxhash64(&header, sizeof(header), hash_state);
+    bool ok = pwrite_fully(fd, reinterpret_cast<const char *>(&checksum), sizeof(checksum), bytes) &&
+              pwrite_fully(fd, reinterpret_cast<const char *>(&header), sizeof(header), 0) && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    fd = -1;
+
+    summary.base_generation = header.base_generation;
+    summary.generation = header.generation;
+    summary.blocks = blocks;
+    summary.bytes = bytes + sizeof(checksum);
+    return ok;
+}
+
+// Reads the run that starts at the current position of fd, leaving its
+// blocks in data. Checks the chained hash as it goes.
+static bool read_run(int fd, uint32_t blocks_count, uint64_t &hash_state, DeltaRun &run, std::vector<char> &data)
+{
+    if (!read_fully(fd, &run, sizeof(run)) || run.count == 0 || run.count > DELTA_RUN_BLOCKS ||
+        run.first >= blocks_count || run.count > blocks_count - run.first ||
+        run.stored > static_cast<size_t>(run.count) * BLOCK_SIZE)
+    {
+        return false;
+    }
+    hash_state = xxhash64(&run, sizeof(run), hash_state);
+
+    size_t length = static_cast<size_t>(run.count) * BLOCK_SIZE;
+    std::vector<char> stored(run.stored);
+    if (!read_fully(fd, stored.data(), stored.size()))
+    {
+        return false;
+    }
+    hash_state = xxhash64(stored.data(), stored.size(), hash_state);
+
+    if (run.stored == length)
+    {
+        data = std::move(stored);
+        return true;
+    }
+    data.resize(length);
+    return lz4_decompress(stored.data(), stored.size(), data.data(), length);
+}
+
+bool apply_delta(const std::string &delta_path, const std::string &image_path, DeltaSummary &summary)
+{
+    int fd = open(delta_path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    // First pass: the whole file must check out before the image is touched
+    DeltaHeader header;
+    DeltaRun run;
+    std::vector<char> data;
+    uint64_t hash_state = 0, checksum = 0;
+    bool ok = read_fully(fd, &header, sizeof(header)) && header.magic == DELTA_MAGIC &&
+              header.block_size == BLOCK_SIZE && header.blocks_count > 0;
+    for (uint32_t i = 0; ok && i < header.runs; i++)
+    {
+        ok = read_run(fd, header.blocks_count, hash_state, run, data);
+    }
+    char extra;
+    ok = ok && read_fully(fd, &checksum, sizeof(checksum)) && read(fd, &extra, 1) == 0 &&
+         checksum == xxhash64(&header, sizeof(header), hash_state);
+
+    // The target must be the image this delta was taken against
+    int image_fd = -1;
+    if (ok)
+    {
+        image_fd = open(image_path.c_str(), O_RDWR | (header.base_generation == 0 ? O_CREAT : 0), 0644);
+        ok = image_fd >= 0;
+    }
+    if (ok && header.base_generation == 0)
+    {
+        ok = ftruncate(image_fd, static_cast<off_t>(header.blocks_count) * BLOCK_SIZE) == 0;
+    }
+    else if (ok)
+    {
+        Superblock superblock;
+        ok = pread(image_fd, &superblock, sizeof(superblock), 0) == sizeof(superblock) &&
+             superblock.magic == FS_MAGIC && superblock.blocks_count == header.blocks_count &&
+             superblock.changes_generation == header.base_generation;
+    }
+
+    // Second pass: write the blocks, holding the superblock back
+    std::vector<char> superblock_data;
+    summary = {header.base_generation, header.generation, 0, 0};
+    ok = ok && lseek(fd, sizeof(header), SEEK_SET) == static_cast<off_t>(sizeof(header));
+    hash_state = 0;
+    for (uint32_t i = 0; ok && i < header.runs; i++)
+    {
+        ok = read_run(fd, header.blocks_count, hash_state, run, data);
+        const char *blocks = data.data();
+        uint32_t first = run.first, count = run.count;
+        if (ok && first == 0)
+        {
+            superblock_data.assign(blocks, blocks + BLOCK_SIZE);
+            blocks += BLOCK_SIZE;
+            first++;
+            count--;
+        }
+        ok = ok && pwrite_fully(image_fd, blocks, static_cast<size_t>(count) * BLOCK_SIZE,
+                                static_cast<off_t>(first) * BLOCK_SIZE);
+        summary.blocks += run.count;
+    }
+    if (ok && !superblock_data.empty())
+    {
+        ok = fsync(image_fd) == 0 && pwrite_fully(image_fd, superblock_data.data(), BLOCK_SIZE, 0);
+    }
+    ok = ok && fsync(image_fd) == 0;
+
+    summary.bytes = lseek(fd, 0, SEEK_END);
+    close(fd);
+    if (image_fd >= 0)
+    {
+        close(image_fd);
+    }
+    return ok;
+}
@@ -0,0 +1,74 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Incremental image format written by FileSystem::export_delta. A header
+// names the change-tracking generation the delta starts from (0 for a full
+// image) and the one it brings the target to. Runs of consecutive blocks
+// follow, each LZ4-compressed when that saves space. The file ends with an
+// xxhash64 chained over the runs in order and then the header.
+
+constexpr uint32_t DELTA_MAGIC = 0x544C4456; // "VDLT"
+constexpr uint32_t DELTA_RUN_BLOCKS = 256;   // Longest run, so one buffer holds it
+
+struct DeltaHeader
+{
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t blocks_count;    // Of the image; a target must match
+    uint32_t base_generation; // Generation the target must be at, 0 = any
+    uint32_t generation;      // Generation the target is at afterwards
+    uint32_t runs;
+};
+
+struct DeltaRun
+{
+    uint32_t first;  // First block
+    uint32_t count;  // Blocks in the run
+    uint32_t stored; // Bytes that follow; count * block_size means uncompressed
+    uint32_t reserved;
+};
+
+// What an export wrote or an apply replayed
+struct DeltaSummary
+{
+    uint32_t base_generation;
+    uint32_t generation;
+    uint64_t blocks;
+    uint64_t bytes; // Size of the delta file
+};
+
+// Streams a delta to a host file
+class DeltaWriter
+{
+private:
+    int fd;
+    DeltaHeader header;
+    uint64_t hash_state; // xxhash64 of the runs, chained run by run
+    uint64_t bytes;
+    uint64_t blocks;
+
+    bool put(const void *data, size_t length);
+
+public:
+    DeltaWriter();
+    ~DeltaWriter();
+
+    DeltaWriter(const DeltaWriter &) = delete;
+    DeltaWriter &operator=(const DeltaWriter &) = delete;
+
+    bool open(const std::string &path, uint32_t blocks_count, uint32_t base_generation, uint32_t generation);
+    bool add_run(uint32_t first, uint32_t count, const char *data);
+    bool finish(DeltaSummary &summary); // Writes the header and checksum, and closes the file
+};
+
+// Replays a delta onto the image at image_path. A full delta creates the
+// image if needed; an incremental one checks that the image is at its base
+// generation. The whole file is verified before any block is written, and
+// the superblock goes last, so an interrupted apply can simply be rerun.
+bool apply_delta(const std::string &delta_path, const std::string &image_path, DeltaSummary &summary);
+
+#endif // DELTA_H
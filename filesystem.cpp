@@ -1,20 +1,117 @@
 #include "filesystem.h"
 #include <cstring>
+#include <cstddef>
 #include <iostream>
 #include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <filesystem>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include "compress.h"
+#include "hash.h"
+#include "thread_pool.h"
+
+// pread/pwrite until the whole range is transferred
+static bool read_fully(int fd, char *buffer, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t got = pread(fd, buffer, length, offset);
+        if (got <= 0)
+        {
+            return false;
+        }
+        buffer += got;
+        length -= got;
+        offset += got;
+    }
+    return true;
+}
+
+static bool write_fully(int fd, const char *buffer, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t put = pwrite(fd, buffer, length, offset);
+        if (put <= 0)
+        {
+            return false;
+        }
+        buffer += put;
+        length -= put;
+        offset += put;
+    }
+    return true;
+}
+
+// Writes the blocks of a file image held in data to fd at their offsets.
+// Blocks whose pointer is 0 are skipped, so they stay holes on the host,
+// and the final size is set with ftruncate.
+static bool write_sparse(int fd, const char *data, size_t size, const std::vector<uint32_t> &blocks)
+{
+    for (size_t i = 0; i < blocks.size();)
+    {
+        if (blocks[i] == 0)
+        {
+            i++;
+            continue;
+        }
+
+        size_t run = 1;
+        while (i + run < blocks.size() && blocks[i + run] != 0)
+        {
+            run++;
+        }
+
+        size_t offset = i * BLOCK_SIZE;
+        if (!write_fully(fd, data + offset, std::min(run * BLOCK_SIZE, size - offset), offset))
+        {
+            return false;
+        }
+        i += run;
+    }
+
+    return ftruncate(fd, size) == 0;
+}
 
-// Magic number for our file system
-constexpr uint32_t FS_MAGIC = 0x4D534653; // "FSMS"
+// True when a BLOCK_SIZE block holds nothing but zero bytes. Words are
+// OR-ed together 64 bytes at a time, which the compiler turns into vector
+// loads, and the check bails out at the first non-zero group.
+static bool block_is_zero(const char *data)
+{
+    for (size_t i = 0; i < BLOCK_SIZE; i += 64)
+    {
+        uint64_t words[8];
+        memcpy(words, data + i, sizeof(words));
+        if ((words[0] | words[1] | words[2] | words[3] | words[4] | words[5] | words[6] | words[7]) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-FileSystem::FileSystem(const std::string &path) : disk_path(path)
+FileSystem::FileSystem(const std::string &path) : disk_path(path), disk_fd(-1), next_free_block(0), next_free_inode(1), dedup_enabled(false), compress_enabled(false), in_transaction(false), root_inode(1), read_only(false)
 {
 }
 
 FileSystem::~FileSystem()
 {
-    if (disk_file.is_open())
+    for (uint32_t i = 0; dir_indexes && i <= superblock.inodes_count; i++)
+    {
+        delete dir_indexes[i].load();
+    }
+    if (disk_fd >= 0)
     {
-        disk_file.close();
+        cache.detach();
+        close(disk_fd);
     }
 }
 
@@ -27,56 +124,52 @@ bool FileSystem::create_disk(size_t size)
     // Calculate number of inodes (roughly 1 inode per 4 blocks)
     size_t inodes_count = num_blocks / 4;
     size_t inode_blocks = (inodes_count * INODE_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t bitmap_blocks = (num_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
 
-    disk_file.open(disk_path, std::ios::out | std::ios::binary);
-    if (!disk_file)
+    // Initialize disk with zeros; ftruncate leaves the unused blocks sparse
+    disk_fd = open(disk_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (disk_fd < 0)
     {
         return false;
     }
-
-    // Initialize disk with zeros
-    char *empty_block = new char[BLOCK_SIZE]();
-    for (size_t i = 0; i < num_blocks; i++)
+    if (ftruncate(disk_fd, actual_size) != 0)
     {
-        disk_file.write(empty_block, BLOCK_SIZE);
+        close(disk_fd);
+        disk_fd = -1;
+        return false;
     }
-    delete[] empty_block;
+    cache.attach(disk_fd, BLOCK_SIZE, false);
 
     // Initialize superblock
+    superblock = {};
     superblock.magic = FS_MAGIC;
     superblock.block_size = BLOCK_SIZE;
     superblock.blocks_count = num_blocks;
-    superblock.free_blocks_count = num_blocks - 2 - inode_blocks; // Subtract superblock, bitmap, and inode blocks
+    superblock.free_blocks_count = num_blocks - 1 - bitmap_blocks - inode_blocks; // Subtract superblock, bitmap, and inode blocks
     superblock.inodes_count = inodes_count;
     superblock.free_inodes_count = inodes_count - 1; // Reserve first inode for root directory
-    superblock.first_data_block = 2 + inode_blocks;
-    superblock.first_inode_block = 2; // Right after superblock and bitmap
+    superblock.first_data_block = 1 + bitmap_blocks + inode_blocks;
+    superblock.first_inode_block = 1 + bitmap_blocks; // Right after superblock and bitmap
     superblock.bitmap_block = 1;
+    superblock.bitmap_blocks = bitmap_blocks;
 
     // Write superblock
-    disk_file.seekp(0, std::ios::beg);
-    disk_file.write(reinterpret_cast<char *>(&superblock), sizeof(Superblock));
+    write_superblock();
 
     // Initialize block bitmap
-    block_bitmap.resize(num_blocks, false);
+    block_bitmap.assign(num_blocks, false);
+    bitmap_dirty.assign(bitmap_blocks, true);
+    block_pinned.assign(num_blocks, false);
     block_bitmap[0] = true; // Superblock
-    block_bitmap[1] = true; // Bitmap block
-    for (size_t i = 0; i < inode_blocks; i++)
+    for (size_t i = 0; i < bitmap_blocks; i++)
     {
-        block_bitmap[2 + i] = true; // Inode blocks
+        block_bitmap[1 + i] = true; // Bitmap blocks
     }
-    write_bitmap();
-
-    // Initialize inode table blocks
-    char zero_inode_block[BLOCK_SIZE] = {0};
-    for (size_t i = 0; i < inode_blocks; ++i)
+    for (size_t i = 0; i < inode_blocks; i++)
     {
-        disk_file.seekp((superblock.first_inode_block + i) * BLOCK_SIZE, std::ios::beg);
-        disk_file.write(zero_inode_block, BLOCK_SIZE);
+        block_bitmap[superblock.first_inode_block + i] = true; // Inode blocks
     }
-
-    // After writing all inode table blocks
-    disk_file.flush();
+    write_bitmap();
 
     // Create root directory
     Inode root_inode;
@@ -106,62 +199,191 @@ bool FileSystem::create_disk(size_t size)
     entries[1].file_type = static_cast<uint8_t>(FileType::DIRECTORY);
     strcpy(entries[1].name, "..");
 
-    // Write directory entries
-    write_block(root_block, dir_block);
+    // Write directory entries and the root inode
+    bool ok = write_block(root_block, dir_block) && write_inode(1, root_inode);
+
+    cache.detach();
+    close(disk_fd);
+    disk_fd = -1;
+    return ok;
+}
+
+// A read-only mount opens the image O_RDONLY, refuses every change and
+// serves lookups and reads without taking any lock
+bool FileSystem::mount_disk(bool read_only)
+{
+    disk_fd = open(disk_path.c_str(), read_only ? O_RDONLY : O_RDWR);
+    if (disk_fd < 0)
+    {
+        return false;
+    }
+    cache.attach(disk_fd, BLOCK_SIZE, false);
 
-    // Directly write the root inode to the inode table block
-    uint32_t inode_block = superblock.first_inode_block;
-    char block_data[BLOCK_SIZE] = {0};
-    memcpy(block_data, &root_inode, sizeof(Inode));
-    disk_file.seekp(inode_block * BLOCK_SIZE, std::ios::beg);
-    disk_file.write(block_data, BLOCK_SIZE);
-    disk_file.flush();
+    this->read_only = read_only;
+    if (!read_superblock() || superblock.magic != FS_MAGIC || !replay_journal() ||
+        !read_bitmap() || !read_refcounts() || !read_dedup_index())
+    {
+        cache.detach();
+        close(disk_fd);
+        disk_fd = -1;
+        return false;
+    }
 
-    disk_file.close();
+    if (read_only)
+    {
+        cache.freeze();
+        dir_indexes.reset(new std::atomic<const DirIndex *>[superblock.inodes_count + 1]());
+    }
+    else
+    {
+        // Writes from here on are cached and committed to the journal in
+        // the background; a disk too full for a journal runs without one
+        ensure_journal();
+        cache.attach(disk_fd, BLOCK_SIZE, true, journal.is_open() ? &journal : nullptr);
+
+        // Once an image has been exported, every change is tracked
+        if (superblock.changes_block != 0 &&
+            !cache.track_changes(superblock.changes_block, superblock.changes_blocks, superblock.blocks_count))
+        {
+            cache.detach();
+            close(disk_fd);
+            disk_fd = -1;
+            return false;
+        }
+    }
     return true;
 }
 
-bool FileSystem::mount_disk()
+// Applies the transactions the last session committed but did not get
+// home. A read-only mount keeps them in the cache instead of writing them.
+bool FileSystem::replay_journal()
 {
-    disk_file.open(disk_path, std::ios::in | std::ios::out | std::ios::binary);
-    if (!disk_file)
+    if (superblock.journal_block == 0)
+    {
+        return true;
+    }
+    if (!journal.open(disk_fd, BLOCK_SIZE, superblock.journal_block, superblock.journal_blocks))
     {
         return false;
     }
 
-    if (!read_superblock())
+    uint32_t blocks_count = superblock.blocks_count;
+    int replayed = journal.replay([this, blocks_count](uint32_t block_num, const char *data)
+                                  {
+                                      if (block_num >= blocks_count)
+                                      {
+                                          return false;
+                                      }
+                                      if (read_only)
+                                      {
+                                          cache.preload(block_num, data);
+                                          return true;
+                                      }
+                                      return cache.write(block_num, 0, data, BLOCK_SIZE); });
+    // Replay moved the sequence past any torn transaction, so a read-write
+    // mount writes the header even when nothing was replayed: new commits
+    // must carry the sequence it names
+    if (replayed < 0 || (!read_only && ((replayed > 0 && fdatasync(disk_fd) != 0) || !journal.reset())))
     {
-        disk_file.close();
         return false;
     }
 
-    if (superblock.magic != FS_MAGIC)
+    // The log may have held a newer superblock
+    return replayed == 0 || read_superblock();
+}
+
+// Images from before the journal get one on their first read-write mount
+bool FileSystem::ensure_journal()
+{
+    if (superblock.journal_block != 0)
+    {
+        return journal.is_open();
+    }
+
+    uint32_t journal_blocks = std::clamp(superblock.blocks_count / 32, JOURNAL_MIN_BLOCKS, JOURNAL_MAX_BLOCKS);
+    uint32_t journal_start = allocate_run(journal_blocks);
+    if (journal_start == 0)
     {
-        disk_file.close();
         return false;
     }
 
-    if (!read_bitmap())
+    // The log is formatted before the superblock points at it
+    if (!journal.format(disk_fd, BLOCK_SIZE, journal_start, journal_blocks))
     {
-        disk_file.close();
         return false;
     }
+    superblock.journal_block = journal_start;
+    superblock.journal_blocks = journal_blocks;
+    return write_superblock() && fdatasync(disk_fd) == 0;
+}
 
+// Blocks freed inside the transaction stay allocated until it commits:
+// file data is written straight to the image, so reusing one of them
+// would overwrite contents that an abort has to bring back
+bool FileSystem::begin_transaction()
+{
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    if (read_only || in_transaction || !cache.begin_transaction())
+    {
+        return false;
+    }
+    in_transaction = true;
     return true;
 }
 
+bool FileSystem::commit_transaction()
+{
+    {
+        std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+        if (!in_transaction)
+        {
+            return false;
+        }
+        in_transaction = false;
+        free_blocks(deferred_frees);
+        deferred_frees.clear();
+    }
+    return cache.commit_transaction();
+}
+
+// The cached blocks go back to their state at begin_transaction, and the
+// in-memory copies of the allocator tables are reloaded from them
+bool FileSystem::abort_transaction()
+{
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    if (!in_transaction)
+    {
+        return false;
+    }
+    in_transaction = false;
+    deferred_frees.clear();
+    cache.abort_transaction();
+    {
+        std::lock_guard<std::mutex> symlink_lock(symlink_mutex);
+        symlink_targets.clear();
+    }
+    return read_superblock() && read_bitmap() && read_refcounts() && read_dedup_index();
+}
+
 bool FileSystem::read_superblock()
 {
-    disk_file.seekg(0, std::ios::beg);
-    disk_file.read(reinterpret_cast<char *>(&superblock), sizeof(Superblock));
-    return disk_file.good();
+    if (!cache.read(0, 0, &superblock, sizeof(Superblock)))
+    {
+        return false;
+    }
+
+    // Images created before multi-block bitmaps leave this field zeroed
+    if (superblock.bitmap_blocks == 0)
+    {
+        superblock.bitmap_blocks = 1;
+    }
+    return true;
 }
 
 bool FileSystem::write_superblock()
 {
-    disk_file.seekp(0, std::ios::beg);
-    disk_file.write(reinterpret_cast<const char *>(&superblock), sizeof(Superblock));
-    return disk_file.good();
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    return cache.write(0, 0, &superblock, sizeof(Superblock));
 }
 
 bool FileSystem::read_block(uint32_t block_num, void *buffer)
@@ -171,9 +393,7 @@ bool FileSystem::read_block(uint32_t block_num, void *buffer)
         return false;
     }
 
-    disk_file.seekg(block_num * BLOCK_SIZE, std::ios::beg);
-    disk_file.read(static_cast<char *>(buffer), BLOCK_SIZE);
-    return disk_file.good();
+    return cache.read(block_num, 0, buffer, BLOCK_SIZE);
 }
 
 bool FileSystem::write_block(uint32_t block_num, const void *buffer)
@@ -183,61 +403,124 @@ bool FileSystem::write_block(uint32_t block_num, const void *buffer)
         return false;
     }
 
-    disk_file.seekp(block_num * BLOCK_SIZE, std::ios::beg);
-    disk_file.write(static_cast<const char *>(buffer), BLOCK_SIZE);
-    return disk_file.good();
+    return cache.write(block_num, 0, buffer, BLOCK_SIZE);
 }
 
 bool FileSystem::read_bitmap()
 {
-    char *bitmap_data = new char[BLOCK_SIZE];
-    if (!read_block(superblock.bitmap_block, bitmap_data))
-    {
-        delete[] bitmap_data;
-        return false;
-    }
+    char bitmap_data[BLOCK_SIZE];
 
-    block_bitmap.resize(superblock.blocks_count);
-    for (uint32_t i = 0; i < superblock.blocks_count; i++)
+    block_bitmap.assign(superblock.blocks_count, false);
+    bitmap_dirty.assign(superblock.bitmap_blocks, false);
+    block_pinned.assign(superblock.blocks_count, false);
+    pinned_blocks.clear();
+
+    for (uint32_t b = 0; b < superblock.bitmap_blocks; b++)
     {
-        if (i / 8 < BLOCK_SIZE)
+        if (!read_block(superblock.bitmap_block + b, bitmap_data))
+        {
+            return false;
+        }
+
+        uint32_t first = b * BITS_PER_BLOCK;
+        uint32_t last = std::min(static_cast<uint32_t>(first + BITS_PER_BLOCK), superblock.blocks_count);
+        for (uint32_t i = first; i < last; i++)
         {
-            block_bitmap[i] = (bitmap_data[i / 8] & (1 << (i % 8))) != 0;
+            uint32_t bit = i - first;
+            block_bitmap[i] = (bitmap_data[bit / 8] & (1 << (bit % 8))) != 0;
         }
     }
 
-    delete[] bitmap_data;
     return true;
 }
 
+// Writes back the bitmap blocks touched since the last write
 bool FileSystem::write_bitmap()
 {
-    char *bitmap_data = new char[BLOCK_SIZE]();
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    bool result = true;
 
-    for (uint32_t i = 0; i < superblock.blocks_count && i / 8 < BLOCK_SIZE; i++)
+    for (uint32_t b = 0; b < superblock.bitmap_blocks; b++)
     {
-        if (block_bitmap[i])
+        if (!bitmap_dirty[b])
+        {
+            continue;
+        }
+
+        char bitmap_data[BLOCK_SIZE] = {0};
+        uint32_t first = b * BITS_PER_BLOCK;
+        uint32_t last = std::min(static_cast<uint32_t>(first + BITS_PER_BLOCK), superblock.blocks_count);
+        for (uint32_t i = first; i < last; i++)
+        {
+            if (block_bitmap[i])
+            {
+                uint32_t bit = i - first;
+                bitmap_data[bit / 8] |= (1 << (bit % 8));
+            }
+        }
+
+        if (write_block(superblock.bitmap_block + b, bitmap_data))
+        {
+            bitmap_dirty[b] = false;
+        }
+        else
         {
-            bitmap_data[i / 8] |= (1 << (i % 8));
+            result = false;
         }
     }
 
-    bool result = write_block(superblock.bitmap_block, bitmap_data);
-    delete[] bitmap_data;
     return result;
 }
 
+void FileSystem::mark_block(uint32_t block_num, bool used)
+{
+    block_bitmap[block_num] = used;
+    bitmap_dirty[block_num / BITS_PER_BLOCK] = true;
+}
+
+// File data goes straight to the image, ahead of the commit that allocates
+// its blocks. A block freed since the last commit must not take any: after
+// a crash the free would be undone and the old owner would see the new
+// data. Such a block stays pinned until the free is in the journal, so a
+// disk filled to the last block may report full until the next commit.
+void FileSystem::release_block(uint32_t block_num)
+{
+    mark_block(block_num, false);
+    block_pinned[block_num] = true;
+    pinned_blocks.push_back({cache.commit_ticket(), block_num});
+}
+
+// Called with alloc_mutex held, before a search for free blocks
+void FileSystem::unpin_committed()
+{
+    while (!pinned_blocks.empty() && cache.is_committed(pinned_blocks.front().first))
+    {
+        block_pinned[pinned_blocks.front().second] = false;
+        pinned_blocks.pop_front();
+    }
+}
+
+// Single blocks are handed out from a rotating start point, so callers
+// that allocate one block at a time do not rescan the full prefix
 uint32_t FileSystem::allocate_block()
 {
-    for (uint32_t i = 0; i < superblock.blocks_count; i++)
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    unpin_committed();
+    uint32_t block_num = next_free_block;
+    for (uint32_t n = 0; n < superblock.blocks_count; n++, block_num++)
     {
-        if (!block_bitmap[i])
+        if (block_num >= superblock.blocks_count)
+        {
+            block_num = 0;
+        }
+        if (!block_bitmap[block_num] && !block_pinned[block_num])
         {
-            block_bitmap[i] = true;
+            mark_block(block_num, true);
             superblock.free_blocks_count--;
             write_bitmap();
             write_superblock();
-            return i;
+            next_free_block = block_num + 1;
+            return block_num;
         }
     }
     return 0; // No free blocks
@@ -245,15 +528,30 @@ uint32_t FileSystem::allocate_block()
 
 void FileSystem::free_block(uint32_t block_num)
 {
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
     if (block_num < superblock.blocks_count && block_bitmap[block_num])
     {
-        block_bitmap[block_num] = false;
+        // A shared block only loses one of its owners
+        if (release_shared(block_num))
+        {
+            write_refcounts();
+            return;
+        }
+        if (in_transaction)
+        {
+            deferred_frees.push_back(block_num);
+            return;
+        }
+
+        release_block(block_num);
         superblock.free_blocks_count++;
         write_bitmap();
         write_superblock();
     }
 }
 
+// Inodes are read and written as single records, never as their whole
+// table block, so updates to neighbouring inodes cannot overwrite each other
 bool FileSystem::read_inode(uint32_t inode_num, Inode &inode)
 {
     if (inode_num == 0 || inode_num > superblock.inodes_count)
@@ -261,253 +559,2472 @@ bool FileSystem::read_inode(uint32_t inode_num, Inode &inode)
         return false;
     }
 
-    uint32_t inode_block = superblock.first_inode_block + (inode_num - 1) / INODES_PER_BLOCK;
-    uint32_t inode_offset = (inode_num - 1) % INODES_PER_BLOCK;
+    size_t offset = static_cast<size_t>(inode_num - 1) * INODE_SIZE;
+    return cache.read(superblock.first_inode_block + offset / BLOCK_SIZE, offset % BLOCK_SIZE, &inode, INODE_SIZE);
+}
 
-    char block_data[BLOCK_SIZE];
-    if (!read_block(inode_block, block_data))
+bool FileSystem::write_inode(uint32_t inode_num, const Inode &inode)
+{
+    if (inode_num == 0 || inode_num > superblock.inodes_count)
     {
-        memset(block_data, 0, BLOCK_SIZE);
+        return false;
     }
 
-    memcpy(&inode, block_data + inode_offset * INODE_SIZE, INODE_SIZE);
-
-    return true;
+    size_t offset = static_cast<size_t>(inode_num - 1) * INODE_SIZE;
+    return cache.write(superblock.first_inode_block + offset / BLOCK_SIZE, offset % BLOCK_SIZE, &inode, INODE_SIZE);
 }
 
-bool FileSystem::write_inode(uint32_t inode_num, const Inode &inode)
+// Reserves count blocks in a single pass over the bitmap. Contiguous free
+// space comes back as physically contiguous extents, and the bitmap and
+// superblock are written once for the whole reservation. On failure
+// nothing stays allocated.
+bool FileSystem::allocate_extents(uint32_t count, std::vector<uint32_t> &blocks)
 {
-    if (inode_num == 0 || inode_num > superblock.inodes_count)
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    blocks.clear();
+    if (count == 0)
+    {
+        return true;
+    }
+    if (count > superblock.free_blocks_count)
     {
         return false;
     }
 
-    uint32_t inode_block = superblock.first_inode_block + (inode_num - 1) / INODES_PER_BLOCK;
-    uint32_t inode_offset = (inode_num - 1) % INODES_PER_BLOCK;
+    blocks.reserve(count);
+    unpin_committed();
+    for (uint32_t i = 0; i < superblock.blocks_count && blocks.size() < count; i++)
+    {
+        if (!block_bitmap[i] && !block_pinned[i])
+        {
+            blocks.push_back(i);
+        }
+    }
 
-    char block_data[BLOCK_SIZE];
-    // Try to read the block; if it doesn't exist, zero it
-    if (!read_block(inode_block, block_data))
+    if (blocks.size() < count)
     {
-        memset(block_data, 0, BLOCK_SIZE);
+        blocks.clear();
+        return false;
     }
 
-    memcpy(block_data + inode_offset * INODE_SIZE, &inode, sizeof(Inode));
-    return write_block(inode_block, block_data);
+    for (uint32_t block_num : blocks)
+    {
+        mark_block(block_num, true);
+    }
+    superblock.free_blocks_count -= count;
+    write_bitmap();
+    write_superblock();
+    return true;
 }
 
-uint32_t FileSystem::allocate_inode()
+// Releases a batch of blocks with a single bitmap and superblock write
+void FileSystem::free_blocks(const std::vector<uint32_t> &blocks)
 {
-    // Start from 1 as inode 0 is invalid
-    for (uint32_t i = 1; i <= superblock.inodes_count; i++)
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    uint32_t freed = 0;
+    bool released = false;
+    for (uint32_t block_num : blocks)
     {
-        Inode inode;
-        if (read_inode(i, inode) && inode.links_count == 0)
+        if (block_num < superblock.blocks_count && block_bitmap[block_num])
         {
-            superblock.free_inodes_count--;
-            write_superblock();
-            return i;
+            if (release_shared(block_num))
+            {
+                released = true;
+                continue;
+            }
+            if (in_transaction)
+            {
+                deferred_frees.push_back(block_num);
+                continue;
+            }
+            release_block(block_num);
+            freed++;
         }
     }
-    return 0; // No free inodes
+
+    if (released)
+    {
+        write_refcounts();
+    }
+    if (freed > 0)
+    {
+        superblock.free_blocks_count += freed;
+        write_bitmap();
+        write_superblock();
+    }
 }
 
-void FileSystem::free_inode(uint32_t inode_num)
+// Reserves count physically contiguous blocks, first fit. Returns the
+// first block of the run, or 0 if no run is long enough.
+uint32_t FileSystem::allocate_run(uint32_t count)
 {
-    if (inode_num == 0 || inode_num > superblock.inodes_count)
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    if (count == 0 || count > superblock.free_blocks_count)
     {
-        return;
+        return 0;
     }
 
-    Inode inode;
-    if (read_inode(inode_num, inode))
+    uint32_t run_start = 0, run_length = 0;
+    unpin_committed();
+    for (uint32_t i = 0; i < superblock.blocks_count; i++)
     {
-        // Free data blocks
-        for (uint32_t i = 0; i < DIRECT_BLOCKS; i++)
+        if (block_bitmap[i] || block_pinned[i])
         {
-            if (inode.blocks[i] != 0)
-            {
-                free_block(inode.blocks[i]);
-                inode.blocks[i] = 0;
-            }
+            run_length = 0;
+            continue;
         }
-
-        // Handle indirect blocks if needed
-        if (inode.blocks[DIRECT_BLOCKS] != 0)
+        if (run_length == 0)
         {
-            uint32_t indirect_block = inode.blocks[DIRECT_BLOCKS];
-            uint32_t indirect_pointers[BLOCK_SIZE / sizeof(uint32_t)];
-
-            if (read_block(indirect_block, indirect_pointers))
+            run_start = i;
+        }
+        if (++run_length == count)
+        {
+            for (uint32_t b = run_start; b < run_start + count; b++)
             {
-                for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); i++)
-                {
-                    if (indirect_pointers[i] != 0)
-                    {
-                        free_block(indirect_pointers[i]);
-                    }
-                }
+                mark_block(b, true);
             }
-
-            free_block(indirect_block);
-            inode.blocks[DIRECT_BLOCKS] = 0;
+            superblock.free_blocks_count -= count;
+            write_bitmap();
+            write_superblock();
+            return run_start;
         }
-
-        inode.links_count = 0;
-        inode.size = 0;
-        inode.mode = 0;
-
-        write_inode(inode_num, inode);
-        superblock.free_inodes_count++;
-        write_superblock();
     }
+    return 0;
 }
 
-std::string FileSystem::get_absolute_path(const std::string &path)
+// The reference table stores one uint16_t per block: how many owners the
+// block has besides the first. Images without shared blocks have no table.
+bool FileSystem::read_refcounts()
 {
-    std::string abs_path = path;
-
-    // Normalize path
-    if (abs_path.empty() || abs_path[0] != '/')
+    block_refs.clear();
+    refs_dirty.clear();
+    if (superblock.refcount_block == 0)
     {
-        abs_path = "/" + abs_path;
+        return true;
     }
 
-    // Remove trailing slash if it's not the root
-    if (abs_path.length() > 1 && abs_path.back() == '/')
+    block_refs.assign(superblock.refcount_blocks * (BLOCK_SIZE / sizeof(uint16_t)), 0);
+    refs_dirty.assign(superblock.refcount_blocks, false);
+    for (uint32_t b = 0; b < superblock.refcount_blocks; b++)
     {
-        abs_path.pop_back();
+        if (!read_block(superblock.refcount_block + b, &block_refs[b * (BLOCK_SIZE / sizeof(uint16_t))]))
+        {
+            return false;
+        }
     }
-
-    return abs_path;
+    block_refs.resize(superblock.blocks_count);
+    return true;
 }
 
-uint32_t FileSystem::find_inode_by_path(const std::string &path)
+// Writes back the reference table blocks touched since the last write
+bool FileSystem::write_refcounts()
 {
-    std::string abs_path = get_absolute_path(path);
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    const size_t per_block = BLOCK_SIZE / sizeof(uint16_t);
+    bool result = true;
 
-    // Root directory is special case
-    if (abs_path == "/")
+    for (uint32_t b = 0; b < refs_dirty.size(); b++)
     {
-        return 1; // Root inode
-    }
+        if (!refs_dirty[b])
+        {
+            continue;
+        }
 
-    // Start from root directory
-    uint32_t current_inode = 1;
+        uint16_t table_data[per_block] = {0};
+        size_t first = b * per_block;
+        size_t count = std::min(per_block, block_refs.size() - first);
+        memcpy(table_data, &block_refs[first], count * sizeof(uint16_t));
 
-    // Split path into components
-    std::vector<std::string> components;
-    std::string component;
-    for (size_t i = 1; i < abs_path.length(); i++)
-    {
-        if (abs_path[i] == '/')
+        if (write_block(superblock.refcount_block + b, table_data))
         {
-            if (!component.empty())
-            {
-                components.push_back(component);
-                component.clear();
-            }
+            refs_dirty[b] = false;
         }
         else
         {
-            component += abs_path[i];
+            result = false;
         }
     }
-    if (!component.empty())
-    {
-        components.push_back(component);
+
+    return result;
+}
+
+// Creates the reference table the first time a block is shared
+bool FileSystem::ensure_refcount_table()
+{
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    if (superblock.refcount_block != 0)
+    {
+        return true;
+    }
+
+    uint32_t table_blocks = (superblock.blocks_count * sizeof(uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t table_start = allocate_run(table_blocks);
+    if (table_start == 0)
+    {
+        return false;
+    }
+
+    superblock.refcount_block = table_start;
+    superblock.refcount_blocks = table_blocks;
+    block_refs.assign(superblock.blocks_count, 0);
+    refs_dirty.assign(table_blocks, true);
+    write_refcounts();
+    write_superblock();
+    return true;
+}
+
+// Adds an owner to an allocated block. Fails when the count would overflow,
+// in which case the caller copies the block instead.
+bool FileSystem::share_block(uint32_t block_num)
+{
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    if (block_refs.empty() || block_num >= superblock.blocks_count ||
+        !block_bitmap[block_num] || block_refs[block_num] == UINT16_MAX)
+    {
+        return false;
+    }
+
+    block_refs[block_num]++;
+    refs_dirty[block_num / (BLOCK_SIZE / sizeof(uint16_t))] = true;
+    return true;
+}
+
+// Drops one owner of a shared block. Returns false if the block has a single
+// owner, which means the caller should really free it.
+bool FileSystem::release_shared(uint32_t block_num)
+{
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    if (block_refs.empty() || block_refs[block_num] == 0)
+    {
+        return false;
+    }
+
+    block_refs[block_num]--;
+    refs_dirty[block_num / (BLOCK_SIZE / sizeof(uint16_t))] = true;
+    return true;
+}
+
+// Returns a block that may be modified in place on behalf of one owner.
+// Unshared blocks come back unchanged; a shared block is copied to a fresh
+// block and the caller's reference moves to the copy. Returns 0 on failure.
+uint32_t FileSystem::make_block_private(uint32_t block_num)
+{
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    if (block_refs.empty() || block_refs[block_num] == 0)
+    {
+        return block_num;
+    }
+
+    char block_data[BLOCK_SIZE];
+    if (!read_block(block_num, block_data))
+    {
+        return 0;
+    }
+
+    uint32_t copy = allocate_block();
+    if (copy == 0)
+    {
+        return 0;
+    }
+    if (!write_block(copy, block_data))
+    {
+        free_block(copy);
+        return 0;
+    }
+
+    release_shared(block_num);
+    write_refcounts();
+    return copy;
+}
+
+// Fills the blocks reserved by prepare_import from src_fd. Ranges the host
+// reports as holes (SEEK_DATA / SEEK_HOLE) are not read at all. Data ranges
+// are scanned in IMPORT_BUFFER_SIZE chunks, and all-zero blocks the host did
+// write are left out too. Each contiguous run of non-zero blocks is moved
+// with copy_file_range, so the kernel can share or copy it without another
+// write from here; if the kernel refuses, the scanned chunk is written
+// instead. Left-out blocks are set to 0 in blocks and collected in skipped,
+// for commit_holes to unmap afterwards. Only the reserved blocks are
+// written, so imports into disjoint blocks may run concurrently.
+bool FileSystem::import_data(int src_fd, size_t size, std::vector<uint32_t> &blocks, std::vector<uint32_t> &skipped)
+{
+    const size_t chunk_blocks = IMPORT_BUFFER_SIZE / BLOCK_SIZE;
+    std::vector<char> buffer(std::min(chunk_blocks, blocks.size()) * BLOCK_SIZE);
+    std::vector<char> zero(chunk_blocks);
+    bool zero_copy = true;
+
+    auto skip = [&](size_t i)
+    {
+        skipped.push_back(blocks[i]);
+        blocks[i] = 0;
+    };
+
+    // Writes run blocks starting at block first, whose contents are at data
+    auto write_run = [&](size_t first, size_t run, const char *data)
+    {
+        if (zero_copy)
+        {
+            size_t offset = first * BLOCK_SIZE;
+            bool refused;
+            if (cache.copy_blocks(src_fd, offset, std::min(run * BLOCK_SIZE, size - offset), blocks[first], refused))
+            {
+                return true;
+            }
+            if (!refused)
+            {
+                return false;
+            }
+            zero_copy = false;
+        }
+        return cache.write_blocks(blocks[first], run, data);
+    };
+
+    // Scans blocks [i, end) through buffer and writes the non-zero ones
+    auto import_range = [&](size_t i, size_t end)
+    {
+        while (i < end)
+        {
+            size_t count = std::min(chunk_blocks, end - i);
+            size_t offset = i * BLOCK_SIZE;
+            size_t length = std::min(count * BLOCK_SIZE, size - offset);
+
+            if (!read_fully(src_fd, buffer.data(), length, offset))
+            {
+                return false;
+            }
+            // Pad the final partial block with zeros
+            memset(buffer.data() + length, 0, count * BLOCK_SIZE - length);
+
+            for (size_t j = 0; j < count; j++)
+            {
+                zero[j] = block_is_zero(buffer.data() + j * BLOCK_SIZE);
+            }
+
+            size_t j = 0;
+            while (j < count)
+            {
+                if (zero[j])
+                {
+                    skip(i + j);
+                    j++;
+                    continue;
+                }
+
+                size_t run = 1;
+                while (j + run < count && !zero[j + run] && blocks[i + j + run] == blocks[i + j] + run)
+                {
+                    run++;
+                }
+
+                if (!write_run(i + j, run, buffer.data() + j * BLOCK_SIZE))
+                {
+                    return false;
+                }
+                j += run;
+            }
+
+            i += count;
+        }
+        return true;
+    };
+
+    size_t i = 0;
+    while (i < blocks.size())
+    {
+        // Jump over host holes without reading them; without SEEK_DATA
+        // support everything counts as data
+        off_t data = lseek(src_fd, static_cast<off_t>(i) * BLOCK_SIZE, SEEK_DATA);
+        size_t hole_end = i;
+        if (data < 0 && errno == ENXIO)
+        {
+            hole_end = blocks.size(); // A hole up to the end, partial last block included
+        }
+        else if (data >= 0)
+        {
+            hole_end = data / BLOCK_SIZE;
+        }
+        for (; i < hole_end && i < blocks.size(); i++)
+        {
+            skip(i);
+        }
+        if (i >= blocks.size())
+        {
+            break;
+        }
+
+        off_t hole = lseek(src_fd, static_cast<off_t>(i) * BLOCK_SIZE, SEEK_HOLE);
+        size_t data_end = hole < 0 ? size : std::min(static_cast<size_t>(hole), size);
+        size_t end_block = std::max(i + 1, std::min(blocks.size(), (data_end + BLOCK_SIZE - 1) / BLOCK_SIZE));
+
+        if (!import_range(i, end_block))
+        {
+            return false;
+        }
+        i = end_block;
+    }
+
+    return true;
+}
+
+// Unmaps the blocks an import left out and returns them to the free pool
+bool FileSystem::commit_holes(uint32_t inode_num, const std::vector<uint32_t> &blocks, const std::vector<uint32_t> &skipped)
+{
+    if (skipped.empty())
+    {
+        return true;
+    }
+
+    Inode inode;
+    if (!read_inode(inode_num, inode) || !store_block_map(inode, blocks))
+    {
+        return false;
+    }
+
+    write_inode(inode_num, inode);
+    free_blocks(skipped);
+    return true;
+}
+
+bool FileSystem::read_dedup_index()
+{
+    dedup_index.clear();
+    dedup_dirty.clear();
+    if (superblock.dedup_block == 0)
+    {
+        return true;
+    }
+
+    dedup_index.resize(superblock.dedup_blocks * DEDUP_SLOTS_PER_BLOCK);
+    dedup_dirty.assign(superblock.dedup_blocks, false);
+    for (uint32_t b = 0; b < superblock.dedup_blocks; b++)
+    {
+        if (!read_block(superblock.dedup_block + b, &dedup_index[b * DEDUP_SLOTS_PER_BLOCK]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Writes back the index blocks touched since the last write
+bool FileSystem::write_dedup_index()
+{
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    bool result = true;
+
+    for (uint32_t b = 0; b < dedup_dirty.size(); b++)
+    {
+        if (!dedup_dirty[b])
+        {
+            continue;
+        }
+        if (write_block(superblock.dedup_block + b, &dedup_index[b * DEDUP_SLOTS_PER_BLOCK]))
+        {
+            dedup_dirty[b] = false;
+        }
+        else
+        {
+            result = false;
+        }
+    }
+
+    return result;
+}
+
+// Creates the content-hash index the first time a deduplicating import
+// runs. It has a power-of-two number of slots, at least one per block.
+bool FileSystem::ensure_dedup_index()
+{
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    if (superblock.dedup_block != 0)
+    {
+        return true;
+    }
+
+    uint32_t slots = DEDUP_SLOTS_PER_BLOCK;
+    while (slots < superblock.blocks_count)
+    {
+        slots *= 2;
+    }
+
+    uint32_t index_blocks = slots / DEDUP_SLOTS_PER_BLOCK;
+    uint32_t index_start = allocate_run(index_blocks);
+    if (index_start == 0)
+    {
+        return false;
+    }
+
+    superblock.dedup_block = index_start;
+    superblock.dedup_blocks = index_blocks;
+    dedup_index.assign(slots, DedupSlot());
+    dedup_dirty.assign(index_blocks, true);
+    write_dedup_index();
+    write_superblock();
+    return true;
+}
+
+// Finds a live block whose content equals block_data. Index entries are
+// only hints: the block must still be allocated and compare equal, since
+// blocks are freed and rewritten without consulting the index.
+uint32_t FileSystem::dedup_lookup(uint64_t hash, const char *block_data)
+{
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    size_t mask = dedup_index.size() - 1;
+    for (size_t probe = 0; probe < DEDUP_PROBE_LIMIT; probe++)
+    {
+        const DedupSlot &slot = dedup_index[(hash + probe) & mask];
+        if (slot.block == 0)
+        {
+            return 0;
+        }
+        if (slot.hash != hash || slot.block >= superblock.blocks_count || !block_bitmap[slot.block])
+        {
+            continue;
+        }
+
+        char existing[BLOCK_SIZE];
+        if (cache.read_blocks(slot.block, 1, existing) &&
+            memcmp(existing, block_data, BLOCK_SIZE) == 0)
+        {
+            return slot.block;
+        }
+    }
+    return 0;
+}
+
+// Records hash -> block. Prefers an empty slot or one whose block has been
+// freed; when the probe window is full the home slot is overwritten.
+void FileSystem::dedup_insert(uint64_t hash, uint32_t block_num)
+{
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    size_t mask = dedup_index.size() - 1;
+    size_t target = hash & mask;
+    for (size_t probe = 0; probe < DEDUP_PROBE_LIMIT; probe++)
+    {
+        size_t index = (hash + probe) & mask;
+        const DedupSlot &slot = dedup_index[index];
+        if (slot.block == 0 || slot.block >= superblock.blocks_count || !block_bitmap[slot.block] ||
+            slot.block == block_num)
+        {
+            target = index;
+            break;
+        }
+    }
+
+    dedup_index[target].hash = hash;
+    dedup_index[target].block = block_num;
+    dedup_dirty[target / DEDUP_SLOTS_PER_BLOCK] = true;
+}
+
+uint32_t FileSystem::allocate_inode()
+{
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    if (superblock.free_inodes_count == 0)
+    {
+        return 0;
+    }
+
+    // Scan the inode table a block at a time, resuming after the last
+    // allocation so bulk creates do not rescan the used prefix every time
+    char block_data[BLOCK_SIZE];
+    uint32_t loaded_block = 0;
+    uint32_t inode_num = next_free_inode;
+
+    for (uint32_t n = 0; n < superblock.inodes_count; n++)
+    {
+        if (inode_num == 0 || inode_num > superblock.inodes_count)
+        {
+            inode_num = 1; // Inode 0 is invalid
+        }
+
+        uint32_t inode_block = superblock.first_inode_block + (inode_num - 1) / INODES_PER_BLOCK;
+        if (inode_block != loaded_block)
+        {
+            if (!read_block(inode_block, block_data))
+            {
+                return 0;
+            }
+            loaded_block = inode_block;
+        }
+
+        const Inode *inode = reinterpret_cast<const Inode *>(
+            block_data + ((inode_num - 1) % INODES_PER_BLOCK) * INODE_SIZE);
+        if (inode->links_count == 0)
+        {
+            // Claim it right away, so a concurrent search skips it
+            Inode claimed;
+            claimed.links_count = 1;
+            if (!write_inode(inode_num, claimed))
+            {
+                return 0;
+            }
+            superblock.free_inodes_count--;
+            write_superblock();
+            next_free_inode = inode_num + 1;
+            return inode_num;
+        }
+
+        inode_num++;
+    }
+    return 0; // No free inodes
+}
+
+void FileSystem::free_inode(uint32_t inode_num)
+{
+    if (inode_num == 0 || inode_num > superblock.inodes_count)
+    {
+        return;
+    }
+
+    Inode inode;
+    if (read_inode(inode_num, inode))
+    {
+        // Free data blocks
+        for (uint32_t i = 0; i < DIRECT_BLOCKS; i++)
+        {
+            if (inode.blocks[i] != 0)
+            {
+                free_block(inode.blocks[i]);
+                inode.blocks[i] = 0;
+            }
+        }
+
+        // Handle indirect blocks if needed
+        if (inode.blocks[DIRECT_BLOCKS] != 0)
+        {
+            uint32_t indirect_block = inode.blocks[DIRECT_BLOCKS];
+            uint32_t indirect_pointers[BLOCK_SIZE / sizeof(uint32_t)];
+
+            if (read_block(indirect_block, indirect_pointers))
+            {
+                for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t); i++)
+                {
+                    if (indirect_pointers[i] != 0)
+                    {
+                        free_block(indirect_pointers[i]);
+                    }
+                }
+            }
+
+            free_block(indirect_block);
+            inode.blocks[DIRECT_BLOCKS] = 0;
+        }
+
+        if (inode.cluster_map != 0)
+        {
+            free_block(inode.cluster_map);
+            inode.cluster_map = 0;
+            inode.flags &= ~INODE_FLAG_COMPRESSED;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(symlink_mutex);
+            symlink_targets.erase(inode_num);
+        }
+
+        inode.links_count = 0;
+        inode.size = 0;
+        inode.mode = 0;
+        inode.flags = 0;
+
+        std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+        write_inode(inode_num, inode);
+        superblock.free_inodes_count++;
+        write_superblock();
+    }
+}
+
+std::string FileSystem::get_absolute_path(const std::string &path)
+{
+    std::string abs_path = path;
+
+    // Normalize path
+    if (abs_path.empty() || abs_path[0] != '/')
+    {
+        abs_path = "/" + abs_path;
+    }
+
+    // Remove trailing slash if it's not the root
+    if (abs_path.length() > 1 && abs_path.back() == '/')
+    {
+        abs_path.pop_back();
+    }
+
+    return abs_path;
+}
+
+// Walks path from the root. Symlinks met along the way are followed, the
+// last component only when follow_last is set; more than
+// MAX_SYMLINK_FOLLOWS expansions in one lookup is taken to be a loop.
+uint32_t FileSystem::find_inode_by_path(const std::string &path, bool follow_last)
+{
+    std::string abs_path = get_absolute_path(path);
+
+    // Root directory is special case
+    if (abs_path == "/")
+    {
+        return root_inode;
+    }
+
+    // Components still to visit, the next one at the back
+    std::vector<std::string> pending;
+    auto push_components = [&pending](const std::string &p)
+    {
+        std::vector<std::string> components;
+        std::string component;
+        for (char c : p)
+        {
+            if (c == '/')
+            {
+                if (!component.empty())
+                {
+                    components.push_back(component);
+                    component.clear();
+                }
+            }
+            else
+            {
+                component += c;
+            }
+        }
+        if (!component.empty())
+        {
+            components.push_back(component);
+        }
+        pending.insert(pending.end(), components.rbegin(), components.rend());
+    };
+    push_components(abs_path);
+
+    // Start from root directory
+    uint32_t current_inode = root_inode;
+    uint32_t follows = 0;
+
+    // Traverse the directory tree
+    while (!pending.empty())
+    {
+        std::string comp = std::move(pending.back());
+        pending.pop_back();
+
+        // The directory cannot change while it is being scanned
+        uint32_t next_inode = 0;
+        if (read_only)
+        {
+            const DirIndex *index = get_dir_index(current_inode);
+            if (index == nullptr)
+            {
+                return 0;
+            }
+            auto found = index->find(comp);
+            next_inode = found == index->end() ? 0 : found->second;
+        }
+        else
+        {
+            std::shared_lock<std::shared_mutex> lock(inode_lock(current_inode));
+            Inode inode;
+            if (!read_inode(current_inode, inode))
+            {
+                return 0;
+            }
+
+            // Check if the current inode is a directory
+            if (static_cast<FileType>(inode.mode) != FileType::DIRECTORY)
+            {
+                return 0;
+            }
+
+            // Look for the component in the directory
+            for (uint32_t i = 0; i < DIRECT_BLOCKS && inode.blocks[i] != 0 && next_inode == 0; i++)
+            {
+                char block_data[BLOCK_SIZE];
+                if (!read_block(inode.blocks[i], block_data))
+                {
+                    continue;
+                }
+
+                // Scan directory entries
+                char *ptr = block_data;
+                while (ptr < block_data + BLOCK_SIZE)
+                {
+                    DirEntry *entry = reinterpret_cast<DirEntry *>(ptr);
+                    if (entry->rec_len == 0)
+                    {
+                        break;
+                    }
+                    if (entry->inode != 0 && comp.length() == entry->name_len &&
+                        strncmp(entry->name, comp.c_str(), entry->name_len) == 0)
+                    {
+                        next_inode = entry->inode;
+                        break;
+                    }
+
+                    ptr += entry->rec_len;
+                }
+            }
+        }
+
+        if (next_inode == 0)
+        {
+            return 0; // Component not found
+        }
+
+        Inode next;
+        if ((follow_last || !pending.empty()) && read_inode(next_inode, next) &&
+            static_cast<FileType>(next.mode) == FileType::SYMLINK)
+        {
+            // Splice the target in front of what is left; relative targets
+            // resolve from the directory holding the link
+            std::string target;
+            if (++follows > MAX_SYMLINK_FOLLOWS || !read_symlink_target(next_inode, next, target))
+            {
+                return 0;
+            }
+            if (target[0] == '/')
+            {
+                current_inode = root_inode;
+            }
+            push_components(target);
+            continue;
+        }
+
+        current_inode = next_inode;
+    }
+
+    return current_inode;
+}
+
+// Target of a symlink inode, from the cache when it has been read before
+bool FileSystem::read_symlink_target(uint32_t inode_num, const Inode &inode, std::string &target)
+{
+    // Read-only mounts skip the cache and its mutex; the target is in the
+    // inode or one block away
+    if (!read_only)
+    {
+        std::lock_guard<std::mutex> lock(symlink_mutex);
+        auto cached = symlink_targets.find(inode_num);
+        if (cached != symlink_targets.end())
+        {
+            target = cached->second;
+            return true;
+        }
+    }
+
+    if (inode.size == 0 || inode.size >= BLOCK_SIZE)
+    {
+        return false;
+    }
+
+    if (inode.flags & INODE_FLAG_INLINE)
+    {
+        target.assign(reinterpret_cast<const char *>(inode.reserved), inode.size);
+    }
+    else
+    {
+        char block_data[BLOCK_SIZE];
+        if (inode.blocks[0] == 0 || !read_block(inode.blocks[0], block_data))
+        {
+            return false;
+        }
+        target.assign(block_data, inode.size);
+    }
+
+    if (read_only)
+    {
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(symlink_mutex);
+    symlink_targets[inode_num] = target;
+    return true;
+}
+
+// Creates link_path as a symlink to target. Targets of up to
+// INLINE_SYMLINK_MAX bytes live in the inode itself; longer ones take a
+// data block.
+bool FileSystem::create_symlink(const std::string &target, const std::string &link_path)
+{
+    if (read_only)
+    {
+        return false;
+    }
+
+    CacheOp op(cache);
+
+    if (target.empty() || target.length() >= BLOCK_SIZE)
+    {
+        return false;
+    }
+
+    uint32_t inode_num = allocate_inode();
+    if (inode_num == 0)
+    {
+        return false;
+    }
+
+    Inode inode;
+    inode.mode = static_cast<uint32_t>(FileType::SYMLINK);
+    inode.links_count = 1;
+    inode.size = target.length();
+
+    if (target.length() <= INLINE_SYMLINK_MAX)
+    {
+        memcpy(inode.reserved, target.data(), target.length());
+        inode.flags |= INODE_FLAG_INLINE;
+    }
+    else
+    {
+        char block_data[BLOCK_SIZE] = {0};
+        memcpy(block_data, target.data(), target.length());
+        inode.blocks[0] = allocate_block();
+        if (inode.blocks[0] == 0 || !write_block(inode.blocks[0], block_data))
+        {
+            write_inode(inode_num, inode);
+            free_inode(inode_num);
+            return false;
+        }
+    }
+
+    // The link is complete before it shows up in its directory
+    if (!write_inode(inode_num, inode) || !publish_inode(link_path, inode_num, FileType::SYMLINK))
+    {
+        free_inode(inode_num);
+        return false;
+    }
+    return true;
+}
+
+bool FileSystem::read_link(const std::string &path, std::string &target)
+{
+    uint32_t inode_num = find_inode_by_path(path, false);
+    if (inode_num == 0)
+    {
+        return false;
+    }
+
+    std::shared_lock<std::shared_mutex> lock = read_lock(inode_num);
+    Inode inode;
+    return read_inode(inode_num, inode) &&
+           static_cast<FileType>(inode.mode) == FileType::SYMLINK &&
+           read_symlink_target(inode_num, inode, target);
+}
+
+// Locks the given inodes exclusively. The locks are taken in stripe order,
+// each stripe once, so operations locking overlapping sets cannot deadlock.
+// Inode 0 stands for "none" and is skipped.
+std::vector<std::unique_lock<std::shared_mutex>> FileSystem::lock_inodes(std::vector<uint32_t> inode_nums)
+{
+    std::vector<size_t> stripes;
+    for (uint32_t inode_num : inode_nums)
+    {
+        if (inode_num != 0)
+        {
+            stripes.push_back(inode_num % INODE_LOCK_STRIPES);
+        }
+    }
+    std::sort(stripes.begin(), stripes.end());
+    stripes.erase(std::unique(stripes.begin(), stripes.end()), stripes.end());
+
+    std::vector<std::unique_lock<std::shared_mutex>> locks;
+    for (size_t stripe : stripes)
+    {
+        locks.emplace_back(inode_locks[stripe]);
+    }
+    return locks;
+}
+
+// Shared lock on an inode for a reader; empty under a read-only mount
+std::shared_lock<std::shared_mutex> FileSystem::read_lock(uint32_t inode_num)
+{
+    if (read_only)
+    {
+        return std::shared_lock<std::shared_mutex>();
+    }
+    return std::shared_lock<std::shared_mutex>(inode_lock(inode_num));
+}
+
+// Index of a directory under a read-only mount, built the first time it is
+// needed. Threads that race to build the same index all scan the directory;
+// the first to publish wins and the others drop their copy. Returns null
+// if the inode is not a directory.
+const DirIndex *FileSystem::get_dir_index(uint32_t dir_inode_num)
+{
+    if (dir_inode_num == 0 || dir_inode_num > superblock.inodes_count)
+    {
+        return nullptr;
+    }
+
+    const DirIndex *index = dir_indexes[dir_inode_num].load(std::memory_order_acquire);
+    if (index != nullptr)
+    {
+        return index;
+    }
+
+    Inode dir_inode;
+    if (!read_inode(dir_inode_num, dir_inode) || static_cast<FileType>(dir_inode.mode) != FileType::DIRECTORY)
+    {
+        return nullptr;
+    }
+
+    // . and .. are kept, lookups walk through them
+    DirIndex *built = new DirIndex();
+    for (uint32_t i = 0; i < DIRECT_BLOCKS && dir_inode.blocks[i] != 0; i++)
+    {
+        char block_data[BLOCK_SIZE];
+        if (!read_block(dir_inode.blocks[i], block_data))
+        {
+            delete built;
+            return nullptr;
+        }
+
+        char *ptr = block_data;
+        while (ptr + offsetof(DirEntry, name) <= block_data + BLOCK_SIZE)
+        {
+            DirEntry *entry = reinterpret_cast<DirEntry *>(ptr);
+            if (entry->rec_len == 0 ||
+                ptr + offsetof(DirEntry, name) + entry->name_len > block_data + BLOCK_SIZE)
+            {
+                break;
+            }
+            if (entry->inode != 0)
+            {
+                built->emplace(std::string(entry->name, entry->name_len), entry->inode);
+            }
+            ptr += entry->rec_len;
+        }
+    }
+
+    if (dir_indexes[dir_inode_num].compare_exchange_strong(index, built, std::memory_order_acq_rel))
+    {
+        return built;
+    }
+    delete built;
+    return index;
+}
+
+// Resolves the directory holding path; name receives the last component
+uint32_t FileSystem::find_parent(const std::string &path, std::string &name)
+{
+    std::string abs_path = get_absolute_path(path);
+    size_t pos = abs_path.find_last_of('/');
+    name = abs_path.substr(pos + 1);
+    return find_inode_by_path(pos == 0 ? "/" : abs_path.substr(0, pos));
+}
+
+// Adds name -> inode_num to a directory under the directory's lock. Fails
+// if the name is taken or the directory was removed after it was looked up.
+bool FileSystem::link_inode(uint32_t dir_inode_num, const std::string &name, uint32_t inode_num, FileType type)
+{
+    std::unique_lock<std::shared_mutex> lock(inode_lock(dir_inode_num));
+
+    Inode dir_inode;
+    uint32_t block_index, offset;
+    return name != "." && name != ".." && read_inode(dir_inode_num, dir_inode) && dir_inode.links_count != 0 &&
+           static_cast<FileType>(dir_inode.mode) == FileType::DIRECTORY &&
+           !find_dir_entry(dir_inode, name, block_index, offset) &&
+           add_dir_entry(dir_inode_num, name, inode_num, type);
+}
+
+// Links a new inode at path. New inodes are filled in before this is
+// called: nothing can reach them until then, so that needs no locks.
+bool FileSystem::publish_inode(const std::string &path, uint32_t inode_num, FileType type)
+{
+    std::string name;
+    uint32_t parent_inode_num = find_parent(path, name);
+    return parent_inode_num != 0 && link_inode(parent_inode_num, name, inode_num, type);
+}
+
+uint32_t FileSystem::create_file(const std::string &parent_path, const std::string &name, FileType type)
+{
+    if (read_only)
+    {
+        return 0;
+    }
+
+    // Find parent directory
+    uint32_t parent_inode_num = find_inode_by_path(parent_path);
+
+    // Names must fit the 255-byte entry name field
+    if (parent_inode_num == 0 || name.empty() || name.length() > 255)
+    {
+        return 0;
+    }
+
+    // Allocate new inode
+    uint32_t new_inode_num = allocate_inode();
+    if (new_inode_num == 0)
+    {
+        return 0;
+    }
+
+    // Initialize new inode
+    Inode new_inode;
+    new_inode.mode = static_cast<uint32_t>(type);
+    new_inode.links_count = 1;
+
+    if (type == FileType::DIRECTORY)
+    {
+        // Allocate a block for directory
+        uint32_t dir_block = allocate_block();
+        if (dir_block == 0)
+        {
+            free_inode(new_inode_num);
+            return 0;
+        }
+
+        new_inode.blocks[0] = dir_block;
+
+        // Set up directory entries (. and ..)
+        char dir_data[BLOCK_SIZE] = {0};
+        DirEntry *entries = reinterpret_cast<DirEntry *>(dir_data);
+        entries[0].inode = new_inode_num;
+        entries[0].rec_len = sizeof(DirEntry);
+        entries[0].name_len = 1;
+        entries[0].file_type = static_cast<uint8_t>(FileType::DIRECTORY);
+        strcpy(entries[0].name, ".");
+
+        entries[1].inode = parent_inode_num;
+        entries[1].rec_len = sizeof(DirEntry);
+        entries[1].name_len = 2;
+        entries[1].file_type = static_cast<uint8_t>(FileType::DIRECTORY);
+        strcpy(entries[1].name, "..");
+
+        // Write directory entries
+        write_block(dir_block, dir_data);
+    }
+
+    // Write new inode
+    write_inode(new_inode_num, new_inode);
+
+    // Add entry to parent directory, which makes the inode visible
+    if (!link_inode(parent_inode_num, name, new_inode_num, type))
+    {
+        free_inode(new_inode_num);
+        return 0;
+    }
+
+    return new_inode_num;
+}
+
+bool FileSystem::create_directory(const std::string &path)
+{
+    CacheOp op(cache);
+
+    // Get the parent path and name of the directory
+    std::string abs_path = get_absolute_path(path);
+    size_t pos = abs_path.find_last_of('/');
+    std::string parent_path, name;
+
+    if (pos == 0)
+    {
+        parent_path = "/";
+        name = abs_path.substr(1);
+    }
+    else
+    {
+        parent_path = abs_path.substr(0, pos);
+        name = abs_path.substr(pos + 1);
+    }
+
+    uint32_t inode_num = create_file(parent_path, name, FileType::DIRECTORY);
+    return inode_num != 0;
+}
+
+bool FileSystem::create_file(const std::string &path)
+{
+    CacheOp op(cache);
+
+    std::string abs_path = get_absolute_path(path);
+    size_t pos = abs_path.find_last_of('/');
+    std::string parent_path = pos == 0 ? "/" : abs_path.substr(0, pos);
+
+    return create_file(parent_path, abs_path.substr(pos + 1), FileType::REGULAR) != 0;
+}
+
+bool FileSystem::remove_directory(const std::string &path)
+{
+    if (read_only)
+    {
+        return false;
+    }
+
+    CacheOp op(cache);
+
+    std::string name;
+    uint32_t dir_inode_num = find_inode_by_path(path, false);
+    uint32_t parent_inode_num = find_parent(path, name);
+    if (dir_inode_num <= 1 || parent_inode_num == 0 || name == "." || name == "..")
+    {
+        return false;
+    }
+
+    auto locks = lock_inodes({parent_inode_num, dir_inode_num});
+
+    // Read directory inode
+    Inode dir_inode, parent_inode;
+    if (!read_inode(dir_inode_num, dir_inode) || !read_inode(parent_inode_num, parent_inode))
+    {
+        return false;
+    }
+
+    // Check if it's a directory
+    if (static_cast<FileType>(dir_inode.mode) != FileType::DIRECTORY)
+    {
+        return false;
+    }
+
+    // Check if directory is empty (except for . and ..)
+    std::vector<std::pair<std::string, uint32_t>> entries;
+    if (!read_dir_entries(dir_inode, entries) || !entries.empty())
+    {
+        return false;
+    }
+
+    // Remove directory entry from parent, if it still names this directory
+    uint32_t block_index, offset, entry_inode;
+    if (!find_dir_entry(parent_inode, name, block_index, offset, &entry_inode) || entry_inode != dir_inode_num ||
+        !set_dir_entry(parent_inode, block_index, offset, 0, FileType::DIRECTORY))
+    {
+        return false;
+    }
+
+    // Free the directory's inode and blocks
+    free_inode(dir_inode_num);
+
+    return true;
+}
+
+bool FileSystem::copy_to_system(const std::string &virt_path, const std::string &sys_path)
+{
+    uint32_t file_inode_num = find_inode_by_path(virt_path);
+    if (file_inode_num == 0)
+    {
+        return false;
+    }
+
+    std::shared_lock<std::shared_mutex> lock = read_lock(file_inode_num);
+    Inode file_inode;
+    if (!read_inode(file_inode_num, file_inode))
+    {
+        return false;
+    }
+
+    // Check if it's a regular file
+    if (static_cast<FileType>(file_inode.mode) != FileType::REGULAR)
+    {
+        return false;
+    }
+
+    std::vector<uint32_t> map, lengths;
+    if (!load_block_map(file_inode, map) || !read_cluster_map(file_inode, lengths))
+    {
+        return false;
+    }
+
+    // Open system file for writing
+    int sys_fd = open(sys_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (sys_fd < 0)
+    {
+        return false;
+    }
+
+    bool ok = true;
+    if (file_inode.flags & INODE_FLAG_COMPRESSED)
+    {
+        // Compressed files are written out cluster by cluster
+        char cluster_data[CLUSTER_SIZE];
+        for (uint32_t c = 0; ok && c < lengths.size(); c++)
+        {
+            size_t offset = static_cast<size_t>(c) * CLUSTER_SIZE;
+            ok = read_cluster(file_inode, map, lengths, c, cluster_data) &&
+                 write_fully(sys_fd, cluster_data, std::min(CLUSTER_SIZE, file_inode.size - offset), offset);
+        }
+    }
+    else
+    {
+        // Data is read one contiguous run at a time and written at its
+        // offset; holes are skipped and come back as holes on the host
+        std::vector<char> buffer;
+        for (uint32_t i = 0; ok && i < map.size();)
+        {
+            if (map[i] == 0)
+            {
+                i++;
+                continue;
+            }
+
+            uint32_t run = 1;
+            while (i + run < map.size() && map[i + run] == map[i] + run && run < IMPORT_BUFFER_SIZE / BLOCK_SIZE)
+            {
+                run++;
+            }
+
+            size_t offset = static_cast<size_t>(i) * BLOCK_SIZE;
+            buffer.resize(static_cast<size_t>(run) * BLOCK_SIZE);
+            ok = cache.read_blocks(map[i], run, buffer.data()) &&
+                 write_fully(sys_fd, buffer.data(), std::min(buffer.size(), file_inode.size - offset), offset);
+            i += run;
+        }
+    }
+
+    // A trailing hole only exists through the size
+    ok = ok && ftruncate(sys_fd, file_inode.size) == 0;
+    close(sys_fd);
+    return ok;
+}
+
+// Whole contents of a regular file; holes read as zeros
+bool FileSystem::read_file(const std::string &path, std::vector<char> &data)
+{
+    uint32_t file_inode_num = find_inode_by_path(path);
+    if (file_inode_num == 0)
+    {
+        return false;
+    }
+
+    std::shared_lock<std::shared_mutex> lock = read_lock(file_inode_num);
+    Inode file_inode;
+    if (!read_inode(file_inode_num, file_inode) ||
+        static_cast<FileType>(file_inode.mode) != FileType::REGULAR)
+    {
+        return false;
+    }
+
+    std::vector<uint32_t> map, lengths;
+    if (!load_block_map(file_inode, map) || !read_cluster_map(file_inode, lengths))
+    {
+        return false;
+    }
+
+    bool ok = true;
+    if (file_inode.flags & INODE_FLAG_COMPRESSED)
+    {
+        data.assign(lengths.size() * CLUSTER_SIZE, 0);
+        for (uint32_t c = 0; ok && c < lengths.size(); c++)
+        {
+            ok = read_cluster(file_inode, map, lengths, c, data.data() + static_cast<size_t>(c) * CLUSTER_SIZE);
+        }
+    }
+    else
+    {
+        data.assign(std::max<size_t>(file_inode.size, map.size() * BLOCK_SIZE), 0);
+        for (uint32_t i = 0; ok && i < map.size();)
+        {
+            if (map[i] == 0)
+            {
+                i++;
+                continue;
+            }
+
+            uint32_t run = 1;
+            while (i + run < map.size() && map[i + run] == map[i] + run)
+            {
+                run++;
+            }
+            ok = cache.read_blocks(map[i], run, data.data() + static_cast<size_t>(i) * BLOCK_SIZE);
+            i += run;
+        }
+    }
+
+    data.resize(file_inode.size);
+    return ok;
+}
+
+// Deduplicating import into the blocks reserved by prepare_import. Each
+// block read from src_fd is hashed; if the image already holds the same
+// content the file references that block instead and the reserved block is
+// never written. Reserved blocks left over are released, and the inode's
+// block map is rewritten once at the end.
+bool FileSystem::import_dedup(int src_fd, size_t size, uint32_t inode_num, std::vector<uint32_t> &blocks)
+{
+    if (!ensure_refcount_table() || !ensure_dedup_index())
+    {
+        std::vector<uint32_t> skipped;
+        return import_data(src_fd, size, blocks, skipped) && commit_holes(inode_num, blocks, skipped);
+    }
+
+    const size_t chunk_blocks = IMPORT_BUFFER_SIZE / BLOCK_SIZE;
+    std::vector<char> buffer(std::min(chunk_blocks, blocks.size()) * BLOCK_SIZE);
+    std::vector<uint32_t> unused;
+    bool ok = true;
+
+    for (size_t chunk_start = 0; ok && chunk_start < blocks.size(); chunk_start += chunk_blocks)
+    {
+        size_t count = std::min(chunk_blocks, blocks.size() - chunk_start);
+        size_t offset = chunk_start * BLOCK_SIZE;
+        size_t length = std::min(count * BLOCK_SIZE, size - offset);
+
+        if (!read_fully(src_fd, buffer.data(), length, offset))
+        {
+            ok = false;
+            break;
+        }
+        memset(buffer.data() + length, 0, count * BLOCK_SIZE - length);
+
+        for (size_t j = 0; j < count; j++)
+        {
+            const char *block_data = buffer.data() + j * BLOCK_SIZE;
+            uint32_t &block_num = blocks[chunk_start + j];
+
+            // All-zero blocks become holes rather than index entries
+            if (block_is_zero(block_data))
+            {
+                unused.push_back(block_num);
+                block_num = 0;
+                continue;
+            }
+
+            uint64_t hash = xxhash64(block_data, BLOCK_SIZE);
+
+            // The match and the new reference are taken together, so the
+            // block cannot be freed or rewritten in place in between
+            std::unique_lock<std::recursive_mutex> lock(alloc_mutex);
+            superblock.dedup_hashed++;
+            uint32_t existing = dedup_lookup(hash, block_data);
+            if (existing != 0 && share_block(existing))
+            {
+                unused.push_back(block_num);
+                block_num = existing;
+                superblock.dedup_hits++;
+                continue;
+            }
+            lock.unlock();
+
+            if (!cache.write_blocks(block_num, 1, block_data))
+            {
+                ok = false;
+                break;
+            }
+            dedup_insert(hash, block_num);
+        }
+    }
+
+    // The file now owns the shared blocks; the inode must point at them
+    // even on failure so that removing it drops those references
+    Inode inode;
+    if (!read_inode(inode_num, inode) || !store_block_map(inode, blocks))
+    {
+        ok = false;
+    }
+    else
+    {
+        write_inode(inode_num, inode);
+    }
+
+    free_blocks(unused);
+    write_refcounts();
+    write_dedup_index();
+    write_superblock();
+    return ok;
+}
+
+// Lengths of the compressed clusters of an inode; 0 marks a cluster
+// stored uncompressed. Empty for inodes that are not compressed.
+bool FileSystem::read_cluster_map(const Inode &inode, std::vector<uint32_t> &lengths)
+{
+    lengths.clear();
+    if (!(inode.flags & INODE_FLAG_COMPRESSED))
+    {
+        return true;
+    }
+
+    uint32_t cluster_count = (inode.size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    uint32_t map_data[POINTERS_PER_BLOCK];
+    if (cluster_count > POINTERS_PER_BLOCK || !read_block(inode.cluster_map, map_data))
+    {
+        return false;
+    }
+
+    lengths.assign(map_data, map_data + cluster_count);
+    return true;
+}
+
+// Reads logical cluster c of a file into out (CLUSTER_SIZE bytes),
+// decompressing it if needed. Bytes past the end of the file are zero.
+bool FileSystem::read_cluster(const Inode &inode, const std::vector<uint32_t> &map,
+                              const std::vector<uint32_t> &lengths, uint32_t cluster, char *out)
+{
+    uint32_t first = cluster * CLUSTER_BLOCKS;
+    uint32_t logical = std::min(static_cast<uint32_t>(CLUSTER_SIZE), inode.size - cluster * static_cast<uint32_t>(CLUSTER_SIZE));
+    uint32_t stored_blocks = lengths[cluster] == 0 ? std::min(CLUSTER_BLOCKS, map.size() - first)
+                                                   : (lengths[cluster] + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    char stored[CLUSTER_SIZE] = {0};
+    for (uint32_t i = 0; i < stored_blocks; i++)
+    {
+        if (map[first + i] != 0 && !read_block(map[first + i], stored + i * BLOCK_SIZE))
+        {
+            return false;
+        }
+    }
+
+    if (lengths[cluster] == 0)
+    {
+        memcpy(out, stored, CLUSTER_SIZE);
+        return true;
+    }
+
+    memset(out + logical, 0, CLUSTER_SIZE - logical);
+    return lz4_decompress(stored, lengths[cluster], out, logical);
+}
+
+// Compressing import into the blocks reserved by prepare_import. Each
+// CLUSTER_SIZE cluster is compressed and kept that way only when it saves
+// at least one block; incompressible clusters are stored as is. Blocks the
+// compressed clusters do not need are released at the end.
+bool FileSystem::import_compressed(int src_fd, size_t size, uint32_t inode_num, std::vector<uint32_t> &blocks)
+{
+    uint32_t cluster_count = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    uint32_t cluster_map = cluster_count > 1 || blocks.size() > 1 ? allocate_block() : 0;
+    if (cluster_map == 0)
+    {
+        std::vector<uint32_t> skipped;
+        return import_data(src_fd, size, blocks, skipped) && commit_holes(inode_num, blocks, skipped);
+    }
+
+    const size_t chunk_clusters = IMPORT_BUFFER_SIZE / CLUSTER_SIZE;
+    std::vector<char> buffer(std::min<size_t>(chunk_clusters, cluster_count) * CLUSTER_SIZE);
+    uint32_t lengths[POINTERS_PER_BLOCK] = {0};
+    char packed[CLUSTER_SIZE];
+    std::vector<uint32_t> unused;
+    bool compressed_any = false;
+    bool ok = true;
+
+    for (size_t chunk_start = 0; ok && chunk_start < cluster_count; chunk_start += chunk_clusters)
+    {
+        size_t count = std::min<size_t>(chunk_clusters, cluster_count - chunk_start);
+        size_t offset = chunk_start * CLUSTER_SIZE;
+        size_t length = std::min(count * CLUSTER_SIZE, size - offset);
+
+        if (!read_fully(src_fd, buffer.data(), length, offset))
+        {
+            ok = false;
+            break;
+        }
+        memset(buffer.data() + length, 0, count * CLUSTER_SIZE - length);
+
+        for (size_t j = 0; ok && j < count; j++)
+        {
+            uint32_t cluster = chunk_start + j;
+            uint32_t first = cluster * CLUSTER_BLOCKS;
+            uint32_t block_count = std::min(CLUSTER_BLOCKS, blocks.size() - first);
+            uint32_t logical = std::min(CLUSTER_SIZE, size - static_cast<size_t>(cluster) * CLUSTER_SIZE);
+            const char *data = buffer.data() + j * CLUSTER_SIZE;
+
+            // An all-zero cluster is left as a hole
+            bool all_zero = true;
+            for (uint32_t i = 0; all_zero && i < block_count; i++)
+            {
+                all_zero = block_is_zero(data + i * BLOCK_SIZE);
+            }
+            if (all_zero)
+            {
+                for (uint32_t i = 0; i < block_count; i++)
+                {
+                    unused.push_back(blocks[first + i]);
+                    blocks[first + i] = 0;
+                }
+                continue;
+            }
+
+            // Only worth it if the result frees at least one block
+            size_t packed_length = block_count > 1 ? lz4_compress(data, logical, packed, (block_count - 1) * BLOCK_SIZE) : 0;
+            if (packed_length > 0)
+            {
+                uint32_t packed_blocks = (packed_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+                memset(packed + packed_length, 0, packed_blocks * BLOCK_SIZE - packed_length);
+                data = packed;
+                lengths[cluster] = packed_length;
+                compressed_any = true;
+
+                for (uint32_t i = packed_blocks; i < block_count; i++)
+                {
+                    unused.push_back(blocks[first + i]);
+                    blocks[first + i] = 0;
+                }
+                block_count = packed_blocks;
+            }
+
+            for (uint32_t i = 0; i < block_count; i++)
+            {
+                if (!cache.write_blocks(blocks[first + i], 1, data + i * BLOCK_SIZE))
+                {
+                    ok = false;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Nothing compressed: the file stays a plain one
+    if (!compressed_any)
+    {
+        unused.push_back(cluster_map);
+        cluster_map = 0;
+    }
+
+    Inode inode;
+    if (!read_inode(inode_num, inode) || !store_block_map(inode, blocks) ||
+        (cluster_map != 0 && !write_block(cluster_map, lengths)))
+    {
+        ok = false;
+    }
+    else
+    {
+        if (cluster_map != 0)
+        {
+            inode.flags |= INODE_FLAG_COMPRESSED;
+            inode.cluster_map = cluster_map;
+        }
+        write_inode(inode_num, inode);
+    }
+
+    free_blocks(unused);
+    return ok;
+}
+
+// Rewrites a compressed file as a plain one, so it can be modified in place
+bool FileSystem::decompress_inode(uint32_t inode_num, Inode &inode)
+{
+    if (!(inode.flags & INODE_FLAG_COMPRESSED))
+    {
+        return true;
     }
 
-    // Traverse the directory tree
-    for (const auto &comp : components)
+    std::vector<uint32_t> map, lengths;
+    if (!load_block_map(inode, map) || !read_cluster_map(inode, lengths))
     {
-        Inode inode;
-        if (!read_inode(current_inode, inode))
+        return false;
+    }
+
+    std::vector<uint32_t> new_map = map;
+    std::vector<uint32_t> release, fresh;
+    for (uint32_t cluster = 0; cluster < lengths.size(); cluster++)
+    {
+        if (lengths[cluster] == 0)
+        {
+            continue;
+        }
+
+        uint32_t first = cluster * CLUSTER_BLOCKS;
+        uint32_t block_count = std::min(CLUSTER_BLOCKS, map.size() - first);
+        char data[CLUSTER_SIZE];
+        if (!read_cluster(inode, map, lengths, cluster, data) || !allocate_extents(block_count, fresh))
+        {
+            free_blocks(release);
+            return false;
+        }
+
+        for (uint32_t i = 0; i < block_count; i++)
+        {
+            write_block(fresh[i], data + i * BLOCK_SIZE);
+            if (map[first + i] != 0)
+            {
+                release.push_back(map[first + i]);
+            }
+            new_map[first + i] = fresh[i];
+        }
+    }
+
+    if (!store_block_map(inode, new_map))
+    {
+        return false;
+    }
+
+    release.push_back(inode.cluster_map);
+    inode.flags &= ~INODE_FLAG_COMPRESSED;
+    inode.cluster_map = 0;
+    write_inode(inode_num, inode);
+    free_blocks(release);
+    return true;
+}
+
+bool FileSystem::get_compression_info(const std::string &path, CompressionInfo &info)
+{
+    uint32_t inode_num = find_inode_by_path(path);
+    if (inode_num == 0)
+    {
+        return false;
+    }
+
+    std::shared_lock<std::shared_mutex> lock = read_lock(inode_num);
+    Inode inode;
+    if (!read_inode(inode_num, inode) || static_cast<FileType>(inode.mode) != FileType::REGULAR)
+    {
+        return false;
+    }
+
+    std::vector<uint32_t> map, lengths;
+    if (!load_block_map(inode, map) || !read_cluster_map(inode, lengths))
+    {
+        return false;
+    }
+
+    info = {};
+    info.logical_bytes = inode.size;
+    info.clusters = (inode.size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    for (uint32_t block_num : map)
+    {
+        if (block_num != 0)
+        {
+            info.stored_blocks++;
+        }
+    }
+    for (uint32_t length : lengths)
+    {
+        if (length != 0)
+        {
+            info.compressed_clusters++;
+        }
+    }
+    return true;
+}
+
+// Builds a regular file of the given size whose data blocks are already
+// reserved and mapped, ready for import_data to fill. The file is not
+// linked yet: publish_inode puts it at virt_path once it is filled.
+// Returns the new inode number, or 0 on failure.
+uint32_t FileSystem::prepare_import(const std::string &virt_path, size_t size, std::vector<uint32_t> &data_blocks)
+{
+    // Refuse files that do not fit in the direct + single indirect pointers
+    uint32_t block_count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (size > UINT32_MAX || block_count > MAX_FILE_BLOCKS)
+    {
+        return 0;
+    }
+
+    // A taken name is caught here rather than after the copy; publish_inode
+    // checks again
+    std::string name;
+    if (find_inode_by_path(virt_path, false) != 0 || find_parent(virt_path, name) == 0)
+    {
+        return 0;
+    }
+
+    uint32_t file_inode_num = allocate_inode();
+    if (file_inode_num == 0)
+    {
+        return 0;
+    }
+
+    Inode file_inode;
+    file_inode.mode = static_cast<uint32_t>(FileType::REGULAR);
+    file_inode.links_count = 1;
+
+    // Reserve the data extents and the indirect block in one allocation pass
+    bool needs_indirect = block_count > DIRECT_BLOCKS;
+    if (!allocate_extents(block_count + (needs_indirect ? 1 : 0), data_blocks))
+    {
+        free_inode(file_inode_num);
+        return 0;
+    }
+
+    uint32_t indirect_pointers[POINTERS_PER_BLOCK] = {0};
+    if (needs_indirect)
+    {
+        file_inode.blocks[DIRECT_BLOCKS] = data_blocks.back();
+        data_blocks.pop_back();
+    }
+
+    // Fill in block pointers
+    for (uint32_t i = 0; i < block_count; i++)
+    {
+        if (i < DIRECT_BLOCKS)
+        {
+            file_inode.blocks[i] = data_blocks[i];
+        }
+        else
+        {
+            indirect_pointers[i - DIRECT_BLOCKS] = data_blocks[i];
+        }
+    }
+
+    if (needs_indirect)
+    {
+        write_block(file_inode.blocks[DIRECT_BLOCKS], indirect_pointers);
+    }
+
+    // Update file size
+    file_inode.size = size;
+    write_inode(file_inode_num, file_inode);
+
+    return file_inode_num;
+}
+
+// Fills a file built by prepare_import from src_fd in the current import
+// mode: compressed, deduplicated or plain with holes
+bool FileSystem::fill_import(int src_fd, size_t size, uint32_t inode_num, std::vector<uint32_t> &blocks)
+{
+    if (compress_enabled)
+    {
+        return import_compressed(src_fd, size, inode_num, blocks);
+    }
+    if (dedup_enabled)
+    {
+        return import_dedup(src_fd, size, inode_num, blocks);
+    }
+
+    std::vector<uint32_t> skipped;
+    return import_data(src_fd, size, blocks, skipped) && commit_holes(inode_num, blocks, skipped);
+}
+
+bool FileSystem::copy_from_system(const std::string &sys_path, const std::string &virt_path)
+{
+    if (read_only)
+    {
+        return false;
+    }
+
+    CacheOp op(cache);
+
+    // Open system file for reading
+    int sys_fd = open(sys_path.c_str(), O_RDONLY);
+    if (sys_fd < 0)
+    {
+        return false;
+    }
+
+    // Get file size
+    struct stat st;
+    if (fstat(sys_fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        close(sys_fd);
+        return false;
+    }
+    size_t file_size = st.st_size;
+
+    std::vector<uint32_t> data_blocks;
+    uint32_t file_inode_num = prepare_import(virt_path, file_size, data_blocks);
+    if (file_inode_num == 0)
+    {
+        close(sys_fd);
+        return false;
+    }
+
+    // Move the data into the image; the file appears once it is complete
+    bool copied = fill_import(sys_fd, file_size, file_inode_num, data_blocks);
+    close(sys_fd);
+
+    if (!copied || !publish_inode(virt_path, file_inode_num, FileType::REGULAR))
+    {
+        free_inode(file_inode_num);
+        return false;
+    }
+
+    return true;
+}
+
+// Recreates the host tree under sys_dir inside virt_dir. The calling thread
+// walks the tree, creates the directories and reserves each file's blocks;
+// a worker pool then fills the files and links them into place.
+bool FileSystem::copy_tree_from_system(const std::string &sys_dir, const std::string &virt_dir,
+                                       const TreeCopyCallback &progress)
+{
+    if (read_only)
+    {
+        return false;
+    }
+
+    namespace fs = std::filesystem;
+    using Clock = std::chrono::steady_clock;
+
+    std::error_code ec;
+    if (!fs::is_directory(sys_dir, ec))
+    {
+        return false;
+    }
+
+    std::string virt_root = get_absolute_path(virt_dir);
+    if (!make_directory_if_missing(virt_root))
+    {
+        return false;
+    }
+
+    auto start = Clock::now();
+    TreeCopyProgress state = {};
+    std::atomic<uint64_t> files_done(0), files_failed(0), bytes_done(0);
+
+    auto report = [&]()
+    {
+        if (progress)
+        {
+            state.files_done = files_done;
+            state.files_failed = files_failed;
+            state.bytes_done = bytes_done;
+            state.elapsed_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            progress(state);
+        }
+    };
+
+    ThreadPool pool;
+    auto last_report = Clock::now();
+    bool walk_ok = true;
+
+    fs::recursive_directory_iterator it(sys_dir, fs::directory_options::skip_permission_denied, ec);
+    for (; !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+    {
+        const fs::directory_entry &entry = *it;
+        // Lexical, so a symlink names itself rather than what it points to
+        std::string relative = entry.path().lexically_relative(sys_dir).generic_string();
+        std::string target = (virt_root == "/" ? "" : virt_root) + "/" + relative;
+
+        // Host symlinks are recreated, not followed
+        if (entry.is_symlink(ec))
+        {
+            std::string link_target = fs::read_symlink(entry.path(), ec).string();
+            if (ec || !create_symlink(link_target, target))
+            {
+                files_failed++;
+            }
+        }
+        else if (entry.is_directory(ec))
+        {
+            if (make_directory_if_missing(target))
+            {
+                state.directories++;
+            }
+            else
+            {
+                // Nothing below an uncreatable directory can be imported
+                walk_ok = false;
+                it.disable_recursion_pending();
+            }
+        }
+        else if (entry.is_regular_file(ec))
+        {
+            state.files_total++;
+            uint64_t size = entry.file_size(ec);
+            int sys_fd = ec ? -1 : open(entry.path().c_str(), O_RDONLY);
+            std::vector<uint32_t> data_blocks;
+            uint32_t inode_num = 0;
+
+            // One operation per file, from reservation to publication, so
+            // no commit can hold a reserved inode that was never linked
+            cache.begin_op(true);
+            if (sys_fd < 0 || (inode_num = prepare_import(target, size, data_blocks)) == 0)
+            {
+                cache.end_op(true);
+                if (sys_fd >= 0)
+                {
+                    close(sys_fd);
+                }
+                files_failed++;
+                continue;
+            }
+            state.bytes_total += size;
+
+            // Files that fail are never linked, so nothing is left behind
+            pool.submit([this, sys_fd, size, target, inode_num, data_blocks = std::move(data_blocks),
+                         &files_done, &files_failed, &bytes_done]() mutable
+                        {
+                            bool copied = fill_import(sys_fd, size, inode_num, data_blocks);
+                            close(sys_fd);
+                            if (copied && publish_inode(target, inode_num, FileType::REGULAR))
+                            {
+                                files_done++;
+                                bytes_done += size;
+                            }
+                            else
+                            {
+                                free_inode(inode_num);
+                                files_failed++;
+                            }
+                            cache.end_op(true); });
+        }
+
+        if (Clock::now() - last_report >= std::chrono::seconds(1))
+        {
+            report();
+            last_report = Clock::now();
+        }
+    }
+    if (ec)
+    {
+        walk_ok = false;
+    }
+
+    while (!pool.wait_idle(std::chrono::milliseconds(1000)))
+    {
+        report();
+    }
+
+    report();
+    return walk_ok && files_failed == 0;
+}
+
+// Creates path as a directory unless a directory already exists there
+bool FileSystem::make_directory_if_missing(const std::string &path)
+{
+    uint32_t inode_num = find_inode_by_path(path);
+    if (inode_num == 0)
+    {
+        if (create_directory(path))
+        {
+            return true;
+        }
+        // Another thread may have created it in the meantime
+        inode_num = find_inode_by_path(path);
+    }
+
+    Inode inode;
+    return inode_num != 0 && read_inode(inode_num, inode) && static_cast<FileType>(inode.mode) == FileType::DIRECTORY;
+}
+
+// Recreates the subtree under virt_dir inside sys_dir. Files are exported in
+// windows of up to EXPORT_WINDOW_SIZE bytes: the calling thread reads every
+// data block of a window in physical block order, so image reads stay
+// sequential, and a worker pool writes the host files from that buffer.
+// Inodes reached through several names are written once and the other
+// names become host hard links. Block maps are taken under each file's
+// lock but the data is read later, so files changed while the export runs
+// may come out with a mix of old and new contents.
+bool FileSystem::copy_tree_to_system(const std::string &virt_dir, const std::string &sys_dir,
+                                     const TreeCopyCallback &progress)
+{
+    namespace fs = std::filesystem;
+    using Clock = std::chrono::steady_clock;
+
+    uint32_t root_inode_num = find_inode_by_path(virt_dir);
+    Inode root_inode;
+    if (root_inode_num == 0 || !read_inode(root_inode_num, root_inode) ||
+        static_cast<FileType>(root_inode.mode) != FileType::DIRECTORY)
+    {
+        return false;
+    }
+
+    std::error_code ec;
+    fs::create_directories(sys_dir, ec);
+    if (!fs::is_directory(sys_dir, ec))
+    {
+        return false;
+    }
+
+    struct ExportFile
+    {
+        std::string sys_path;
+        uint32_t size;
+        std::vector<uint32_t> blocks;   // Logical to physical block map
+        std::vector<uint32_t> clusters; // Compressed cluster lengths, if compressed
+    };
+
+    auto start = Clock::now();
+    TreeCopyProgress state = {};
+    std::atomic<uint64_t> files_done(0), files_failed(0), bytes_done(0);
+    bool ok = true;
+
+    auto report = [&]()
+    {
+        if (progress)
+        {
+            state.files_done = files_done;
+            state.files_failed = files_failed;
+            state.bytes_done = bytes_done;
+            state.elapsed_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            progress(state);
+        }
+    };
+
+    // Walk the subtree by inode number, so no path is resolved from the root
+    std::vector<ExportFile> files;
+    std::vector<std::pair<std::string, std::string>> links; // <existing host path, new name>
+    std::unordered_map<uint32_t, size_t> exported;          // Inode -> index into files
+    std::unordered_set<uint32_t> visited_dirs = {root_inode_num};
+    std::vector<std::pair<uint32_t, std::string>> pending = {{root_inode_num, sys_dir}};
+
+    while (!pending.empty())
+    {
+        auto [dir_inode_num, dir_sys_path] = pending.back();
+        pending.pop_back();
+
+        Inode dir_inode;
+        std::vector<std::pair<std::string, uint32_t>> entries;
+        bool listed;
+        {
+            std::shared_lock<std::shared_mutex> dir_lock = read_lock(dir_inode_num);
+            listed = read_inode(dir_inode_num, dir_inode) && read_dir_entries(dir_inode, entries);
+        }
+        if (!listed)
+        {
+            ok = false;
+            continue;
+        }
+
+        for (const auto &[name, inode_num] : entries)
+        {
+            std::string sys_path = dir_sys_path + "/" + name;
+            std::shared_lock<std::shared_mutex> lock = read_lock(inode_num);
+            Inode inode;
+            if (!read_inode(inode_num, inode))
+            {
+                files_failed++;
+                continue;
+            }
+
+            FileType type = static_cast<FileType>(inode.mode);
+            if (type == FileType::DIRECTORY)
+            {
+                // A directory hard link would make the walk loop forever
+                if (!visited_dirs.insert(inode_num).second)
+                {
+                    continue;
+                }
+                fs::create_directory(sys_path, ec);
+                if (ec && !fs::is_directory(sys_path))
+                {
+                    ok = false;
+                    continue;
+                }
+                state.directories++;
+                pending.push_back({inode_num, sys_path});
+            }
+            else if (type == FileType::SYMLINK)
+            {
+                std::string target;
+                fs::remove(sys_path, ec);
+                if (!read_symlink_target(inode_num, inode, target) ||
+                    (fs::create_symlink(target, sys_path, ec), ec))
+                {
+                    files_failed++;
+                }
+            }
+            else if (type == FileType::REGULAR)
+            {
+                auto seen = exported.find(inode_num);
+                if (inode.links_count > 1 && seen != exported.end())
+                {
+                    links.push_back({files[seen->second].sys_path, sys_path});
+                    continue;
+                }
+
+                ExportFile file;
+                file.sys_path = sys_path;
+                file.size = inode.size;
+                if (!load_block_map(inode, file.blocks) || !read_cluster_map(inode, file.clusters))
+                {
+                    files_failed++;
+                    continue;
+                }
+
+                exported[inode_num] = files.size();
+                state.files_total++;
+                state.bytes_total += inode.size;
+                files.push_back(std::move(file));
+            }
+        }
+    }
+
+    // Visit files in the order their data starts on disk
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    auto first_block = [&](size_t i)
+    {
+        for (uint32_t block_num : files[i].blocks)
+        {
+            if (block_num != 0)
+            {
+                return block_num;
+            }
+        }
+        return UINT32_MAX;
+    };
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+              { return first_block(a) < first_block(b); });
+
+    ThreadPool pool;
+    std::vector<char> window;
+    size_t next = 0;
+
+    while (next < order.size())
+    {
+        // Gather files until the window is full (a single file always fits)
+        size_t window_end = next;
+        size_t window_blocks = 0;
+        while (window_end < order.size() &&
+               (window_end == next ||
+                (window_blocks + files[order[window_end]].blocks.size()) * BLOCK_SIZE <= EXPORT_WINDOW_SIZE))
         {
-            return 0;
+            window_blocks += files[order[window_end]].blocks.size();
+            window_end++;
         }
 
-        // Check if the current inode is a directory
-        if (static_cast<FileType>(inode.mode) != FileType::DIRECTORY)
+        // <physical block, slot in window buffer>, read back in disk order
+        std::vector<std::pair<uint32_t, size_t>> reads;
+        std::vector<size_t> slot_base(window_end - next);
+        size_t slot = 0;
+        for (size_t w = next; w < window_end; w++)
         {
-            return 0;
+            slot_base[w - next] = slot;
+            for (uint32_t block_num : files[order[w]].blocks)
+            {
+                if (block_num != 0)
+                {
+                    reads.push_back({block_num, slot});
+                }
+                slot++;
+            }
         }
+        std::sort(reads.begin(), reads.end());
 
-        // Look for the component in the directory
-        bool found = false;
-        for (uint32_t i = 0; i < DIRECT_BLOCKS && inode.blocks[i] != 0; i++)
+        window.assign(window_blocks * BLOCK_SIZE, 0);
+        bool window_ok = true;
+        size_t r = 0;
+        while (r < reads.size())
         {
-            char block_data[BLOCK_SIZE];
-            if (!read_block(inode.blocks[i], block_data))
+            // Coalesce blocks that are contiguous on disk and in the buffer
+            size_t run = 1;
+            while (r + run < reads.size() &&
+                   reads[r + run].first == reads[r].first + run &&
+                   reads[r + run].second == reads[r].second + run)
             {
-                continue;
+                run++;
             }
 
-            // Scan directory entries
-            char *ptr = block_data;
-            while (ptr < block_data + BLOCK_SIZE)
+            if (!cache.read_blocks(reads[r].first, run, window.data() + reads[r].second * BLOCK_SIZE))
             {
-                DirEntry *entry = reinterpret_cast<DirEntry *>(ptr);
-                if (entry->inode == 0 || entry->rec_len == 0)
-                {
-                    break;
-                }
+                window_ok = false;
+                break;
+            }
+            r += run;
+        }
+
+        if (!window_ok)
+        {
+            files_failed += window_end - next;
+            next = window_end;
+            continue;
+        }
 
-                std::string entry_name(entry->name, entry->name_len);
+        for (size_t w = next; w < window_end; w++)
+        {
+            const ExportFile *file = &files[order[w]];
+            const char *data = window.data() + slot_base[w - next] * BLOCK_SIZE;
+
+            pool.submit([file, data, &files_done, &files_failed, &bytes_done]()
+                        {
+                            int fd = open(file->sys_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                            bool written = fd >= 0;
+                            if (written && file->clusters.empty())
+                            {
+                                written = write_sparse(fd, data, file->size, file->blocks);
+                            }
+
+                            // A compressed cluster sits at the start of its slots
+                            char cluster_data[CLUSTER_SIZE];
+                            for (size_t c = 0; written && c < file->clusters.size(); c++)
+                            {
+                                size_t offset = c * CLUSTER_SIZE;
+                                size_t logical = std::min(CLUSTER_SIZE, file->size - offset);
+                                const char *plain = data + offset;
+                                if (file->clusters[c] != 0)
+                                {
+                                    written = lz4_decompress(data + offset, file->clusters[c], cluster_data, logical);
+                                    plain = cluster_data;
+                                }
+                                written = written && write_fully(fd, plain, logical, offset);
+                            }
+                            if (written && !file->clusters.empty())
+                            {
+                                written = ftruncate(fd, file->size) == 0;
+                            }
+                            if (fd >= 0)
+                            {
+                                close(fd);
+                            }
+                            if (written)
+                            {
+                                files_done++;
+                                bytes_done += file->size;
+                            }
+                            else
+                            {
+                                files_failed++;
+                            } });
+        }
 
-                if (strncmp(entry->name, comp.c_str(), entry->name_len) == 0 &&
-                    comp.length() == entry->name_len)
-                {
-                    current_inode = entry->inode;
-                    found = true;
-                    break;
-                }
+        // The window buffer is reused, so let the writers drain it first
+        while (!pool.wait_idle(std::chrono::milliseconds(1000)))
+        {
+            report();
+        }
+        next = window_end;
+        report();
+    }
 
-                ptr += entry->rec_len;
-            }
+    for (const auto &[existing, name] : links)
+    {
+        fs::remove(name, ec);
+        fs::create_hard_link(existing, name, ec);
+        if (ec)
+        {
+            files_failed++;
+        }
+        else
+        {
+            state.hard_links++;
+        }
+    }
+
+    report();
+    return ok && files_failed == 0;
+}
+
+// Logical to physical map of every block within inode.size; holes are 0
+bool FileSystem::load_block_map(const Inode &inode, std::vector<uint32_t> &map)
+{
+    uint32_t block_count = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (block_count > MAX_FILE_BLOCKS)
+    {
+        return false;
+    }
+
+    map.assign(block_count, 0);
+    for (uint32_t i = 0; i < block_count && i < DIRECT_BLOCKS; i++)
+    {
+        map[i] = inode.blocks[i];
+    }
+
+    if (block_count > DIRECT_BLOCKS && inode.blocks[DIRECT_BLOCKS] != 0)
+    {
+        uint32_t indirect_pointers[POINTERS_PER_BLOCK];
+        if (!read_block(inode.blocks[DIRECT_BLOCKS], indirect_pointers))
+        {
+            return false;
+        }
+        for (uint32_t i = DIRECT_BLOCKS; i < block_count; i++)
+        {
+            map[i] = indirect_pointers[i - DIRECT_BLOCKS];
+        }
+    }
+
+    return true;
+}
+
+// Collects <name, inode> for every live entry of a directory except . and ..
+bool FileSystem::read_dir_entries(const Inode &dir_inode, std::vector<std::pair<std::string, uint32_t>> &entries)
+{
+    entries.clear();
+
+    for (uint32_t i = 0; i < DIRECT_BLOCKS && dir_inode.blocks[i] != 0; i++)
+    {
+        char block_data[BLOCK_SIZE];
+        if (!read_block(dir_inode.blocks[i], block_data))
+        {
+            return false;
+        }
 
-            if (found)
+        // Scan directory entries; removed entries keep their slot with inode 0.
+        // Older images may hold a short entry in the tail of the block.
+        char *ptr = block_data;
+        while (ptr + offsetof(DirEntry, name) <= block_data + BLOCK_SIZE)
+        {
+            DirEntry *entry = reinterpret_cast<DirEntry *>(ptr);
+            if (entry->rec_len == 0 ||
+                ptr + offsetof(DirEntry, name) + entry->name_len > block_data + BLOCK_SIZE)
             {
                 break;
             }
+
+            bool dot = (entry->name_len == 1 && entry->name[0] == '.') ||
+                       (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.');
+            if (entry->inode != 0 && !dot)
+            {
+                entries.push_back({std::string(entry->name, entry->name_len), entry->inode});
+            }
+
+            ptr += entry->rec_len;
         }
+    }
+
+    return true;
+}
+
+// Points the inode at map, allocating or releasing the indirect block as
+// needed. The data blocks themselves are not touched.
+bool FileSystem::store_block_map(Inode &inode, const std::vector<uint32_t> &map)
+{
+    if (map.size() > MAX_FILE_BLOCKS)
+    {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < DIRECT_BLOCKS; i++)
+    {
+        inode.blocks[i] = i < map.size() ? map[i] : 0;
+    }
 
-        if (!found)
+    if (map.size() <= DIRECT_BLOCKS)
+    {
+        if (inode.blocks[DIRECT_BLOCKS] != 0)
         {
-            return 0; // Component not found
+            free_block(inode.blocks[DIRECT_BLOCKS]);
+            inode.blocks[DIRECT_BLOCKS] = 0;
         }
+        return true;
     }
 
-    return current_inode;
+    if (inode.blocks[DIRECT_BLOCKS] == 0)
+    {
+        inode.blocks[DIRECT_BLOCKS] = allocate_block();
+        if (inode.blocks[DIRECT_BLOCKS] == 0)
+        {
+            return false;
+        }
+    }
+
+    uint32_t indirect_pointers[POINTERS_PER_BLOCK] = {0};
+    std::copy(map.begin() + DIRECT_BLOCKS, map.end(), indirect_pointers);
+    return write_block(inode.blocks[DIRECT_BLOCKS], indirect_pointers);
 }
 
-uint32_t FileSystem::create_file(const std::string &parent_path, const std::string &name, FileType type)
+// Repoints one logical block of an inode; index must already be mapped
+bool FileSystem::set_block_pointer(Inode &inode, uint32_t index, uint32_t block_num)
 {
-    // Find parent directory
-    uint32_t parent_inode_num = find_inode_by_path(parent_path);
+    if (index < DIRECT_BLOCKS)
+    {
+        inode.blocks[index] = block_num;
+        return true;
+    }
 
-    if (parent_inode_num == 0)
+    uint32_t indirect_pointers[POINTERS_PER_BLOCK];
+    if (index >= MAX_FILE_BLOCKS || inode.blocks[DIRECT_BLOCKS] == 0 ||
+        !read_block(inode.blocks[DIRECT_BLOCKS], indirect_pointers))
     {
-        return 0;
+        return false;
+    }
+
+    indirect_pointers[index - DIRECT_BLOCKS] = block_num;
+    return write_block(inode.blocks[DIRECT_BLOCKS], indirect_pointers);
+}
+
+std::vector<std::pair<std::string, uint32_t>> FileSystem::list_directory(const std::string &path)
+{
+    std::vector<std::pair<std::string, uint32_t>> result;
+
+    uint32_t dir_inode_num = find_inode_by_path(path);
+    if (dir_inode_num == 0)
+    {
+        return result;
     }
 
-    Inode parent_inode;
-    if (!read_inode(parent_inode_num, parent_inode))
+    std::shared_lock<std::shared_mutex> lock = read_lock(dir_inode_num);
+    Inode dir_inode;
+    if (!read_inode(dir_inode_num, dir_inode))
     {
-        return 0;
+        return result;
     }
 
-    // Check if parent is a directory
-    if (static_cast<FileType>(parent_inode.mode) != FileType::DIRECTORY)
+    // Check if it's a directory
+    if (static_cast<FileType>(dir_inode.mode) != FileType::DIRECTORY)
     {
-        return 0;
+        return result;
     }
 
-    // Check if file already exists
-    for (uint32_t i = 0; i < DIRECT_BLOCKS && parent_inode.blocks[i] != 0; i++)
+    // Scan directory blocks
+    for (uint32_t i = 0; i < DIRECT_BLOCKS && dir_inode.blocks[i] != 0; i++)
     {
         char block_data[BLOCK_SIZE];
-        if (!read_block(parent_inode.blocks[i], block_data))
+        if (!read_block(dir_inode.blocks[i], block_data))
         {
             continue;
         }
@@ -517,747 +3034,999 @@ uint32_t FileSystem::create_file(const std::string &parent_path, const std::stri
         while (ptr < block_data + BLOCK_SIZE)
         {
             DirEntry *entry = reinterpret_cast<DirEntry *>(ptr);
-            if (entry->inode == 0 || entry->rec_len == 0)
+            if (entry->rec_len == 0)
             {
                 break;
             }
+            if (entry->inode == 0)
+            {
+                ptr += entry->rec_len; // Slot of a removed entry
+                continue;
+            }
+
+            // Skip . and ..
+            if ((entry->name_len == 1 && entry->name[0] == '.') ||
+                (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.'))
+            {
+                ptr += entry->rec_len;
+                continue;
+            }
+
+            std::string name(entry->name, entry->name_len);
 
-            if (strncmp(entry->name, name.c_str(), entry->name_len) == 0 &&
-                name.length() == entry->name_len)
+            // Read file/directory inode to get size
+            Inode entry_inode;
+            if (read_inode(entry->inode, entry_inode))
             {
-                return 0; // File already exists
+                std::string target;
+                if (static_cast<FileType>(entry_inode.mode) == FileType::SYMLINK &&
+                    read_symlink_target(entry->inode, entry_inode, target))
+                {
+                    name += " -> " + target;
+                }
+                result.push_back(std::make_pair(name, entry_inode.size));
             }
 
             ptr += entry->rec_len;
         }
     }
 
-    // Allocate new inode
-    uint32_t new_inode_num = allocate_inode();
-    if (new_inode_num == 0)
+    return result;
+}
+
+// Locates the live entry called name in a directory: the index of the
+// directory block holding it, the entry's byte offset in that block and,
+// if inode_num is given, the inode it names
+bool FileSystem::find_dir_entry(const Inode &dir_inode, const std::string &name, uint32_t &block_index, uint32_t &offset,
+                                uint32_t *inode_num)
+{
+    for (uint32_t i = 0; i < DIRECT_BLOCKS && dir_inode.blocks[i] != 0; i++)
     {
-        return 0;
+        char block_data[BLOCK_SIZE];
+        if (!read_block(dir_inode.blocks[i], block_data))
+        {
+            return false;
+        }
+
+        char *ptr = block_data;
+        while (ptr + offsetof(DirEntry, name) <= block_data + BLOCK_SIZE)
+        {
+            DirEntry *entry = reinterpret_cast<DirEntry *>(ptr);
+            if (entry->rec_len == 0)
+            {
+                break;
+            }
+            if (entry->inode != 0 && entry->name_len == name.length() &&
+                strncmp(entry->name, name.c_str(), entry->name_len) == 0)
+            {
+                block_index = i;
+                offset = ptr - block_data;
+                if (inode_num)
+                {
+                    *inode_num = entry->inode;
+                }
+                return true;
+            }
+
+            ptr += entry->rec_len;
+        }
     }
 
-    // Initialize new inode
-    Inode new_inode;
-    new_inode.mode = static_cast<uint32_t>(type);
-    new_inode.links_count = 1;
+    return false;
+}
 
-    if (type == FileType::DIRECTORY)
+// Points the entry at block_index/offset of a directory at inode_num
+bool FileSystem::set_dir_entry(const Inode &dir_inode, uint32_t block_index, uint32_t offset, uint32_t inode_num, FileType type)
+{
+    char block_data[BLOCK_SIZE];
+    if (!read_block(dir_inode.blocks[block_index], block_data))
     {
-        // Allocate a block for directory
-        uint32_t dir_block = allocate_block();
-        if (dir_block == 0)
+        return false;
+    }
+
+    DirEntry *entry = reinterpret_cast<DirEntry *>(block_data + offset);
+    entry->inode = inode_num;
+    entry->file_type = static_cast<uint8_t>(type);
+    return write_block(dir_inode.blocks[block_index], block_data);
+}
+
+// Adds name -> inode_num to a directory, reusing the slot of a removed
+// entry or appending, and growing the directory by a block if it is full
+bool FileSystem::add_dir_entry(uint32_t dir_inode_num, const std::string &name, uint32_t inode_num, FileType type)
+{
+    Inode dir_inode;
+    if (name.empty() || name.length() > 255 || !read_inode(dir_inode_num, dir_inode))
+    {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < DIRECT_BLOCKS; i++)
+    {
+        char block_data[BLOCK_SIZE] = {0};
+        bool new_block = dir_inode.blocks[i] == 0;
+        if (new_block)
         {
-            free_inode(new_inode_num);
-            return 0;
+            dir_inode.blocks[i] = allocate_block();
+            if (dir_inode.blocks[i] == 0)
+            {
+                return false;
+            }
+        }
+        else if (!read_block(dir_inode.blocks[i], block_data))
+        {
+            return false;
         }
 
-        new_inode.blocks[0] = dir_block;
+        // Removed slots keep their rec_len; rec_len 0 marks the end
+        char *ptr = block_data;
+        while (ptr + sizeof(DirEntry) <= block_data + BLOCK_SIZE)
+        {
+            DirEntry *entry = reinterpret_cast<DirEntry *>(ptr);
+            if (entry->rec_len == 0 || (entry->inode == 0 && entry->rec_len >= sizeof(DirEntry)))
+            {
+                entry->inode = inode_num;
+                entry->rec_len = sizeof(DirEntry);
+                entry->name_len = name.length();
+                entry->file_type = static_cast<uint8_t>(type);
+                memset(entry->name, 0, sizeof(entry->name));
+                memcpy(entry->name, name.c_str(), name.length());
+
+                if (!write_block(dir_inode.blocks[i], block_data))
+                {
+                    return false;
+                }
+                if (new_block)
+                {
+                    write_inode(dir_inode_num, dir_inode);
+                }
+                return true;
+            }
 
-        // Set up directory entries (. and ..)
-        DirEntry entries[2];
-        entries[0].inode = new_inode_num;
-        entries[0].rec_len = 12;
-        entries[0].name_len = 1;
-        entries[0].file_type = static_cast<uint8_t>(FileType::DIRECTORY);
-        strcpy(entries[0].name, ".");
+            ptr += entry->rec_len;
+        }
+    }
 
-        entries[1].inode = parent_inode_num;
-        entries[1].rec_len = 12;
-        entries[1].name_len = 2;
-        entries[1].file_type = static_cast<uint8_t>(FileType::DIRECTORY);
-        strcpy(entries[1].name, "..");
+    return false;
+}
 
-        // Write directory entries
-        write_block(dir_block, entries);
+// Moves old_path to new_path by rewriting directory entries only, so the
+// cost does not depend on the size of the file or subtree. An existing
+// new_path is replaced when it is a file and old_path is one, or when both
+// are directories and it is empty. A directory moved to another parent has
+// its .. repointed, and may not be moved below itself.
+bool FileSystem::rename(const std::string &old_path, const std::string &new_path)
+{
+    if (read_only)
+    {
+        return false;
     }
 
-    // Write new inode
-    write_inode(new_inode_num, new_inode);
+    CacheOp op(cache);
 
-    // Add entry to parent directory
-    bool entry_added = false;
-    for (uint32_t i = 0; i < DIRECT_BLOCKS; i++)
+    std::string old_abs = get_absolute_path(old_path);
+    std::string new_abs = get_absolute_path(new_path);
+    if (old_abs == "/" || new_abs == "/")
+    {
+        return false;
+    }
+
+    size_t old_pos = old_abs.find_last_of('/');
+    size_t new_pos = new_abs.find_last_of('/');
+    std::string old_name = old_abs.substr(old_pos + 1);
+    std::string new_name = new_abs.substr(new_pos + 1);
+    if (old_name == "." || old_name == ".." || new_name == "." || new_name == ".." ||
+        new_name.empty() || new_name.length() > 255)
+    {
+        return false;
+    }
+
+    // Only renames move directories, so with one rename at a time the
+    // ancestry checked below cannot change before the entries are rewritten
+    std::lock_guard<std::mutex> rename_lock(rename_mutex);
+
+    uint32_t src_num = find_inode_by_path(old_abs, false);
+    uint32_t dst_num = find_inode_by_path(new_abs, false);
+    uint32_t old_parent_num = find_inode_by_path(old_pos == 0 ? "/" : old_abs.substr(0, old_pos));
+    uint32_t new_parent_num = find_inode_by_path(new_pos == 0 ? "/" : new_abs.substr(0, new_pos));
+
+    Inode src;
+    if (src_num == 0 || old_parent_num == 0 || new_parent_num == 0 || !read_inode(src_num, src))
+    {
+        return false;
+    }
+
+    FileType type = static_cast<FileType>(src.mode);
+    bool is_dir = type == FileType::DIRECTORY;
+
+    // Walk up from the new parent; meeting the source means a loop
+    if (is_dir && new_parent_num != old_parent_num)
     {
-        if (parent_inode.blocks[i] == 0)
+        uint32_t current = new_parent_num;
+        for (uint32_t depth = 0; current != 1; depth++)
         {
-            // Allocate new block for directory
-            uint32_t new_block = allocate_block();
-            if (new_block == 0)
+            std::shared_lock<std::shared_mutex> lock(inode_lock(current));
+            Inode current_inode;
+            uint32_t block_index, offset;
+            if (current == src_num || depth > superblock.inodes_count ||
+                !read_inode(current, current_inode) ||
+                !find_dir_entry(current_inode, "..", block_index, offset, &current))
             {
-                free_inode(new_inode_num);
-                return 0;
+                return false;
             }
+        }
+    }
 
-            parent_inode.blocks[i] = new_block;
+    auto locks = lock_inodes({old_parent_num, new_parent_num, src_num, dst_num});
 
-            // Initialize new directory block
-            DirEntry new_entry;
-            new_entry.inode = new_inode_num;
-            new_entry.rec_len = sizeof(DirEntry);
-            new_entry.name_len = name.length();
-            new_entry.file_type = static_cast<uint8_t>(type);
-            strncpy(new_entry.name, name.c_str(), 255);
-            new_entry.name[255] = '\0';
+    // Everything is read again under the locks; entries that changed since
+    // the lookups make the rename fail
+    Inode old_parent, new_parent;
+    if (!read_inode(src_num, src) || src.links_count == 0 ||
+        !read_inode(old_parent_num, old_parent) || !read_inode(new_parent_num, new_parent) ||
+        new_parent.links_count == 0 || static_cast<FileType>(new_parent.mode) != FileType::DIRECTORY)
+    {
+        return false;
+    }
 
-            // Write directory block
-            write_block(new_block, &new_entry);
-            entry_added = true;
-            break;
-        }
-        else
-        {
-            // Try to add to existing block
-            char block_data[BLOCK_SIZE];
-            if (read_block(parent_inode.blocks[i], block_data))
-            {
-                // Find space for new entry
-                char *ptr = block_data;
-                DirEntry *last_entry = nullptr;
+    uint32_t old_block, old_offset, entry_num;
+    if (!find_dir_entry(old_parent, old_name, old_block, old_offset, &entry_num) || entry_num != src_num)
+    {
+        return false;
+    }
 
-                while (ptr < block_data + BLOCK_SIZE)
-                {
-                    DirEntry *entry = reinterpret_cast<DirEntry *>(ptr);
-                    if (entry->inode == 0 || entry->rec_len == 0)
-                    {
-                        // Found empty slot
-                        entry->inode = new_inode_num;
-                        entry->rec_len = sizeof(DirEntry);
-                        entry->name_len = name.length();
-                        entry->file_type = static_cast<uint8_t>(type);
-                        strncpy(entry->name, name.c_str(), 255);
-                        entry->name[255] = '\0';
-
-                        write_block(parent_inode.blocks[i], block_data);
-                        entry_added = true;
-                        break;
-                    }
+    uint32_t new_block, new_offset;
+    if (find_dir_entry(new_parent, new_name, new_block, new_offset, &entry_num))
+    {
+        // Renaming onto another link of the same inode changes nothing
+        if (entry_num == src_num)
+        {
+            return true;
+        }
 
-                    last_entry = entry;
-                    ptr += entry->rec_len;
-                }
+        Inode dst;
+        std::vector<std::pair<std::string, uint32_t>> dst_entries;
+        if (entry_num != dst_num || !read_inode(dst_num, dst) ||
+            (static_cast<FileType>(dst.mode) == FileType::DIRECTORY) != is_dir ||
+            (is_dir && (!read_dir_entries(dst, dst_entries) || !dst_entries.empty())))
+        {
+            return false;
+        }
 
-                if (!entry_added && last_entry && ptr + sizeof(DirEntry) <= block_data + BLOCK_SIZE)
-                {
-                    // Add at the end
-                    DirEntry *new_entry = reinterpret_cast<DirEntry *>(ptr);
-                    new_entry->inode = new_inode_num;
-                    new_entry->rec_len = sizeof(DirEntry);
-                    new_entry->name_len = name.length();
-                    new_entry->file_type = static_cast<uint8_t>(type);
-                    strncpy(new_entry->name, name.c_str(), 255);
-                    new_entry->name[255] = '\0';
-
-                    write_block(parent_inode.blocks[i], block_data);
-                    entry_added = true;
-                }
-            }
+        // The replaced entry switches over in a single block write
+        if (!set_dir_entry(new_parent, new_block, new_offset, src_num, type))
+        {
+            return false;
         }
 
-        if (entry_added)
+        if (--dst.links_count == 0)
         {
-            break;
+            free_inode(dst_num);
+        }
+        else
+        {
+            write_inode(dst_num, dst);
         }
     }
+    else if (dst_num != 0 || !add_dir_entry(new_parent_num, new_name, src_num, type))
+    {
+        return false;
+    }
 
-    if (!entry_added)
+    // The new entry is in place before the old one goes away. The old
+    // parent is read again in case it is the new parent and just grew.
+    if (!read_inode(old_parent_num, old_parent) ||
+        !set_dir_entry(old_parent, old_block, old_offset, 0, type))
     {
-        free_inode(new_inode_num);
-        return 0;
+        return false;
     }
 
-    // Update parent inode
-    write_inode(parent_inode_num, parent_inode);
+    uint32_t dotdot_block, dotdot_offset;
+    if (is_dir && new_parent_num != old_parent_num &&
+        (!find_dir_entry(src, "..", dotdot_block, dotdot_offset) ||
+         !set_dir_entry(src, dotdot_block, dotdot_offset, new_parent_num, FileType::DIRECTORY)))
+    {
+        return false;
+    }
 
-    return new_inode_num;
+    return true;
 }
 
-bool FileSystem::create_directory(const std::string &path)
+bool FileSystem::create_link(const std::string &target, const std::string &link_path)
 {
-    // Get the parent path and name of the directory
-    std::string abs_path = get_absolute_path(path);
-    size_t pos = abs_path.find_last_of('/');
-    std::string parent_path, name;
-
-    if (pos == 0)
-    {
-        parent_path = "/";
-        name = abs_path.substr(1);
-    }
-    else
+    if (read_only)
     {
-        parent_path = abs_path.substr(0, pos);
-        name = abs_path.substr(pos + 1);
+        return false;
     }
 
-    uint32_t inode_num = create_file(parent_path, name, FileType::DIRECTORY);
-    return inode_num != 0;
-}
+    CacheOp op(cache);
 
-bool FileSystem::remove_directory(const std::string &path)
-{
-    uint32_t dir_inode_num = find_inode_by_path(path);
-    if (dir_inode_num == 0)
+    std::string name;
+    uint32_t target_inode_num = find_inode_by_path(target, false);
+    uint32_t parent_inode_num = find_parent(link_path, name);
+    if (target_inode_num == 0 || parent_inode_num == 0)
     {
         return false;
     }
 
-    // Read directory inode
-    Inode dir_inode;
-    if (!read_inode(dir_inode_num, dir_inode))
+    auto locks = lock_inodes({parent_inode_num, target_inode_num});
+
+    Inode target_inode, parent_inode;
+    if (!read_inode(target_inode_num, target_inode) || target_inode.links_count == 0 ||
+        !read_inode(parent_inode_num, parent_inode) || parent_inode.links_count == 0)
     {
         return false;
     }
 
-    // Check if it's a directory
-    if (static_cast<FileType>(dir_inode.mode) != FileType::DIRECTORY)
+    // Check if parent is a directory
+    if (static_cast<FileType>(parent_inode.mode) != FileType::DIRECTORY)
     {
         return false;
     }
 
-    // Check if directory is empty (except for . and ..)
-    for (uint32_t i = 0; i < DIRECT_BLOCKS && dir_inode.blocks[i] != 0; i++)
+    // Add directory entry for the link
+    uint32_t block_index, offset;
+    if (find_dir_entry(parent_inode, name, block_index, offset) ||
+        !add_dir_entry(parent_inode_num, name, target_inode_num, static_cast<FileType>(target_inode.mode)))
     {
-        char block_data[BLOCK_SIZE];
-        if (!read_block(dir_inode.blocks[i], block_data))
-        {
-            continue;
-        }
+        return false;
+    }
 
-        // Scan directory entries
-        char *ptr = block_data;
-        while (ptr < block_data + BLOCK_SIZE)
-        {
-            DirEntry *entry = reinterpret_cast<DirEntry *>(ptr);
-            if (entry->inode == 0 || entry->rec_len == 0)
-            {
-                break;
-            }
+    // Increment link count; read again in case the target is the parent
+    // and add_dir_entry grew it
+    read_inode(target_inode_num, target_inode);
+    target_inode.links_count++;
+    write_inode(target_inode_num, target_inode);
 
-            // Skip . and ..
-            if (!(entry->name_len == 1 && entry->name[0] == '.') &&
-                !(entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.'))
-            {
-                return false; // Directory not empty
-            }
+    return true;
+}
 
-            ptr += entry->rec_len;
-        }
+// Copies a regular file inside the image. By default the copy shares every
+// data block with the source through the reference table, so only the inode
+// and the indirect block are written; blocks are duplicated later, when one
+// of the files modifies them. With share_blocks false, or when a block
+// cannot take another reference, the data is copied up front.
+bool FileSystem::copy_file(const std::string &src_path, const std::string &dst_path, bool share_blocks)
+{
+    if (read_only)
+    {
+        return false;
     }
 
-    // Get parent directory
-    std::string abs_path = get_absolute_path(path);
-    size_t pos = abs_path.find_last_of('/');
-    std::string parent_path, name;
+    CacheOp op(cache);
 
-    if (pos == 0)
-    {
-        parent_path = "/";
-        name = abs_path.substr(1);
-    }
-    else
+    uint32_t src_inode_num = find_inode_by_path(src_path);
+    if (src_inode_num == 0)
     {
-        parent_path = abs_path.substr(0, pos);
-        name = abs_path.substr(pos + 1);
+        return false;
     }
 
-    uint32_t parent_inode_num = find_inode_by_path(parent_path);
-    if (parent_inode_num == 0)
+    // Without room for a reference table the copy cannot share blocks
+    if (share_blocks && !ensure_refcount_table())
     {
-        return false;
+        share_blocks = false;
     }
 
-    Inode parent_inode;
-    if (!read_inode(parent_inode_num, parent_inode))
+    // The copy takes its references and private blocks while the source is
+    // locked, and is linked at dst_path only once it is complete
+    Inode src_inode;
+    std::vector<uint32_t> dst_map;
+    uint32_t cluster_map = 0;
+    auto release = [&]()
     {
-        return false;
-    }
+        // Drops the references taken and frees the private copies
+        std::vector<uint32_t> taken;
+        for (uint32_t block_num : dst_map)
+        {
+            if (block_num != 0)
+            {
+                taken.push_back(block_num);
+            }
+        }
+        if (cluster_map != 0)
+        {
+            taken.push_back(cluster_map);
+        }
+        free_blocks(taken);
+    };
 
-    // Remove directory entry from parent
-    for (uint32_t i = 0; i < DIRECT_BLOCKS && parent_inode.blocks[i] != 0; i++)
     {
-        char block_data[BLOCK_SIZE];
-        if (!read_block(parent_inode.blocks[i], block_data))
+        std::shared_lock<std::shared_mutex> lock(inode_lock(src_inode_num));
+
+        // Check if it's a regular file
+        std::vector<uint32_t> src_map;
+        if (!read_inode(src_inode_num, src_inode) ||
+            static_cast<FileType>(src_inode.mode) != FileType::REGULAR ||
+            !load_block_map(src_inode, src_map))
         {
-            continue;
+            return false;
         }
 
-        // Scan directory entries
-        char *ptr = block_data;
-        while (ptr < block_data + BLOCK_SIZE)
+        // Share what we can, remember which blocks still need a private copy
+        dst_map.assign(src_map.size(), 0);
+        std::vector<uint32_t> to_copy;
+        for (uint32_t i = 0; i < src_map.size(); i++)
         {
-            DirEntry *entry = reinterpret_cast<DirEntry *>(ptr);
-            if (entry->inode == 0 || entry->rec_len == 0)
+            if (src_map[i] == 0)
             {
-                break;
+                continue;
             }
+            if (share_blocks && share_block(src_map[i]))
+            {
+                dst_map[i] = src_map[i];
+            }
+            else
+            {
+                to_copy.push_back(i);
+            }
+        }
+        write_refcounts();
+
+        std::vector<uint32_t> fresh;
+        bool ok = allocate_extents(to_copy.size(), fresh);
+        for (size_t j = 0; ok && j < to_copy.size(); j++)
+        {
+            dst_map[to_copy[j]] = fresh[j];
+        }
+        for (size_t j = 0; ok && j < to_copy.size(); j++)
+        {
+            char block_data[BLOCK_SIZE];
+            ok = read_block(src_map[to_copy[j]], block_data) && write_block(fresh[j], block_data);
+        }
 
-            if (entry->inode == dir_inode_num)
+        // A compressed copy needs the cluster lengths as well
+        if (ok && (src_inode.flags & INODE_FLAG_COMPRESSED))
+        {
+            char map_data[BLOCK_SIZE];
+            if (share_blocks && share_block(src_inode.cluster_map))
             {
-                // Remove entry
-                entry->inode = 0;
-                write_block(parent_inode.blocks[i], block_data);
-                break;
+                cluster_map = src_inode.cluster_map;
+                write_refcounts();
+            }
+            else if ((cluster_map = allocate_block()) == 0 || !read_block(src_inode.cluster_map, map_data) ||
+                     !write_block(cluster_map, map_data))
+            {
+                ok = false;
             }
+        }
 
-            ptr += entry->rec_len;
+        if (!ok)
+        {
+            release();
+            return false;
         }
     }
 
-    // Free the directory's inode and blocks
-    free_inode(dir_inode_num);
+    Inode dst_inode;
+    dst_inode.mode = static_cast<uint32_t>(FileType::REGULAR);
+    dst_inode.links_count = 1;
+    dst_inode.size = src_inode.size;
+    if (cluster_map != 0)
+    {
+        dst_inode.flags |= INODE_FLAG_COMPRESSED;
+        dst_inode.cluster_map = cluster_map;
+    }
+
+    uint32_t dst_inode_num = allocate_inode();
+    if (dst_inode_num == 0 || !store_block_map(dst_inode, dst_map))
+    {
+        release();
+        if (dst_inode_num != 0)
+        {
+            if (dst_inode.blocks[DIRECT_BLOCKS] != 0)
+            {
+                free_block(dst_inode.blocks[DIRECT_BLOCKS]);
+            }
+            free_inode(dst_inode_num);
+        }
+        return false;
+    }
+
+    // From here on the inode owns the blocks, so freeing it releases them
+    if (!write_inode(dst_inode_num, dst_inode) || !publish_inode(dst_path, dst_inode_num, FileType::REGULAR))
+    {
+        free_inode(dst_inode_num);
+        return false;
+    }
 
     return true;
 }
 
-bool FileSystem::copy_to_system(const std::string &virt_path, const std::string &sys_path)
+bool FileSystem::remove_file(const std::string &path)
 {
-    uint32_t file_inode_num = find_inode_by_path(virt_path);
-    if (file_inode_num == 0)
+    if (read_only)
     {
         return false;
     }
 
-    Inode file_inode;
-    if (!read_inode(file_inode_num, file_inode))
+    CacheOp op(cache);
+
+    std::string name;
+    uint32_t file_inode_num = find_inode_by_path(path, false);
+    uint32_t parent_inode_num = find_parent(path, name);
+    if (file_inode_num == 0 || parent_inode_num == 0)
     {
         return false;
     }
 
-    // Check if it's a regular file
-    if (static_cast<FileType>(file_inode.mode) != FileType::REGULAR)
+    auto locks = lock_inodes({parent_inode_num, file_inode_num});
+
+    Inode file_inode, parent_inode;
+    if (!read_inode(file_inode_num, file_inode) || !read_inode(parent_inode_num, parent_inode))
     {
         return false;
     }
 
-    // Open system file for writing
-    std::ofstream sys_file(sys_path, std::ios::binary);
-    if (!sys_file)
+    // Remove directory entry from parent, if it still names this file
+    uint32_t block_index, offset, entry_inode;
+    if (!find_dir_entry(parent_inode, name, block_index, offset, &entry_inode) || entry_inode != file_inode_num ||
+        !set_dir_entry(parent_inode, block_index, offset, 0, static_cast<FileType>(file_inode.mode)))
     {
         return false;
     }
 
-    // Copy data blocks
-    uint32_t remaining_size = file_inode.size;
+    // Decrement link count
+    file_inode.links_count--;
 
-    // Direct blocks
-    for (uint32_t i = 0; i < DIRECT_BLOCKS && remaining_size > 0 && file_inode.blocks[i] != 0; i++)
+    if (file_inode.links_count == 0)
     {
-        char block_data[BLOCK_SIZE];
-        if (!read_block(file_inode.blocks[i], block_data))
-        {
-            sys_file.close();
-            return false;
-        }
-
-        uint32_t write_size = std::min(remaining_size, static_cast<uint32_t>(BLOCK_SIZE));
-        sys_file.write(block_data, write_size);
-        remaining_size -= write_size;
+        // Free the file's blocks and inode
+        free_inode(file_inode_num);
+    }
+    else
+    {
+        // Just update the inode
+        write_inode(file_inode_num, file_inode);
     }
 
-    // Handle indirect blocks if needed
-    if (remaining_size > 0 && file_inode.blocks[DIRECT_BLOCKS] != 0)
+    return true;
+}
+
+// Appends length bytes to the in-memory view of a file. The partial last
+// block is extended in place; the rest goes straight from data into freshly
+// reserved extents, one write per contiguous run. New blocks are recorded
+// in added, and map and size are written back by the caller.
+bool FileSystem::append_chunk(uint32_t inode_num, Inode &inode, std::vector<uint32_t> &map, uint32_t &size,
+                              const char *data, size_t length, std::vector<uint32_t> &added)
+{
+    size_t offset = 0;
+    uint32_t tail = size % BLOCK_SIZE;
+    if (tail > 0 && length > 0)
     {
-        uint32_t indirect_pointers[BLOCK_SIZE / sizeof(uint32_t)];
-        if (!read_block(file_inode.blocks[DIRECT_BLOCKS], indirect_pointers))
+        uint32_t index = map.size() - 1;
+        uint32_t block_num = map[index];
+        char block_data[BLOCK_SIZE] = {0};
+        uint32_t target;
+        std::unique_lock<std::recursive_mutex> alloc_lock(alloc_mutex, std::defer_lock);
+
+        if (block_num == 0)
+        {
+            // Hole: the tail gets a block of its own
+            target = allocate_block();
+            if (target != 0)
+            {
+                added.push_back(target);
+                map[index] = target;
+            }
+        }
+        else if (!read_block(block_num, block_data))
         {
-            sys_file.close();
             return false;
         }
-
-        for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t) && remaining_size > 0; i++)
+        else
         {
-            if (indirect_pointers[i] == 0)
+            // A block shared with a copy of this file must not change under it.
+            // The old reference is gone once this returns, so the new pointer
+            // is stored right away. The allocator stays locked until the block
+            // is written, so a deduplicating import cannot share it meanwhile.
+            alloc_lock.lock();
+            target = make_block_private(block_num);
+            if (target != 0 && target != block_num)
             {
-                continue;
+                map[index] = target;
+                if (!set_block_pointer(inode, index, target))
+                {
+                    return false;
+                }
+                write_inode(inode_num, inode);
             }
+        }
 
-            char block_data[BLOCK_SIZE];
-            if (!read_block(indirect_pointers[i], block_data))
-            {
-                sys_file.close();
-                return false;
-            }
+        if (target == 0)
+        {
+            return false;
+        }
 
-            uint32_t write_size = std::min(remaining_size, static_cast<uint32_t>(BLOCK_SIZE));
-            sys_file.write(block_data, write_size);
-            remaining_size -= write_size;
+        offset = std::min(length, static_cast<size_t>(BLOCK_SIZE - tail));
+        memcpy(block_data + tail, data, offset);
+        if (!write_block(target, block_data))
+        {
+            return false;
         }
+        size += offset;
     }
 
-    sys_file.close();
-    return true;
-}
+    size_t remaining = length - offset;
+    uint32_t count = (remaining + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (map.size() + count > MAX_FILE_BLOCKS)
+    {
+        return false;
+    }
 
-bool FileSystem::copy_from_system(const std::string &sys_path, const std::string &virt_path)
-{
-    // Open system file for reading
-    std::ifstream sys_file(sys_path, std::ios::binary | std::ios::ate);
-    if (!sys_file)
+    std::vector<uint32_t> fresh;
+    if (!allocate_extents(count, fresh))
     {
         return false;
     }
+    added.insert(added.end(), fresh.begin(), fresh.end());
 
-    // Get file size
-    size_t file_size = sys_file.tellg();
-    sys_file.seekg(0, std::ios::beg);
+    for (uint32_t i = 0; i < count;)
+    {
+        uint32_t run = 1;
+        while (i + run < count && fresh[i + run] == fresh[i] + run)
+        {
+            run++;
+        }
 
-    // Create virtual file
-    std::string abs_path = get_absolute_path(virt_path);
-    size_t pos = abs_path.find_last_of('/');
-    std::string parent_path, name;
+        const char *src = data + offset + static_cast<size_t>(i) * BLOCK_SIZE;
+        size_t run_bytes = std::min(static_cast<size_t>(run) * BLOCK_SIZE, remaining - static_cast<size_t>(i) * BLOCK_SIZE);
+        size_t whole = run_bytes / BLOCK_SIZE * BLOCK_SIZE;
+        if (whole > 0 && !cache.write_blocks(fresh[i], whole / BLOCK_SIZE, src))
+        {
+            return false;
+        }
+
+        // Bytes past the end of the file stay zero
+        if (whole < run_bytes)
+        {
+            char last[BLOCK_SIZE] = {0};
+            memcpy(last, src + whole, run_bytes - whole);
+            if (!cache.write_blocks(fresh[i] + whole / BLOCK_SIZE, 1, last))
+            {
+                return false;
+            }
+        }
 
-    if (pos == 0)
-    {
-        parent_path = "/";
-        name = abs_path.substr(1);
+        i += run;
     }
-    else
+
+    map.insert(map.end(), fresh.begin(), fresh.end());
+    size += remaining;
+    return true;
+}
+
+// Appends everything source produces to path. source fills up to max bytes
+// of its argument and returns the count, 0 at the end of the data and -1 on
+// error. Data is staged in a buffer that starts small and grows up to
+// IMPORT_BUFFER_SIZE, so an append never holds the whole payload in memory.
+// On failure the file keeps its old size and the new blocks are released.
+bool FileSystem::append_from_source(const std::string &path, const std::function<ssize_t(char *, size_t)> &source)
+{
+    if (read_only)
     {
-        parent_path = abs_path.substr(0, pos);
-        name = abs_path.substr(pos + 1);
+        return false;
     }
 
-    uint32_t file_inode_num = create_file(parent_path, name, FileType::REGULAR);
+    CacheOp op(cache);
+
+    uint32_t file_inode_num = find_inode_by_path(path);
     if (file_inode_num == 0)
     {
         return false;
     }
 
+    std::unique_lock<std::shared_mutex> lock(inode_lock(file_inode_num));
     Inode file_inode;
-    if (!read_inode(file_inode_num, file_inode))
+    if (!read_inode(file_inode_num, file_inode) ||
+        static_cast<FileType>(file_inode.mode) != FileType::REGULAR)
     {
         return false;
     }
 
-    // Copy data blocks
-    uint32_t remaining_size = file_size;
-    uint32_t block_count = 0;
-
-    // Direct blocks
-    for (uint32_t i = 0; i < DIRECT_BLOCKS && remaining_size > 0; i++)
+    // In-place updates work on plain blocks
+    std::vector<uint32_t> map;
+    if (!decompress_inode(file_inode_num, file_inode) || !load_block_map(file_inode, map))
     {
-        char block_data[BLOCK_SIZE] = {0};
+        return false;
+    }
 
-        uint32_t read_size = std::min(remaining_size, static_cast<uint32_t>(BLOCK_SIZE));
-        sys_file.read(block_data, read_size);
+    uint32_t size = file_inode.size;
+    std::vector<uint32_t> added;
+    std::vector<char> buffer(64 * 1024);
+    bool ok = true;
+    bool done = false;
 
-        uint32_t block_num = allocate_block();
-        if (block_num == 0)
+    while (ok && !done)
+    {
+        size_t filled = 0;
+        while (filled < buffer.size())
         {
-            // Failed to allocate block, clean up
-            file_inode.size = 0;
-            write_inode(file_inode_num, file_inode);
-            free_inode(file_inode_num);
-            return false;
+            ssize_t n = source(buffer.data() + filled, buffer.size() - filled);
+            if (n <= 0)
+            {
+                ok = n == 0;
+                done = true;
+                break;
+            }
+            filled += n;
         }
 
-        file_inode.blocks[i] = block_num;
-        if (!write_block(block_num, block_data))
+        ok = ok && append_chunk(file_inode_num, file_inode, map, size, buffer.data(), filled, added);
+
+        if (filled == buffer.size() && buffer.size() < IMPORT_BUFFER_SIZE)
         {
-            free_block(block_num);
-            file_inode.blocks[i] = 0;
-            file_inode.size = 0;
-            write_inode(file_inode_num, file_inode);
-            free_inode(file_inode_num);
-            return false;
+            buffer.resize(buffer.size() * 2);
         }
-
-        remaining_size -= read_size;
-        block_count++;
     }
 
-    // Handle indirect blocks if needed
-    if (remaining_size > 0)
+    file_inode.size = size;
+    if (!ok || !store_block_map(file_inode, map))
     {
-        uint32_t indirect_block = allocate_block();
-        if (indirect_block == 0)
-        {
-            // Clean up
-            for (uint32_t i = 0; i < block_count; i++)
-            {
-                free_block(file_inode.blocks[i]);
-                file_inode.blocks[i] = 0;
-            }
-            file_inode.size = 0;
-            write_inode(file_inode_num, file_inode);
-            free_inode(file_inode_num);
-            return false;
-        }
+        free_blocks(added);
+        return false;
+    }
 
-        file_inode.blocks[DIRECT_BLOCKS] = indirect_block;
+    write_inode(file_inode_num, file_inode);
+    return true;
+}
 
-        uint32_t indirect_pointers[BLOCK_SIZE / sizeof(uint32_t)] = {0};
-        uint32_t indirect_count = 0;
+bool FileSystem::append_to_file(const std::string &path, const char *data, size_t size)
+{
+    if (read_only)
+    {
+        return false;
+    }
 
-        for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t) && remaining_size > 0; i++)
-        {
-            char block_data[BLOCK_SIZE] = {0};
+    CacheOp op(cache);
 
-            uint32_t read_size = std::min(remaining_size, static_cast<uint32_t>(BLOCK_SIZE));
-            sys_file.read(block_data, read_size);
+    uint32_t file_inode_num = find_inode_by_path(path);
+    if (file_inode_num == 0)
+    {
+        return false;
+    }
 
-            uint32_t block_num = allocate_block();
-            if (block_num == 0)
-            {
-                // Clean up
-                for (uint32_t j = 0; j < block_count; j++)
-                {
-                    free_block(file_inode.blocks[j]);
-                    file_inode.blocks[j] = 0;
-                }
-                for (uint32_t j = 0; j < indirect_count; j++)
-                {
-                    free_block(indirect_pointers[j]);
-                }
-                free_block(indirect_block);
-                file_inode.blocks[DIRECT_BLOCKS] = 0;
-                file_inode.size = 0;
-                write_inode(file_inode_num, file_inode);
-                free_inode(file_inode_num);
-                return false;
-            }
+    std::unique_lock<std::shared_mutex> lock(inode_lock(file_inode_num));
+    Inode file_inode;
+    if (!read_inode(file_inode_num, file_inode) ||
+        static_cast<FileType>(file_inode.mode) != FileType::REGULAR)
+    {
+        return false;
+    }
 
-            indirect_pointers[i] = block_num;
-            if (!write_block(block_num, block_data))
-            {
-                free_block(block_num);
-                // Clean up
-                for (uint32_t j = 0; j < block_count; j++)
-                {
-                    free_block(file_inode.blocks[j]);
-                    file_inode.blocks[j] = 0;
-                }
-                for (uint32_t j = 0; j < indirect_count; j++)
-                {
-                    free_block(indirect_pointers[j]);
-                }
-                free_block(indirect_block);
-                file_inode.blocks[DIRECT_BLOCKS] = 0;
-                file_inode.size = 0;
-                write_inode(file_inode_num, file_inode);
-                free_inode(file_inode_num);
-                return false;
-            }
+    std::vector<uint32_t> map;
+    if (!decompress_inode(file_inode_num, file_inode) || !load_block_map(file_inode, map))
+    {
+        return false;
+    }
 
-            remaining_size -= read_size;
-            indirect_count++;
-        }
+    // The caller's buffer is written from directly, without staging
+    uint32_t new_size = file_inode.size;
+    std::vector<uint32_t> added;
+    bool ok = append_chunk(file_inode_num, file_inode, map, new_size, data, size, added);
 
-        // Write indirect block pointers
-        write_block(indirect_block, indirect_pointers);
+    file_inode.size = new_size;
+    if (!ok || !store_block_map(file_inode, map))
+    {
+        free_blocks(added);
+        return false;
     }
 
-    // Update file size
-    file_inode.size = file_size;
     write_inode(file_inode_num, file_inode);
-
-    sys_file.close();
     return true;
 }
 
-std::vector<std::pair<std::string, uint32_t>> FileSystem::list_directory(const std::string &path)
+// Replaces the contents of a regular file, creating it if needed. The file
+// stays locked throughout, so readers see either the old or the new data.
+bool FileSystem::write_file(const std::string &path, const char *data, size_t size)
 {
-    std::vector<std::pair<std::string, uint32_t>> result;
-
-    uint32_t dir_inode_num = find_inode_by_path(path);
-    if (dir_inode_num == 0)
+    if (read_only)
     {
-        return result;
+        return false;
     }
 
-    Inode dir_inode;
-    if (!read_inode(dir_inode_num, dir_inode))
+    CacheOp op(cache);
+
+    uint32_t file_inode_num = find_inode_by_path(path);
+    if (file_inode_num == 0)
     {
-        return result;
+        // Another writer may have created it in the meantime
+        create_file(path);
+        file_inode_num = find_inode_by_path(path);
+        if (file_inode_num == 0)
+        {
+            return false;
+        }
     }
 
-    // Check if it's a directory
-    if (static_cast<FileType>(dir_inode.mode) != FileType::DIRECTORY)
+    std::unique_lock<std::shared_mutex> lock(inode_lock(file_inode_num));
+    Inode file_inode;
+    if (!read_inode(file_inode_num, file_inode) ||
+        static_cast<FileType>(file_inode.mode) != FileType::REGULAR ||
+        !resize_inode(file_inode_num, file_inode, 0))
     {
-        return result;
+        return false;
     }
 
-    // Scan directory blocks
-    for (uint32_t i = 0; i < DIRECT_BLOCKS && dir_inode.blocks[i] != 0; i++)
+    // resize_inode left the file plain and empty
+    std::vector<uint32_t> map;
+    if (!load_block_map(file_inode, map))
     {
-        char block_data[BLOCK_SIZE];
-        if (!read_block(dir_inode.blocks[i], block_data))
-        {
-            continue;
-        }
+        return false;
+    }
 
-        // Scan directory entries
-        char *ptr = block_data;
-        while (ptr < block_data + BLOCK_SIZE)
-        {
-            DirEntry *entry = reinterpret_cast<DirEntry *>(ptr);
-            if (entry->inode == 0 || entry->rec_len == 0)
-            {
-                break;
-            }
+    uint32_t new_size = 0;
+    std::vector<uint32_t> added;
+    bool ok = append_chunk(file_inode_num, file_inode, map, new_size, data, size, added);
 
-            // Skip . and ..
-            if ((entry->name_len == 1 && entry->name[0] == '.') ||
-                (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.'))
-            {
-                ptr += entry->rec_len;
-                continue;
-            }
+    file_inode.size = new_size;
+    if (!ok || !store_block_map(file_inode, map))
+    {
+        free_blocks(added);
+        return false;
+    }
 
-            std::string name(entry->name, entry->name_len);
+    write_inode(file_inode_num, file_inode);
+    return true;
+}
 
-            // Read file/directory inode to get size
-            Inode entry_inode;
-            if (read_inode(entry->inode, entry_inode))
-            {
-                result.push_back(std::make_pair(name, entry_inode.size));
-            }
+bool FileSystem::append_from_stream(const std::string &path, std::istream &in)
+{
+    return append_from_source(path, [&in](char *buffer, size_t max) -> ssize_t
+                              {
+                                  in.read(buffer, max);
+                                  return in.bad() ? -1 : in.gcount();
+                              });
+}
 
-            ptr += entry->rec_len;
-        }
-    }
+bool FileSystem::append_from_fd(const std::string &path, int fd)
+{
+    return append_from_source(path, [fd](char *buffer, size_t max) -> ssize_t
+                              {
+                                  ssize_t n;
+                                  do
+                                  {
+                                      n = read(fd, buffer, max);
+                                  } while (n < 0 && errno == EINTR);
+                                  return n;
+                              });
+}
 
-    return result;
+// Appends bytes of 'A'..'Z' filler, generated one buffer at a time
+bool FileSystem::append_to_file(const std::string &path, size_t bytes)
+{
+    size_t produced = 0;
+    return append_from_source(path, [&produced, bytes](char *buffer, size_t max) -> ssize_t
+                              {
+                                  size_t n = std::min(max, bytes - produced);
+                                  for (size_t i = 0; i < n; i++)
+                                  {
+                                      buffer[i] = 'A' + ((produced + i) % 26);
+                                  }
+                                  produced += n;
+                                  return n;
+                              });
 }
 
-bool FileSystem::create_link(const std::string &target, const std::string &link_path)
+// Sets the size of a file. Growing adds holes; shrinking drops the blocks
+// past the new end in a single bitmap update. Either way the bytes past the
+// end of the last partial block are zeroed, so a later grow reads zeros.
+bool FileSystem::truncate_to_size(const std::string &path, size_t new_size)
 {
-    uint32_t target_inode_num = find_inode_by_path(target);
-    if (target_inode_num == 0)
+    if (read_only)
     {
         return false;
     }
 
-    Inode target_inode;
-    if (!read_inode(target_inode_num, target_inode))
+    CacheOp op(cache);
+
+    uint32_t file_inode_num = find_inode_by_path(path);
+    if (file_inode_num == 0)
     {
         return false;
     }
 
-    // Get parent path and name for the link
-    std::string abs_link_path = get_absolute_path(link_path);
-    size_t pos = abs_link_path.find_last_of('/');
-    std::string parent_path, name;
+    std::unique_lock<std::shared_mutex> lock(inode_lock(file_inode_num));
+    Inode file_inode;
+    return read_inode(file_inode_num, file_inode) &&
+           static_cast<FileType>(file_inode.mode) == FileType::REGULAR &&
+           resize_inode(file_inode_num, file_inode, new_size);
+}
 
-    if (pos == 0)
-    {
-        parent_path = "/";
-        name = abs_link_path.substr(1);
-    }
-    else
+// truncate_to_size for a file the caller has locked
+bool FileSystem::resize_inode(uint32_t file_inode_num, Inode &file_inode, size_t new_size)
+{
+    if (new_size > static_cast<size_t>(MAX_FILE_BLOCKS) * BLOCK_SIZE)
     {
-        parent_path = abs_link_path.substr(0, pos);
-        name = abs_link_path.substr(pos + 1);
+        return false;
     }
 
-    uint32_t parent_inode_num = find_inode_by_path(parent_path);
-    if (parent_inode_num == 0)
+    // In-place updates work on plain blocks
+    std::vector<uint32_t> map;
+    if (!decompress_inode(file_inode_num, file_inode) || !load_block_map(file_inode, map))
     {
         return false;
     }
 
-    Inode parent_inode;
-    if (!read_inode(parent_inode_num, parent_inode))
+    uint32_t new_blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<uint32_t> released;
+    for (uint32_t i = new_blocks; i < map.size(); i++)
     {
-        return false;
+        if (map[i] != 0)
+        {
+            released.push_back(map[i]);
+        }
     }
+    map.resize(new_blocks, 0);
 
-    // Check if parent is a directory
-    if (static_cast<FileType>(parent_inode.mode) != FileType::DIRECTORY)
+    // The indirect block goes out with the data blocks
+    if (new_blocks <= DIRECT_BLOCKS && file_inode.blocks[DIRECT_BLOCKS] != 0)
     {
-        return false;
+        released.push_back(file_inode.blocks[DIRECT_BLOCKS]);
+        file_inode.blocks[DIRECT_BLOCKS] = 0;
     }
 
-    // Add directory entry for the link
-    for (uint32_t i = 0; i < DIRECT_BLOCKS; i++)
+    // Zero the tail of the block holding the new end of the data
+    uint32_t keep = std::min(static_cast<size_t>(file_inode.size), new_size);
+    uint32_t tail = keep % BLOCK_SIZE;
+    uint32_t boundary = keep / BLOCK_SIZE;
+    if (tail > 0 && map[boundary] != 0)
     {
-        if (parent_inode.blocks[i] == 0)
+        // Allocator locked for the same reason as in append_chunk
+        std::lock_guard<std::recursive_mutex> alloc_lock(alloc_mutex);
+        char block_data[BLOCK_SIZE];
+        if (!read_block(map[boundary], block_data))
         {
-            // Allocate new block for directory
-            uint32_t new_block = allocate_block();
-            if (new_block == 0)
-            {
-                return false;
-            }
-
-            parent_inode.blocks[i] = new_block;
-
-            // Initialize new directory block
-            DirEntry new_entry;
-            new_entry.inode = target_inode_num;
-            new_entry.rec_len = sizeof(DirEntry);
-            new_entry.name_len = name.length();
-            new_entry.file_type = static_cast<uint8_t>(static_cast<FileType>(target_inode.mode));
-            strncpy(new_entry.name, name.c_str(), 255);
-            new_entry.name[255] = '\0';
-
-            // Write directory block
-            write_block(new_block, &new_entry);
-            break;
+            return false;
         }
-        else
+        memset(block_data + tail, 0, BLOCK_SIZE - tail);
+
+        // A block shared with a copy of this file must not change under it
+        uint32_t target = make_block_private(map[boundary]);
+        if (target == 0 || !write_block(target, block_data))
         {
-            // Try to add to existing block
-            char block_data[BLOCK_SIZE];
-            if (read_block(parent_inode.blocks[i], block_data))
-            {
-                // Find space for new entry
-                char *ptr = block_data;
-                DirEntry *last_entry = nullptr;
+            return false;
+        }
+        map[boundary] = target;
+    }
 
-                while (ptr < block_data + BLOCK_SIZE)
-                {
-                    DirEntry *entry = reinterpret_cast<DirEntry *>(ptr);
-                    if (entry->inode == 0 || entry->rec_len == 0)
-                    {
-                        // Found empty slot
-                        entry->inode = target_inode_num;
-                        entry->rec_len = sizeof(DirEntry);
-                        entry->name_len = name.length();
-                        entry->file_type = static_cast<uint8_t>(static_cast<FileType>(target_inode.mode));
-                        strncpy(entry->name, name.c_str(), 255);
-                        entry->name[255] = '\0';
-
-                        write_block(parent_inode.blocks[i], block_data);
-                        break;
-                    }
+    if (!store_block_map(file_inode, map))
+    {
+        return false;
+    }
 
-                    last_entry = entry;
-                    ptr += entry->rec_len;
-                }
+    file_inode.size = new_size;
+    write_inode(file_inode_num, file_inode);
+    free_blocks(released);
+    return true;
+}
 
-                if (last_entry && ptr + sizeof(DirEntry) <= block_data + BLOCK_SIZE)
-                {
-                    // Add at the end
-                    DirEntry *new_entry = reinterpret_cast<DirEntry *>(ptr);
-                    new_entry->inode = target_inode_num;
-                    new_entry->rec_len = sizeof(DirEntry);
-                    new_entry->name_len = name.length();
-                    new_entry->file_type = static_cast<uint8_t>(static_cast<FileType>(target_inode.mode));
-                    strncpy(new_entry->name, name.c_str(), 255);
-                    new_entry->name[255] = '\0';
-
-                    write_block(parent_inode.blocks[i], block_data);
-                    break;
-                }
-            }
-        }
+// Shrinks a file by bytes
+bool FileSystem::truncate_file(const std::string &path, size_t bytes)
+{
+    if (read_only)
+    {
+        return false;
     }
 
-    // Increment link count
-    target_inode.links_count++;
-    write_inode(target_inode_num, target_inode);
+    CacheOp op(cache);
 
-    // Update parent inode
-    write_inode(parent_inode_num, parent_inode);
+    uint32_t file_inode_num = find_inode_by_path(path);
+    if (file_inode_num == 0)
+    {
+        return false;
+    }
 
-    return true;
+    // The new size is computed under the same lock that applies it
+    std::unique_lock<std::shared_mutex> lock(inode_lock(file_inode_num));
+    Inode file_inode;
+    return read_inode(file_inode_num, file_inode) &&
+           static_cast<FileType>(file_inode.mode) == FileType::REGULAR && file_inode.size >= bytes &&
+           resize_inode(file_inode_num, file_inode, file_inode.size - bytes);
 }
 
-bool FileSystem::remove_file(const std::string &path)
+// Finds the first offset at or after offset that holds data (hole false) or
+// lies in a hole (hole true), like lseek with SEEK_DATA / SEEK_HOLE. The end
+// of the file counts as a hole. Compressed files are reported as all data.
+bool FileSystem::seek_extent(const std::string &path, uint32_t offset, bool hole, uint32_t &result)
 {
     uint32_t file_inode_num = find_inode_by_path(path);
     if (file_inode_num == 0)
@@ -1265,351 +4034,582 @@ bool FileSystem::remove_file(const std::string &path)
         return false;
     }
 
+    std::shared_lock<std::shared_mutex> lock = read_lock(file_inode_num);
     Inode file_inode;
-    if (!read_inode(file_inode_num, file_inode))
+    std::vector<uint32_t> map;
+    if (!read_inode(file_inode_num, file_inode) ||
+        static_cast<FileType>(file_inode.mode) != FileType::REGULAR ||
+        offset >= file_inode.size || !load_block_map(file_inode, map))
     {
         return false;
     }
 
-    // Get parent directory
-    std::string abs_path = get_absolute_path(path);
-    size_t pos = abs_path.find_last_of('/');
-    std::string parent_path, name;
+    bool compressed = file_inode.flags & INODE_FLAG_COMPRESSED;
+    for (uint32_t i = offset / BLOCK_SIZE; i < map.size(); i++)
+    {
+        bool is_hole = !compressed && map[i] == 0;
+        if (is_hole == hole)
+        {
+            result = std::max(offset, i * static_cast<uint32_t>(BLOCK_SIZE));
+            return true;
+        }
+    }
 
-    if (pos == 0)
+    if (hole)
     {
-        parent_path = "/";
-        name = abs_path.substr(1);
+        result = file_inode.size;
+        return true;
     }
-    else
+    return false;
+}
+
+bool FileSystem::seek_data(const std::string &path, uint32_t offset, uint32_t &result)
+{
+    return seek_extent(path, offset, false, result);
+}
+
+bool FileSystem::seek_hole(const std::string &path, uint32_t offset, uint32_t &result)
+{
+    return seek_extent(path, offset, true, result);
+}
+
+bool FileSystem::get_file_size(const std::string &path, uint32_t &size)
+{
+    uint32_t inode_num = find_inode_by_path(path);
+    if (inode_num == 0)
     {
-        parent_path = abs_path.substr(0, pos);
-        name = abs_path.substr(pos + 1);
+        return false;
     }
 
-    uint32_t parent_inode_num = find_inode_by_path(parent_path);
-    if (parent_inode_num == 0)
+    std::shared_lock<std::shared_mutex> lock = read_lock(inode_num);
+    Inode inode;
+    if (!read_inode(inode_num, inode) || static_cast<FileType>(inode.mode) != FileType::REGULAR)
     {
         return false;
     }
 
-    Inode parent_inode;
-    if (!read_inode(parent_inode_num, parent_inode))
+    size = inode.size;
+    return true;
+}
+
+std::pair<uint32_t, uint32_t> FileSystem::get_disk_usage()
+{
+    std::unique_lock<std::recursive_mutex> lock(alloc_mutex, std::defer_lock);
+    if (!read_only)
+    {
+        lock.lock();
+    }
+    uint32_t used_blocks = superblock.blocks_count - superblock.free_blocks_count;
+    uint32_t total_blocks = superblock.blocks_count;
+
+    return std::make_pair(used_blocks, total_blocks);
+}
+
+DedupStats FileSystem::get_dedup_stats()
+{
+    std::unique_lock<std::recursive_mutex> lock(alloc_mutex, std::defer_lock);
+    if (!read_only)
     {
-        return false;
+        lock.lock();
     }
-
-    // Remove directory entry from parent
-    for (uint32_t i = 0; i < DIRECT_BLOCKS && parent_inode.blocks[i] != 0; i++)
+    DedupStats stats = {};
+    stats.index_slots = dedup_index.size();
+    for (const DedupSlot &slot : dedup_index)
     {
-        char block_data[BLOCK_SIZE];
-        if (!read_block(parent_inode.blocks[i], block_data))
+        if (slot.block != 0)
         {
-            continue;
+            stats.index_entries++;
         }
+    }
 
-        // Scan directory entries
-        char *ptr = block_data;
-        while (ptr < block_data + BLOCK_SIZE)
+    stats.blocks_hashed = superblock.dedup_hashed;
+    stats.dedup_hits = superblock.dedup_hits;
+    for (uint16_t refs : block_refs)
+    {
+        if (refs > 0)
         {
-            DirEntry *entry = reinterpret_cast<DirEntry *>(ptr);
-            if (entry->inode == 0 || entry->rec_len == 0)
-            {
-                break;
-            }
-
-            if (entry->inode == file_inode_num)
-            {
-                // Remove entry
-                entry->inode = 0;
-                write_block(parent_inode.blocks[i], block_data);
-                break;
-            }
-
-            ptr += entry->rec_len;
+            stats.shared_blocks++;
+            stats.saved_blocks += refs;
         }
     }
 
-    // Decrement link count
-    file_inode.links_count--;
-
-    if (file_inode.links_count == 0)
-    {
-        // Free the file's blocks and inode
-        free_inode(file_inode_num);
-    }
-    else
-    {
-        // Just update the inode
-        write_inode(file_inode_num, file_inode);
-    }
+    return stats;
+}
 
-    return true;
+bool FileSystem::read_snapshots(std::vector<SnapshotEntry> &table)
+{
+    table.assign(MAX_SNAPSHOTS, SnapshotEntry());
+    return superblock.snapshot_block == 0 || read_block(superblock.snapshot_block, table.data());
 }
 
-bool FileSystem::append_to_file(const std::string &path, size_t bytes)
+// The table block is allocated with the first snapshot
+bool FileSystem::write_snapshots(const std::vector<SnapshotEntry> &table)
 {
-    uint32_t file_inode_num = find_inode_by_path(path);
-    if (file_inode_num == 0)
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    if (superblock.snapshot_block != 0)
     {
-        return false;
+        return write_block(superblock.snapshot_block, table.data());
     }
 
-    Inode file_inode;
-    if (!read_inode(file_inode_num, file_inode))
+    uint32_t table_block = allocate_block();
+    if (table_block == 0 || !write_block(table_block, table.data()))
     {
+        if (table_block != 0)
+        {
+            free_block(table_block);
+        }
         return false;
     }
+    superblock.snapshot_block = table_block;
+    return write_superblock();
+}
 
-    // Check if it's a regular file
-    if (static_cast<FileType>(file_inode.mode) != FileType::REGULAR)
+// Copy of a file or symlink inode that shares its data blocks, cluster map
+// and target block with the original. Blocks whose reference count is
+// saturated are copied instead. Returns 0 on failure.
+uint32_t FileSystem::clone_inode(const Inode &src)
+{
+    std::vector<uint32_t> map;
+    bool symlink = static_cast<FileType>(src.mode) == FileType::SYMLINK;
+    if (symlink)
     {
-        return false;
+        map.assign(src.blocks, src.blocks + DIRECT_BLOCKS);
     }
-
-    // Calculate current block count and position
-    uint32_t current_size = file_inode.size;
-    uint32_t current_blocks = (current_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    uint32_t position_in_last_block = current_size % BLOCK_SIZE;
-
-    // Generate random data to append
-    char *append_data = new char[bytes];
-    for (size_t i = 0; i < bytes; i++)
+    else if (!load_block_map(src, map))
     {
-        append_data[i] = 'A' + (i % 26);
+        return 0;
     }
+    map.push_back(src.cluster_map);
 
-    // Append data
-    uint32_t bytes_left = bytes;
-    uint32_t data_offset = 0;
-
-    // First, fill the last block if it's not full
-    if (position_in_last_block > 0 && current_blocks > 0)
+    std::vector<uint32_t> taken;
+    bool ok = true;
+    for (size_t i = 0; ok && i < map.size(); i++)
     {
-        uint32_t block_index = current_blocks - 1;
-        uint32_t block_num;
-
-        if (block_index < DIRECT_BLOCKS)
+        if (map[i] == 0)
         {
-            block_num = file_inode.blocks[block_index];
+            continue;
         }
-        else
+        if (share_block(map[i]))
         {
-            // Use indirect block
-            uint32_t indirect_index = block_index - DIRECT_BLOCKS;
-            uint32_t indirect_pointers[BLOCK_SIZE / sizeof(uint32_t)];
-
-            if (!read_block(file_inode.blocks[DIRECT_BLOCKS], indirect_pointers))
-            {
-                delete[] append_data;
-                return false;
-            }
-
-            block_num = indirect_pointers[indirect_index];
+            taken.push_back(map[i]);
+            continue;
         }
 
         char block_data[BLOCK_SIZE];
-        if (!read_block(block_num, block_data))
+        uint32_t copy = allocate_block();
+        if (copy != 0)
         {
-            delete[] append_data;
-            return false;
+            taken.push_back(copy);
         }
+        ok = copy != 0 && read_block(map[i], block_data) && write_block(copy, block_data);
+        map[i] = copy;
+    }
+    write_refcounts();
 
-        uint32_t space_left = BLOCK_SIZE - position_in_last_block;
-        uint32_t bytes_to_write = std::min(bytes_left, space_left);
-
-        memcpy(block_data + position_in_last_block, append_data, bytes_to_write);
+    Inode dst = src;
+    dst.cluster_map = map.back();
+    map.pop_back();
+    uint32_t inode_num = ok ? allocate_inode() : 0;
+    if (symlink)
+    {
+        std::copy(map.begin(), map.end(), dst.blocks);
+    }
+    else
+    {
+        dst.blocks[DIRECT_BLOCKS] = 0;
+        ok = inode_num != 0 && store_block_map(dst, map);
+    }
 
-        if (!write_block(block_num, block_data))
+    if (inode_num == 0 || !ok || !write_inode(inode_num, dst))
+    {
+        free_blocks(taken);
+        if (inode_num != 0)
         {
-            delete[] append_data;
-            return false;
+            if (!symlink && dst.blocks[DIRECT_BLOCKS] != 0)
+            {
+                free_block(dst.blocks[DIRECT_BLOCKS]);
+            }
+            free_inode(inode_num);
         }
-
-        bytes_left -= bytes_to_write;
-        data_offset += bytes_to_write;
+        return 0;
     }
+    return inode_num;
+}
 
-    // Allocate new blocks for remaining data
-    while (bytes_left > 0)
+// Copies the live directory tree under a new root that no directory links
+// to. Directories get new blocks, hard links stay hard links within the
+// copy, directory links included, so a linked directory is copied once and
+// a link back to an ancestor cannot recurse. Returns the new root, or 0
+// after undoing a partial copy.
+uint32_t FileSystem::clone_tree()
+{
+    std::vector<uint32_t> created;
+    auto make_directory = [&](uint32_t parent) -> uint32_t
     {
-        uint32_t new_block = allocate_block();
-        if (new_block == 0)
+        uint32_t inode_num = allocate_inode();
+        if (inode_num == 0)
         {
-            delete[] append_data;
-            return false;
+            return 0;
         }
+        created.push_back(inode_num);
 
-        char block_data[BLOCK_SIZE] = {0};
-        uint32_t bytes_to_write = std::min(bytes_left, static_cast<uint32_t>(BLOCK_SIZE));
+        Inode inode;
+        inode.mode = static_cast<uint32_t>(FileType::DIRECTORY);
+        inode.links_count = 1;
+        inode.blocks[0] = allocate_block();
+
+        char dir_data[BLOCK_SIZE] = {0};
+        DirEntry *entries = reinterpret_cast<DirEntry *>(dir_data);
+        entries[0].inode = inode_num;
+        entries[0].rec_len = sizeof(DirEntry);
+        entries[0].name_len = 1;
+        entries[0].file_type = static_cast<uint8_t>(FileType::DIRECTORY);
+        strcpy(entries[0].name, ".");
+        entries[1].inode = parent != 0 ? parent : inode_num; // The root is its own parent
+        entries[1].rec_len = sizeof(DirEntry);
+        entries[1].name_len = 2;
+        entries[1].file_type = static_cast<uint8_t>(FileType::DIRECTORY);
+        strcpy(entries[1].name, "..");
 
-        memcpy(block_data, append_data + data_offset, bytes_to_write);
+        bool ok = inode.blocks[0] != 0 && write_block(inode.blocks[0], dir_data);
+        write_inode(inode_num, inode);
+        return ok ? inode_num : 0;
+    };
+
+    uint32_t root = make_directory(0);
+    std::unordered_map<uint32_t, uint32_t> clones;             // Live inode -> its copy
+    std::vector<std::pair<uint32_t, uint32_t>> pending;        // <live directory, copy>
+    bool ok = root != 0;
+    if (ok)
+    {
+        clones[1] = root;
+        pending.push_back({1, root});
+    }
 
-        if (!write_block(new_block, block_data))
-        {
-            free_block(new_block);
-            delete[] append_data;
-            return false;
-        }
+    while (ok && !pending.empty())
+    {
+        auto [dir_inode_num, copy_num] = pending.back();
+        pending.pop_back();
 
-        // Store block pointer
-        if (current_blocks < DIRECT_BLOCKS)
+        Inode dir_inode;
+        std::vector<std::pair<std::string, uint32_t>> entries;
+        ok = read_inode(dir_inode_num, dir_inode) && read_dir_entries(dir_inode, entries);
+        for (size_t i = 0; ok && i < entries.size(); i++)
         {
-            file_inode.blocks[current_blocks] = new_block;
-        }
-        else
-        {
-            // Use indirect block
-            uint32_t indirect_index = current_blocks - DIRECT_BLOCKS;
+            const auto &[name, child_num] = entries[i];
+            Inode child;
+            ok = read_inode(child_num, child);
+            FileType type = static_cast<FileType>(child.mode);
 
-            if (indirect_index == 0)
+            uint32_t child_copy = 0;
+            if (!ok)
+            {
+                break;
+            }
+            else if (clones.count(child_num) > 0)
             {
-                // Allocate indirect block
-                uint32_t indirect_block = allocate_block();
-                if (indirect_block == 0)
+                // Another name for something already copied. A file copy
+                // took the live link count; a directory copy counts its names.
+                child_copy = clones[child_num];
+                Inode copy;
+                if (type == FileType::DIRECTORY && (ok = read_inode(child_copy, copy)))
                 {
-                    free_block(new_block);
-                    delete[] append_data;
-                    return false;
+                    copy.links_count++;
+                    write_inode(child_copy, copy);
                 }
+            }
+            else if (type == FileType::DIRECTORY)
+            {
+                child_copy = make_directory(copy_num);
+                clones[child_num] = child_copy;
+                pending.push_back({child_num, child_copy});
+            }
+            else if ((child_copy = clone_inode(child)) != 0)
+            {
+                created.push_back(child_copy);
+                clones[child_num] = child_copy;
+            }
+            ok = child_copy != 0 && add_dir_entry(copy_num, name, child_copy, type);
+        }
+    }
 
-                file_inode.blocks[DIRECT_BLOCKS] = indirect_block;
+    if (!ok)
+    {
+        for (uint32_t inode_num : created)
+        {
+            free_inode(inode_num);
+        }
+        return 0;
+    }
+    return root;
+}
 
-                uint32_t indirect_pointers[BLOCK_SIZE / sizeof(uint32_t)] = {0};
-                indirect_pointers[0] = new_block;
+// Removes a copy made by clone_tree: files go when their last name in it
+// does, directories after everything in them. A directory with several
+// names is walked and freed once.
+void FileSystem::drop_tree(uint32_t root)
+{
+    std::vector<uint32_t> directories = {root};
+    std::unordered_set<uint32_t> visited_dirs = {root};
+    for (size_t d = 0; d < directories.size(); d++)
+    {
+        Inode dir_inode;
+        std::vector<std::pair<std::string, uint32_t>> entries;
+        if (!read_inode(directories[d], dir_inode) || !read_dir_entries(dir_inode, entries))
+        {
+            continue;
+        }
 
-                if (!write_block(indirect_block, indirect_pointers))
+        for (const auto &entry : entries)
+        {
+            Inode inode;
+            if (!read_inode(entry.second, inode))
+            {
+                continue;
+            }
+            if (static_cast<FileType>(inode.mode) == FileType::DIRECTORY)
+            {
+                if (visited_dirs.insert(entry.second).second)
                 {
-                    free_block(indirect_block);
-                    free_block(new_block);
-                    file_inode.blocks[DIRECT_BLOCKS] = 0;
-                    delete[] append_data;
-                    return false;
+                    directories.push_back(entry.second);
                 }
             }
+            else if (inode.links_count <= 1)
+            {
+                free_inode(entry.second);
+            }
             else
             {
-                // Update existing indirect block
-                uint32_t indirect_pointers[BLOCK_SIZE / sizeof(uint32_t)];
-
-                if (!read_block(file_inode.blocks[DIRECT_BLOCKS], indirect_pointers))
-                {
-                    free_block(new_block);
-                    delete[] append_data;
-                    return false;
-                }
-
-                indirect_pointers[indirect_index] = new_block;
-
-                if (!write_block(file_inode.blocks[DIRECT_BLOCKS], indirect_pointers))
-                {
-                    free_block(new_block);
-                    delete[] append_data;
-                    return false;
-                }
+                inode.links_count--;
+                write_inode(entry.second, inode);
             }
         }
-
-        bytes_left -= bytes_to_write;
-        data_offset += bytes_to_write;
-        current_blocks++;
     }
 
-    // Update file size
-    file_inode.size += bytes;
-    write_inode(file_inode_num, file_inode);
-
-    delete[] append_data;
-    return true;
+    for (uint32_t dir_inode_num : directories)
+    {
+        free_inode(dir_inode_num);
+    }
 }
 
-bool FileSystem::truncate_file(const std::string &path, size_t bytes)
+bool FileSystem::create_snapshot(const std::string &name)
 {
-    uint32_t file_inode_num = find_inode_by_path(path);
-    if (file_inode_num == 0)
+    if (read_only || name.empty() || name.length() > SNAPSHOT_NAME_MAX)
     {
         return false;
     }
 
-    Inode file_inode;
-    if (!read_inode(file_inode_num, file_inode))
+    // Writers wait until the copy is complete, so it shows a single moment
+    ExclusiveCacheOp op(cache);
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+
+    std::vector<SnapshotEntry> table;
+    if (!ensure_refcount_table() || !read_snapshots(table))
     {
         return false;
     }
 
-    // Check if it's a regular file
-    if (static_cast<FileType>(file_inode.mode) != FileType::REGULAR)
+    SnapshotEntry *slot = nullptr;
+    for (SnapshotEntry &entry : table)
+    {
+        if (entry.root != 0 && name == entry.name)
+        {
+            return false;
+        }
+        if (entry.root == 0 && slot == nullptr)
+        {
+            slot = &entry;
+        }
+    }
+
+    uint32_t root = slot != nullptr ? clone_tree() : 0;
+    if (root == 0)
     {
         return false;
     }
 
-    // Check if file is big enough to truncate
-    if (file_inode.size < bytes)
+    *slot = SnapshotEntry();
+    memcpy(slot->name, name.data(), name.length());
+    slot->root = root;
+    slot->created = static_cast<uint64_t>(std::time(nullptr));
+    if (!write_snapshots(table))
     {
+        drop_tree(root);
         return false;
     }
+    return true;
+}
 
-    // Calculate new size and blocks needed
-    uint32_t new_size = file_inode.size - bytes;
-    uint32_t new_blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    uint32_t current_blocks = (file_inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+// The entry goes first, so a snapshot is never half visible
+bool FileSystem::delete_snapshot(const std::string &name)
+{
+    if (read_only)
+    {
+        return false;
+    }
 
-    // Free blocks that are no longer needed
-    if (new_blocks < current_blocks)
+    CacheOp op(cache);
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+
+    std::vector<SnapshotEntry> table;
+    if (!read_snapshots(table))
+    {
+        return false;
+    }
+    for (SnapshotEntry &entry : table)
     {
-        // First, handle indirect blocks if any
-        if (current_blocks > DIRECT_BLOCKS && file_inode.blocks[DIRECT_BLOCKS] != 0)
+        if (entry.root != 0 && name == entry.name)
         {
-            uint32_t indirect_pointers[BLOCK_SIZE / sizeof(uint32_t)];
-
-            if (read_block(file_inode.blocks[DIRECT_BLOCKS], indirect_pointers))
+            uint32_t root = entry.root;
+            entry = SnapshotEntry();
+            if (!write_snapshots(table))
             {
-                for (uint32_t i = (new_blocks > DIRECT_BLOCKS ? new_blocks - DIRECT_BLOCKS : 0);
-                     i < current_blocks - DIRECT_BLOCKS; i++)
-                {
-                    if (indirect_pointers[i] != 0)
-                    {
-                        free_block(indirect_pointers[i]);
-                        indirect_pointers[i] = 0;
-                    }
-                }
-
-                // If we don't need the indirect block anymore, free it
-                if (new_blocks <= DIRECT_BLOCKS)
-                {
-                    free_block(file_inode.blocks[DIRECT_BLOCKS]);
-                    file_inode.blocks[DIRECT_BLOCKS] = 0;
-                }
-                else
-                {
-                    // Otherwise write back the updated pointers
-                    write_block(file_inode.blocks[DIRECT_BLOCKS], indirect_pointers);
-                }
+                return false;
             }
+            drop_tree(root);
+            return true;
         }
+    }
+    return false;
+}
 
-        // Handle direct blocks
-        for (uint32_t i = new_blocks; i < std::min(current_blocks, static_cast<uint32_t>(DIRECT_BLOCKS)); i++)
+std::vector<std::pair<std::string, uint64_t>> FileSystem::list_snapshots()
+{
+    std::lock_guard<std::mutex> lock(snapshot_mutex);
+    std::vector<std::pair<std::string, uint64_t>> result;
+    std::vector<SnapshotEntry> table;
+    if (read_snapshots(table))
+    {
+        for (const SnapshotEntry &entry : table)
         {
-            if (file_inode.blocks[i] != 0)
+            if (entry.root != 0)
             {
-                free_block(file_inode.blocks[i]);
-                file_inode.blocks[i] = 0;
+                result.push_back({entry.name, entry.created});
             }
         }
     }
+    return result;
+}
 
-    // Update file size
-    file_inode.size = new_size;
-    write_inode(file_inode_num, file_inode);
+bool FileSystem::open_snapshot(const std::string &name)
+{
+    std::vector<SnapshotEntry> table;
+    if (!read_only || !read_snapshots(table))
+    {
+        return false;
+    }
+    for (const SnapshotEntry &entry : table)
+    {
+        if (entry.root != 0 && name == entry.name)
+        {
+            root_inode = entry.root;
+            return true;
+        }
+    }
+    return false;
+}
 
-    return true;
+// The map is created by the first export, which holds every block anyway
+bool FileSystem::ensure_change_map()
+{
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    if (superblock.changes_block != 0)
+    {
+        return true;
+    }
+
+    uint32_t map_blocks = (superblock.blocks_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    uint32_t map_start = allocate_run(map_blocks);
+    if (map_start == 0)
+    {
+        return false;
+    }
+
+    char zeros[BLOCK_SIZE] = {0};
+    for (uint32_t b = 0; b < map_blocks; b++)
+    {
+        if (!write_block(map_start + b, zeros))
+        {
+            for (b = 0; b < map_blocks; b++)
+            {
+                free_block(map_start + b);
+            }
+            return false;
+        }
+    }
+    superblock.changes_block = map_start;
+    superblock.changes_blocks = map_blocks;
+    return write_superblock() && cache.track_changes(map_start, map_blocks, superblock.blocks_count);
 }
 
-std::pair<uint32_t, uint32_t> FileSystem::get_disk_usage()
+// Runs alone, so the delta shows a single moment. The marks are cleared
+// before the blocks are written home, and put back if the export fails,
+// so a change made after this export is never lost to the next one.
+bool FileSystem::export_delta(const std::string &sys_path, bool full, DeltaSummary &summary)
 {
-    uint32_t used_blocks = superblock.blocks_count - superblock.free_blocks_count;
-    uint32_t total_blocks = superblock.blocks_count;
+    if (read_only)
+    {
+        return false;
+    }
 
-    return std::make_pair(used_blocks, total_blocks);
-}
\ No newline at end of file
+    ExclusiveCacheOp op(cache);
+    {
+        // An open transaction has nothing in the image yet
+        std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+        if (in_transaction)
+        {
+            return false;
+        }
+    }
+
+    full = full || superblock.changes_block == 0;
+    if (!ensure_change_map())
+    {
+        return false;
+    }
+    std::vector<bool> marks = cache.take_changes();
+    uint32_t base_generation = full ? 0 : superblock.changes_generation;
+    superblock.changes_generation++;
+    bool ok = write_superblock() && cache.flush();
+
+    // Free blocks are skipped. The superblock and the journal header are
+    // always sent, the header being written home past the marks; so is the
+    // map, which the target keeps consistent with its superblock.
+    std::vector<uint32_t> blocks;
+    {
+        std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+        for (uint32_t i = 0; i < superblock.blocks_count; i++)
+        {
+            bool in_map = i >= superblock.changes_block && i < superblock.changes_block + superblock.changes_blocks;
+            if (block_bitmap[i] && (full || (i < marks.size() && marks[i]) || in_map ||
+                                    i == 0 || i == superblock.journal_block))
+            {
+                blocks.push_back(i);
+            }
+        }
+    }
+
+    // Consecutive blocks go out as one run
+    DeltaWriter writer;
+    ok = ok && writer.open(sys_path, superblock.blocks_count, base_generation, superblock.changes_generation);
+    std::vector<char> buffer(DELTA_RUN_BLOCKS * BLOCK_SIZE);
+    for (size_t i = 0; ok && i < blocks.size();)
+    {
+        size_t run = 1;
+        while (i + run < blocks.size() && run < DELTA_RUN_BLOCKS && blocks[i + run] == blocks[i] + run)
+        {
+            run++;
+        }
+        ok = cache.read_blocks(blocks[i], run, buffer.data()) && writer.add_run(blocks[i], run, buffer.data());
+        i += run;
+    }
+    ok = ok && writer.finish(summary);
+
+    if (!ok)
+    {
+        superblock.changes_generation--;
+        write_superblock();
+        cache.restore_changes(marks);
+    }
+    return ok;
+}
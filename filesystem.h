@@ -4,16 +4,43 @@
 #include <string>
 #include <vector>
 #include <cstdint>
-#include <fstream>
+#include <array>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
 #include <memory>
 #include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <sys/types.h>
+#include "delta.h"
+#include "journal.h"
+#include "writeback.h"
 
 // Constants for file system structure
+constexpr uint32_t FS_MAGIC = 0x4D534653; // "FSMS", identifies the superblock
 constexpr size_t BLOCK_SIZE = 4096; // 4KB blocks
 constexpr size_t INODE_SIZE = 128;  // Size of inode in bytes
 constexpr size_t INODES_PER_BLOCK = BLOCK_SIZE / INODE_SIZE;
+constexpr size_t BITS_PER_BLOCK = BLOCK_SIZE * 8; // Blocks tracked per bitmap block
 constexpr size_t DIRECT_BLOCKS = 12;  // Direct block pointers in inode
 constexpr size_t INDIRECT_BLOCKS = 1; // Single indirect block pointer
+constexpr size_t POINTERS_PER_BLOCK = BLOCK_SIZE / sizeof(uint32_t);
+constexpr size_t MAX_FILE_BLOCKS = DIRECT_BLOCKS + POINTERS_PER_BLOCK;
+constexpr size_t IMPORT_BUFFER_SIZE = 4 << 20; // 4MB chunks for buffered import
+constexpr size_t EXPORT_WINDOW_SIZE = 64 << 20; // Image bytes read per recursive export window
+constexpr size_t CLUSTER_BLOCKS = 4;              // Logical blocks per compressed cluster
+constexpr size_t CLUSTER_SIZE = CLUSTER_BLOCKS * BLOCK_SIZE;
+
+// Inode flags
+constexpr uint32_t INODE_FLAG_COMPRESSED = 0x1; // Data stored as compressed clusters
+constexpr uint32_t INODE_FLAG_INLINE = 0x2;     // Symlink target kept in the inode's reserved bytes
+
+constexpr uint32_t MAX_SYMLINK_FOLLOWS = 40; // Symlink expansions per lookup before it counts as a loop
+constexpr size_t INODE_LOCK_STRIPES = 256;   // Inodes share reader/writer locks modulo this
+constexpr uint32_t JOURNAL_MIN_BLOCKS = 64;   // Journal length bounds; it takes 1/32 of the disk in between
+constexpr uint32_t JOURNAL_MAX_BLOCKS = 8192;
 
 // File types
 enum class FileType
@@ -36,6 +63,19 @@ struct Superblock
     uint32_t first_data_block;  // First data block
     uint32_t first_inode_block; // First inode block
     uint32_t bitmap_block;      // Block bitmap location
+    uint32_t bitmap_blocks;     // Number of bitmap blocks (0 on old images means 1)
+    uint32_t refcount_block;    // First block of the shared-block reference table (0 = none yet)
+    uint32_t refcount_blocks;   // Length of the reference table in blocks
+    uint32_t dedup_block;       // First block of the content-hash index (0 = none yet)
+    uint32_t dedup_blocks;      // Length of the content-hash index in blocks
+    uint32_t dedup_hashed;      // Blocks hashed by deduplicating imports
+    uint32_t dedup_hits;        // Of those, blocks that referenced an existing block
+    uint32_t journal_block;     // First block of the metadata journal (0 = none yet)
+    uint32_t journal_blocks;    // Length of the journal in blocks
+    uint32_t snapshot_block;    // Table of snapshots (0 = none yet)
+    uint32_t changes_block;     // Changed-block map (0 = changes not tracked yet)
+    uint32_t changes_blocks;    // Length of the map in blocks
+    uint32_t changes_generation; // Exports so far; a delta applies to an image at its base
 };
 
 // Inode structure
@@ -46,12 +86,16 @@ struct Inode
     uint32_t size;                                    // 4
     uint32_t links_count;                             // 4
     uint32_t blocks[DIRECT_BLOCKS + INDIRECT_BLOCKS]; // 13 * 4 = 52
-    uint8_t reserved[128 - (4 + 4 + 4 + 52)];         // 68 bytes padding
+    uint32_t flags;                                   // 4, INODE_FLAG_*
+    uint32_t cluster_map;                             // 4, block of compressed cluster lengths
+    uint8_t reserved[128 - (4 + 4 + 4 + 52 + 8)];     // 60 bytes padding
     Inode()
     {
         mode = 0;
         size = 0;
         links_count = 0;
+        flags = 0;
+        cluster_map = 0;
         for (size_t i = 0; i < DIRECT_BLOCKS + INDIRECT_BLOCKS; i++)
         {
             blocks[i] = 0;
@@ -61,6 +105,8 @@ struct Inode
 };
 #pragma pack(pop)
 
+constexpr size_t INLINE_SYMLINK_MAX = sizeof(Inode::reserved); // Longest target stored in the inode
+
 // Directory entry structure
 struct DirEntry
 {
@@ -80,17 +126,116 @@ struct DirEntry
     }
 };
 
+// Slot of the on-disk content-hash index (block 0 marks an empty slot)
+struct DedupSlot
+{
+    uint64_t hash;
+    uint32_t block;
+    uint32_t unused;
+};
+
+constexpr size_t DEDUP_SLOTS_PER_BLOCK = BLOCK_SIZE / sizeof(DedupSlot);
+constexpr size_t DEDUP_PROBE_LIMIT = 16; // Slots examined per lookup or insert
+
+// Slot of the snapshot table (root 0 marks an empty slot). A snapshot is a
+// copy of the directory tree that is linked nowhere in the live one.
+struct SnapshotEntry
+{
+    char name[48]; // NUL-terminated
+    uint32_t root; // Root directory inode of the copy
+    uint32_t unused;
+    uint64_t created; // Seconds since the epoch
+};
+
+constexpr size_t MAX_SNAPSHOTS = BLOCK_SIZE / sizeof(SnapshotEntry);
+constexpr size_t SNAPSHOT_NAME_MAX = sizeof(SnapshotEntry::name) - 1;
+
+// Savings reported by dedup-stats
+struct DedupStats
+{
+    uint32_t index_slots;   // Capacity of the hash index
+    uint32_t index_entries; // Slots in use
+    uint32_t blocks_hashed; // Blocks hashed by deduplicating imports
+    uint32_t dedup_hits;    // Imported blocks that referenced an existing block
+    uint32_t shared_blocks; // Blocks currently owned more than once
+    uint32_t saved_blocks;  // Extra references, i.e. blocks not stored twice
+};
+
+// Per-file compression figures
+struct CompressionInfo
+{
+    uint32_t logical_bytes;       // File size
+    uint32_t stored_blocks;       // Data blocks actually used
+    uint32_t clusters;            // Clusters covering the file
+    uint32_t compressed_clusters; // Of those, clusters stored compressed
+};
+
+// Progress of a recursive copy between the host and the virtual disk
+struct TreeCopyProgress
+{
+    uint64_t files_total;  // Files discovered so far
+    uint64_t files_done;   // Files whose contents have been copied
+    uint64_t files_failed; // Files that could not be copied
+    uint64_t directories;  // Directories created
+    uint64_t hard_links;   // Extra names recreated as host hard links
+    uint64_t bytes_total;  // Bytes scheduled for copying
+    uint64_t bytes_done;   // Bytes copied so far
+    double elapsed_seconds;
+};
+
+using TreeCopyCallback = std::function<void(const TreeCopyProgress &)>;
+
+// Name -> inode map of one directory, built on first use under read-only mounts
+using DirIndex = std::unordered_map<std::string, uint32_t>;
+
 // File system class
 class FileSystem
 {
 private:
     std::string disk_path;
-    std::fstream disk_file;
+    int disk_fd; // Image descriptor; all I/O is positional, so threads share it
+    Journal journal;      // Metadata write-ahead log, closed when the disk has none
+    WritebackCache cache; // Metadata and directory blocks are written back in the background
     Superblock superblock;
     std::vector<bool> block_bitmap;
+    std::vector<bool> bitmap_dirty; // Bitmap blocks changed since the last write
+    std::vector<bool> block_pinned; // Free in the bitmap, but not reusable until the free is committed
+    std::deque<std::pair<uint64_t, uint32_t>> pinned_blocks; // <commit ticket, block>, in ticket order
+    uint32_t next_free_block;       // Where the next block search starts
+    uint32_t next_free_inode;       // Where the next inode search starts
+    std::vector<uint16_t> block_refs; // Extra owners of each block (0 = unshared), empty without a table
+    std::vector<bool> refs_dirty;     // Reference table blocks changed since the last write
+    std::vector<DedupSlot> dedup_index; // Content-hash index, empty without one
+    std::vector<bool> dedup_dirty;      // Index blocks changed since the last write
+    std::atomic<bool> dedup_enabled;    // Imports share blocks with identical content
+    std::atomic<bool> compress_enabled; // Imports store clusters compressed
+    std::unordered_map<uint32_t, std::string> symlink_targets; // Symlink inode -> target, filled on first read
+    bool in_transaction;                  // An explicit transaction is open
+    std::vector<uint32_t> deferred_frees; // Blocks freed inside it, released when it commits
+    uint32_t root_inode;                  // 1, or the root of the snapshot a read-only mount shows
+
+    // Locking. Directory and file contents are guarded by the inode locks,
+    // shared for reading and exclusive for changes; an operation that needs
+    // several takes them together through lock_inodes. The allocator state
+    // (bitmap, superblock counters, reference table, hash index) has its
+    // own mutex, which is always taken last.
+    std::array<std::shared_mutex, INODE_LOCK_STRIPES> inode_locks;
+    std::recursive_mutex alloc_mutex;
+    std::mutex rename_mutex;  // One rename at a time, so ancestry checks stay valid
+    std::mutex symlink_mutex; // Guards symlink_targets
+    std::mutex snapshot_mutex; // One change to the snapshot table at a time
+
+    // Read-only mounts. Nothing on disk changes after mount_disk, so readers
+    // take no locks, and directory lookups go through per-directory
+    // indexes that are published with a compare-and-swap and never freed
+    // before unmount.
+    bool read_only;
+    std::unique_ptr<std::atomic<const DirIndex *>[]> dir_indexes; // By inode number
 
     // Helper methods
     bool read_superblock();
+    bool replay_journal();
+    bool ensure_journal();
     bool write_superblock();
     bool read_block(uint32_t block_num, void *buffer);
     bool write_block(uint32_t block_num, const void *buffer);
@@ -98,13 +243,68 @@ private:
     bool write_inode(uint32_t inode_num, const Inode &inode);
     uint32_t allocate_block();
     void free_block(uint32_t block_num);
+    bool allocate_extents(uint32_t count, std::vector<uint32_t> &blocks);
+    void free_blocks(const std::vector<uint32_t> &blocks);
+    void release_block(uint32_t block_num);
+    void unpin_committed();
+    bool import_data(int src_fd, size_t size, std::vector<uint32_t> &blocks, std::vector<uint32_t> &skipped);
+    bool commit_holes(uint32_t inode_num, const std::vector<uint32_t> &blocks, const std::vector<uint32_t> &skipped);
+    uint32_t prepare_import(const std::string &virt_path, size_t size, std::vector<uint32_t> &data_blocks);
+    bool make_directory_if_missing(const std::string &path);
+    bool load_block_map(const Inode &inode, std::vector<uint32_t> &map);
+    bool read_dir_entries(const Inode &dir_inode, std::vector<std::pair<std::string, uint32_t>> &entries);
+    bool store_block_map(Inode &inode, const std::vector<uint32_t> &map);
+    bool set_block_pointer(Inode &inode, uint32_t index, uint32_t block_num);
+    uint32_t allocate_run(uint32_t count);
+    bool read_refcounts();
+    bool write_refcounts();
+    bool ensure_refcount_table();
+    bool share_block(uint32_t block_num);
+    bool release_shared(uint32_t block_num);
+    uint32_t make_block_private(uint32_t block_num);
+    bool read_dedup_index();
+    bool write_dedup_index();
+    bool ensure_dedup_index();
+    uint32_t dedup_lookup(uint64_t hash, const char *block_data);
+    void dedup_insert(uint64_t hash, uint32_t block_num);
+    bool import_dedup(int src_fd, size_t size, uint32_t inode_num, std::vector<uint32_t> &blocks);
+    bool read_cluster_map(const Inode &inode, std::vector<uint32_t> &lengths);
+    bool read_cluster(const Inode &inode, const std::vector<uint32_t> &map,
+                      const std::vector<uint32_t> &lengths, uint32_t cluster, char *out);
+    bool import_compressed(int src_fd, size_t size, uint32_t inode_num, std::vector<uint32_t> &blocks);
+    bool decompress_inode(uint32_t inode_num, Inode &inode);
+    bool append_chunk(uint32_t inode_num, Inode &inode, std::vector<uint32_t> &map, uint32_t &size,
+                      const char *data, size_t length, std::vector<uint32_t> &added);
+    bool append_from_source(const std::string &path, const std::function<ssize_t(char *, size_t)> &source);
+    bool seek_extent(const std::string &path, uint32_t offset, bool hole, uint32_t &result);
     uint32_t allocate_inode();
     void free_inode(uint32_t inode_num);
     bool read_bitmap();
     bool write_bitmap();
+    void mark_block(uint32_t block_num, bool used);
     std::string get_absolute_path(const std::string &path);
-    uint32_t find_inode_by_path(const std::string &path);
+    uint32_t find_inode_by_path(const std::string &path, bool follow_last = true);
+    bool read_symlink_target(uint32_t inode_num, const Inode &inode, std::string &target);
+    bool find_dir_entry(const Inode &dir_inode, const std::string &name, uint32_t &block_index, uint32_t &offset,
+                        uint32_t *inode_num = nullptr);
+    bool set_dir_entry(const Inode &dir_inode, uint32_t block_index, uint32_t offset, uint32_t inode_num, FileType type);
+    bool add_dir_entry(uint32_t dir_inode_num, const std::string &name, uint32_t inode_num, FileType type);
+    std::shared_mutex &inode_lock(uint32_t inode_num) { return inode_locks[inode_num % INODE_LOCK_STRIPES]; }
+    std::vector<std::unique_lock<std::shared_mutex>> lock_inodes(std::vector<uint32_t> inode_nums);
+    std::shared_lock<std::shared_mutex> read_lock(uint32_t inode_num);
+    const DirIndex *get_dir_index(uint32_t dir_inode_num);
+    uint32_t find_parent(const std::string &path, std::string &name);
+    bool link_inode(uint32_t dir_inode_num, const std::string &name, uint32_t inode_num, FileType type);
+    bool publish_inode(const std::string &path, uint32_t inode_num, FileType type);
+    bool resize_inode(uint32_t inode_num, Inode &inode, size_t new_size);
+    bool fill_import(int src_fd, size_t size, uint32_t inode_num, std::vector<uint32_t> &blocks);
     uint32_t create_file(const std::string &parent_path, const std::string &name, FileType type);
+    bool read_snapshots(std::vector<SnapshotEntry> &table);
+    bool write_snapshots(const std::vector<SnapshotEntry> &table);
+    uint32_t clone_inode(const Inode &src);
+    uint32_t clone_tree();
+    void drop_tree(uint32_t root);
+    bool ensure_change_map();
 
 public:
     FileSystem(const std::string &disk_path);
@@ -112,17 +312,63 @@ public:
 
     // Main operations
     bool create_disk(size_t size);
-    bool mount_disk();
+    bool mount_disk(bool read_only = false);
+    bool is_read_only() const { return read_only; }
+    uint32_t lookup(const std::string &path) { return find_inode_by_path(path); } // Inode number, 0 if missing
+    bool create_file(const std::string &path); // Empty regular file
     bool create_directory(const std::string &path);
     bool remove_directory(const std::string &path);
     bool copy_to_system(const std::string &virt_path, const std::string &sys_path);
+    bool copy_tree_to_system(const std::string &virt_dir, const std::string &sys_dir,
+                             const TreeCopyCallback &progress = nullptr);
     bool copy_from_system(const std::string &sys_path, const std::string &virt_path);
+    bool copy_tree_from_system(const std::string &sys_dir, const std::string &virt_dir,
+                               const TreeCopyCallback &progress = nullptr);
     std::vector<std::pair<std::string, uint32_t>> list_directory(const std::string &path);
     bool create_link(const std::string &target, const std::string &link_path);
+    bool create_symlink(const std::string &target, const std::string &link_path);
+    bool rename(const std::string &old_path, const std::string &new_path);
+    bool read_link(const std::string &path, std::string &target);
+    bool copy_file(const std::string &src_path, const std::string &dst_path, bool share_blocks = true);
     bool remove_file(const std::string &path);
     bool append_to_file(const std::string &path, size_t bytes);
+    bool read_file(const std::string &path, std::vector<char> &data);
+    bool write_file(const std::string &path, const char *data, size_t size);
+    bool append_to_file(const std::string &path, const char *data, size_t size);
+    bool append_from_stream(const std::string &path, std::istream &in);
+    bool append_from_fd(const std::string &path, int fd);
     bool truncate_file(const std::string &path, size_t bytes);
+    bool truncate_to_size(const std::string &path, size_t new_size);
+    bool seek_data(const std::string &path, uint32_t offset, uint32_t &result);
+    bool seek_hole(const std::string &path, uint32_t offset, uint32_t &result);
+    bool get_file_size(const std::string &path, uint32_t &size);
     std::pair<uint32_t, uint32_t> get_disk_usage(); // Returns <used, total> in blocks
+    void set_dedup(bool enabled) { dedup_enabled = enabled; }
+    bool get_dedup() const { return dedup_enabled; }
+    DedupStats get_dedup_stats();
+    void set_compress(bool enabled) { compress_enabled = enabled; }
+    bool get_compress() const { return compress_enabled; }
+    bool get_compression_info(const std::string &path, CompressionInfo &info);
+    bool sync() { return read_only || cache.flush(); } // Writes all cached blocks to the image
+    WritebackStats get_writeback_stats() { return cache.get_stats(); }
+
+    // Explicit transactions. Everything changed until commit_transaction
+    // reaches the journal as one transaction; abort_transaction undoes it.
+    bool begin_transaction();
+    bool commit_transaction();
+    bool abort_transaction();
+
+    // Snapshots. Creating one copies the directory tree and inodes while
+    // writers wait; file contents are shared and diverge copy-on-write.
+    bool create_snapshot(const std::string &name);
+    bool delete_snapshot(const std::string &name);
+    std::vector<std::pair<std::string, uint64_t>> list_snapshots(); // <name, creation time>
+    bool open_snapshot(const std::string &name); // Read-only mounts: paths resolve inside it
+
+    // Writes the blocks changed since the last export to a delta file that
+    // apply_delta replays onto a copy of the image. The first export, or a
+    // full one, holds every allocated block and starts a new chain.
+    bool export_delta(const std::string &sys_path, bool full, DeltaSummary &summary);
 };
 
 #endif // FILESYSTEM_H
\ No newline at end of file
@@ -0,0 +1,11 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit xxHash (XXH64). Its four independent accumulator lanes keep the
+// multipliers busy in parallel, so block-sized inputs hash at memory speed.
+uint64_t xxhash64(const void *data, size_t length, uint64_t seed = 0);
+
+#endif // HASH_H
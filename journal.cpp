@@ -0,0 +1,279 @@
+#include "journal.h"
+#include "hash.h"
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <unistd.h>
+
+constexpr uint32_t JOURNAL_MAGIC = 0x4A4E4C56;  // Header, "VLNJ"
+constexpr uint32_t DESCRIPTOR_MAGIC = 0x43534456; // "VDSC"
+constexpr uint32_t COMMIT_MAGIC = 0x4D4D4356;   // "VCMM"
+
+struct JournalHeader
+{
+    uint32_t magic;
+    uint32_t blocks;
+    uint64_t sequence; // Transaction expected right after the header
+};
+
+struct JournalDescriptor
+{
+    uint32_t magic;
+    uint32_t count;   // Blocks following this descriptor
+    uint32_t revokes; // Revoked block numbers, listed after the count blocks' numbers
+    uint32_t last;    // 1 when the commit block follows this descriptor's blocks
+    uint64_t sequence;
+    // uint32_t block numbers, then revoked block numbers
+};
+
+struct JournalCommit
+{
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t sequence;
+    uint64_t checksum; // xxhash64 of the transaction's descriptors and blocks
+};
+
+static bool pread_fully(int fd, char *buffer, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t got = pread(fd, buffer, length, offset);
+        if (got <= 0)
+        {
+            return false;
+        }
+        buffer += got;
+        length -= got;
+        offset += got;
+    }
+    return true;
+}
+
+static bool pwrite_fully(int fd, const char *buffer, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t put = pwrite(fd, buffer, length, offset);
+        if (put <= 0)
+        {
+            return false;
+        }
+        buffer += put;
+        length -= put;
+        offset += put;
+    }
+    return true;
+}
+
+Journal::Journal() : fd(-1), block_size(0), start(0), blocks(0), head(1), sequence(1)
+{
+}
+
+size_t Journal::entries_per_descriptor() const
+{
+    return (block_size - sizeof(JournalDescriptor)) / sizeof(uint32_t);
+}
+
+bool Journal::write_header()
+{
+    std::vector<char> block(block_size, 0);
+    JournalHeader header = {JOURNAL_MAGIC, blocks, sequence};
+    memcpy(block.data(), &header, sizeof(header));
+    return pwrite_fully(fd, block.data(), block_size, static_cast<off_t>(start) * block_size);
+}
+
+bool Journal::open(int fd, size_t block_size, uint32_t start, uint32_t blocks)
+{
+    JournalHeader header;
+    if (!pread_fully(fd, reinterpret_cast<char *>(&header), sizeof(header), static_cast<off_t>(start) * block_size) ||
+        header.magic != JOURNAL_MAGIC || header.blocks != blocks)
+    {
+        return false;
+    }
+
+    this->fd = fd;
+    this->block_size = block_size;
+    this->start = start;
+    this->blocks = blocks;
+    head = 1;
+    sequence = header.sequence;
+    return true;
+}
+
+bool Journal::format(int fd, size_t block_size, uint32_t start, uint32_t blocks)
+{
+    this->fd = fd;
+    this->block_size = block_size;
+    this->start = start;
+    this->blocks = blocks;
+    head = 1;
+    sequence = 1;
+    return write_header() && fdatasync(fd) == 0;
+}
+
+size_t Journal::transaction_blocks(size_t count, size_t revokes) const
+{
+    size_t per_descriptor = entries_per_descriptor();
+    size_t descriptors = std::max<size_t>(1, (count + revokes + per_descriptor - 1) / per_descriptor);
+    return descriptors + count + 1;
+}
+
+bool Journal::commit(const std::vector<uint32_t> &block_nums, const char *data, const std::vector<uint32_t> &revokes)
+{
+    size_t length = transaction_blocks(block_nums.size(), revokes.size());
+    if (length > free_blocks())
+    {
+        return false;
+    }
+
+    // Descriptors take block numbers first, then revokes, in order
+    std::vector<char> buffer(length * block_size, 0);
+    size_t per_descriptor = entries_per_descriptor();
+    size_t next_block = 0, next_revoke = 0;
+    char *out = buffer.data();
+    while (true)
+    {
+        JournalDescriptor descriptor = {DESCRIPTOR_MAGIC, 0, 0, 0, sequence};
+        descriptor.count = std::min(per_descriptor, block_nums.size() - next_block);
+        descriptor.revokes = std::min(per_descriptor - descriptor.count, revokes.size() - next_revoke);
+        descriptor.last = next_block + descriptor.count == block_nums.size() &&
+                          next_revoke + descriptor.revokes == revokes.size();
+
+        uint32_t *entries = reinterpret_cast<uint32_t *>(out + sizeof(descriptor));
+        memcpy(out, &descriptor, sizeof(descriptor));
+        memcpy(entries, block_nums.data() + next_block, descriptor.count * sizeof(uint32_t));
+        memcpy(entries + descriptor.count, revokes.data() + next_revoke, descriptor.revokes * sizeof(uint32_t));
+        memcpy(out + block_size, data + next_block * block_size, descriptor.count * block_size);
+
+        out += (1 + descriptor.count) * block_size;
+        next_block += descriptor.count;
+        next_revoke += descriptor.revokes;
+        if (descriptor.last)
+        {
+            break;
+        }
+    }
+
+    JournalCommit commit = {COMMIT_MAGIC, 0, sequence, xxhash64(buffer.data(), out - buffer.data())};
+    memcpy(out, &commit, sizeof(commit));
+
+    // The checksum covers a torn write, so data and commit block go out
+    // together and are made durable with one flush
+    if (!pwrite_fully(fd, buffer.data(), buffer.size(), static_cast<off_t>(start + head) * block_size) ||
+        fdatasync(fd) != 0)
+    {
+        return false;
+    }
+
+    head += length;
+    sequence++;
+    return true;
+}
+
+bool Journal::reset()
+{
+    head = 1;
+    return write_header() && fdatasync(fd) == 0;
+}
+
+int Journal::replay(const std::function<bool(uint32_t, const char *)> &apply)
+{
+    struct Transaction
+    {
+        uint64_t sequence;
+        std::vector<uint32_t> block_nums;
+        std::vector<char> data;
+    };
+
+    // First pass: collect complete transactions and the newest revoke of
+    // each block
+    std::vector<Transaction> transactions;
+    std::unordered_map<uint32_t, uint64_t> revoked;
+    std::vector<char> block(block_size);
+    uint32_t position = 1;
+    uint64_t expected = sequence;
+    while (true)
+    {
+        Transaction transaction = {expected, {}, {}};
+        std::vector<uint32_t> revokes;
+        std::vector<char> covered; // Descriptors and blocks, for the checksum
+        bool complete = false;
+        while (position < blocks)
+        {
+            if (!pread_fully(fd, block.data(), block_size, static_cast<off_t>(start + position) * block_size))
+            {
+                return -1;
+            }
+
+            JournalDescriptor descriptor;
+            memcpy(&descriptor, block.data(), sizeof(descriptor));
+            if (descriptor.magic != DESCRIPTOR_MAGIC || descriptor.sequence != expected ||
+                descriptor.count + descriptor.revokes > entries_per_descriptor() ||
+                position + 1 + descriptor.count >= blocks)
+            {
+                break;
+            }
+
+            const uint32_t *entries = reinterpret_cast<const uint32_t *>(block.data() + sizeof(descriptor));
+            transaction.block_nums.insert(transaction.block_nums.end(), entries, entries + descriptor.count);
+            revokes.insert(revokes.end(), entries + descriptor.count, entries + descriptor.count + descriptor.revokes);
+            covered.insert(covered.end(), block.begin(), block.end());
+
+            size_t data_start = transaction.data.size();
+            transaction.data.resize(data_start + descriptor.count * block_size);
+            if (!pread_fully(fd, transaction.data.data() + data_start, descriptor.count * block_size,
+                             static_cast<off_t>(start + position + 1) * block_size))
+            {
+                return -1;
+            }
+            covered.insert(covered.end(), transaction.data.begin() + data_start, transaction.data.end());
+            position += 1 + descriptor.count;
+
+            if (descriptor.last)
+            {
+                JournalCommit commit;
+                complete = pread_fully(fd, reinterpret_cast<char *>(&commit), sizeof(commit),
+                                       static_cast<off_t>(start + position) * block_size) &&
+                           commit.magic == COMMIT_MAGIC && commit.sequence == expected &&
+                           commit.checksum == xxhash64(covered.data(), covered.size());
+                position++;
+                break;
+            }
+        }
+
+        if (!complete)
+        {
+            break;
+        }
+        for (uint32_t block_num : revokes)
+        {
+            revoked[block_num] = expected;
+        }
+        transactions.push_back(std::move(transaction));
+        expected++;
+    }
+
+    // Second pass: a copy older than a revoke of its block is stale
+    for (const Transaction &transaction : transactions)
+    {
+        for (size_t i = 0; i < transaction.block_nums.size(); i++)
+        {
+            auto found = revoked.find(transaction.block_nums[i]);
+            if (found != revoked.end() && found->second > transaction.sequence)
+            {
+                continue;
+            }
+            if (!apply(transaction.block_nums[i], transaction.data.data() + i * block_size))
+            {
+                return -1;
+            }
+        }
+    }
+
+    // Skipping a number means a torn transaction left behind in the log can
+    // never match the sequence of a new one
+    head = position;
+    sequence = expected + 1;
+    return transactions.size();
+}
@@ -0,0 +1,55 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Metadata write-ahead log in a fixed run of image blocks. The first block
+// is a header; transactions follow it back to back until the log is reset.
+// A transaction is one or more descriptor blocks, each followed by the
+// blocks it lists, and a commit block holding a checksum of everything
+// before it. A descriptor can also revoke blocks: older logged copies of
+// them must not be replayed because they have been reused for file data.
+class Journal
+{
+private:
+    int fd;
+    size_t block_size;
+    uint32_t start;    // First block of the log in the image
+    uint32_t blocks;   // Length of the log, header included
+    uint32_t head;     // Next free block, relative to start
+    uint64_t sequence; // Sequence number of the next transaction
+
+    bool write_header();
+    size_t entries_per_descriptor() const;
+
+public:
+    Journal();
+
+    // Loads the header of an existing log; format writes an empty one
+    bool open(int fd, size_t block_size, uint32_t start, uint32_t blocks);
+    bool format(int fd, size_t block_size, uint32_t start, uint32_t blocks);
+    bool is_open() const { return blocks != 0; }
+
+    // Hands every block of each complete transaction to apply, oldest
+    // first, skipping revoked copies. Stops at the first torn or
+    // unfinished transaction. Returns the number of transactions replayed,
+    // or -1 when the log cannot be read.
+    int replay(const std::function<bool(uint32_t, const char *)> &apply);
+
+    // Log blocks a transaction of count blocks and revokes takes
+    size_t transaction_blocks(size_t count, size_t revokes) const;
+    size_t free_blocks() const { return blocks - head; }
+    size_t capacity() const { return blocks - 1; }
+
+    // Appends one transaction with a single sequential write and makes it
+    // durable. data holds the blocks in the order of block_nums.
+    bool commit(const std::vector<uint32_t> &block_nums, const char *data, const std::vector<uint32_t> &revokes);
+
+    // Empties the log. Every logged block must be on disk at home first.
+    bool reset();
+};
+
+#endif // JOURNAL_H
@@ -0,0 +1,131 @@
+#include "libvfs.h"
+#include "filesystem.h"
+#include <cstdlib>
+#include <cstring>
+
+struct vfs
+{
+    FileSystem fs;
+
+    explicit vfs(const char *disk_path) : fs(disk_path) {}
+};
+
+static int status(bool ok)
+{
+    return ok ? 0 : -1;
+}
+
+int vfs_api_version(void)
+{
+    return VFS_API_VERSION;
+}
+
+int vfs_create_disk(const char *disk_path, uint64_t size)
+{
+    FileSystem fs(disk_path);
+    return status(fs.create_disk(size));
+}
+
+vfs_t *vfs_mount(const char *disk_path, int read_only)
+{
+    vfs_t *vfs = new vfs_t(disk_path);
+    if (!vfs->fs.mount_disk(read_only != 0))
+    {
+        delete vfs;
+        return nullptr;
+    }
+    return vfs;
+}
+
+int vfs_unmount(vfs_t *vfs)
+{
+    bool ok = vfs->fs.sync();
+    delete vfs;
+    return status(ok);
+}
+
+int vfs_sync(vfs_t *vfs)
+{
+    return status(vfs->fs.sync());
+}
+
+uint32_t vfs_lookup(vfs_t *vfs, const char *path)
+{
+    return vfs->fs.lookup(path);
+}
+
+int vfs_create(vfs_t *vfs, const char *path)
+{
+    return status(vfs->fs.create_file(path));
+}
+
+int vfs_mkdir(vfs_t *vfs, const char *path)
+{
+    return status(vfs->fs.create_directory(path));
+}
+
+int vfs_read(vfs_t *vfs, const char *path, void **data, size_t *size)
+{
+    std::vector<char> contents;
+    if (!vfs->fs.read_file(path, contents))
+    {
+        return -1;
+    }
+
+    // malloc(0) may return NULL, which would look like a failure
+    *data = malloc(contents.empty() ? 1 : contents.size());
+    if (*data == nullptr)
+    {
+        return -1;
+    }
+    memcpy(*data, contents.data(), contents.size());
+    *size = contents.size();
+    return 0;
+}
+
+void vfs_free(void *data)
+{
+    free(data);
+}
+
+int vfs_write(vfs_t *vfs, const char *path, const void *data, size_t size)
+{
+    return status(vfs->fs.write_file(path, static_cast<const char *>(data), size));
+}
+
+int vfs_append(vfs_t *vfs, const char *path, const void *data, size_t size)
+{
+    return status(vfs->fs.append_to_file(path, static_cast<const char *>(data), size));
+}
+
+int vfs_readdir(vfs_t *vfs, const char *path, vfs_readdir_callback callback, void *context)
+{
+    // list_directory cannot tell a missing directory from an empty one
+    if (vfs->fs.lookup(path) == 0)
+    {
+        return -1;
+    }
+    for (const auto &[name, size] : vfs->fs.list_directory(path))
+    {
+        if (callback(name.c_str(), size, context) != 0)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+int vfs_remove(vfs_t *vfs, const char *path)
+{
+    return status(vfs->fs.remove_file(path));
+}
+
+int vfs_rmdir(vfs_t *vfs, const char *path)
+{
+    return status(vfs->fs.remove_directory(path));
+}
+
+int vfs_rename(vfs_t *vfs, const char *old_path, const char *new_path)
+{
+    return status(vfs->fs.rename(old_path, new_path));
+}
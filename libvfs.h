@@ -0,0 +1,55 @@
+#ifndef LIBVFS_H
+#define LIBVFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// C interface to the vfs_core library, for programs that embed the file
+// system instead of driving the CLI or a `vfs serve` daemon. It covers the
+// operations of the daemon protocol. Calls that return int give 0 on
+// success and -1 on failure. One handle may be used by many threads at
+// once, as a FileSystem can.
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define VFS_API_VERSION 1 // Bumped whenever a declaration below changes
+
+typedef struct vfs vfs_t; // A mounted disk
+
+// Called once per directory entry; returning nonzero stops the listing
+typedef int (*vfs_readdir_callback)(const char *name, uint32_t size, void *context);
+
+int vfs_api_version(void);
+
+// Formats a new image of size bytes at disk_path, replacing any file there
+int vfs_create_disk(const char *disk_path, uint64_t size);
+
+// Returns NULL if the image cannot be mounted. vfs_unmount writes every
+// cached change back and frees the handle, even when that write fails.
+vfs_t *vfs_mount(const char *disk_path, int read_only);
+int vfs_unmount(vfs_t *vfs);
+int vfs_sync(vfs_t *vfs);
+
+uint32_t vfs_lookup(vfs_t *vfs, const char *path); // Inode number, 0 if missing
+int vfs_create(vfs_t *vfs, const char *path);      // Empty regular file
+int vfs_mkdir(vfs_t *vfs, const char *path);
+
+// Reads a whole file into a buffer the caller releases with vfs_free
+int vfs_read(vfs_t *vfs, const char *path, void **data, size_t *size);
+void vfs_free(void *data);
+
+int vfs_write(vfs_t *vfs, const char *path, const void *data, size_t size); // Replaces the contents, creating the file
+int vfs_append(vfs_t *vfs, const char *path, const void *data, size_t size);
+int vfs_readdir(vfs_t *vfs, const char *path, vfs_readdir_callback callback, void *context);
+int vfs_remove(vfs_t *vfs, const char *path);
+int vfs_rmdir(vfs_t *vfs, const char *path);
+int vfs_rename(vfs_t *vfs, const char *old_path, const char *new_path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBVFS_H
@@ -1,17 +1,34 @@
 #include "filesystem.h"
+#include "server.h"
 #include <iostream>
 #include <string>
 #include <sstream>
 #include <fstream>
 #include <iomanip>
+#include <chrono>
+#include <csignal>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
 
-#define COLOR_RESET "\033[0m"
-#define COLOR_RED "\033[31m"
-#define COLOR_GREEN "\033[32m"
-#define COLOR_YELLOW "\033[33m"
-#define COLOR_BLUE "\033[34m"
-#define COLOR_CYAN "\033[36m"
-#define COLOR_BOLD "\033[1m"
+// Batch mode (-f / -c) reads commands from a script instead of a person:
+// no colors, no prompts, and failures are counted instead of just shown
+static bool batch_mode = false;
+static bool assume_yes = false; // --yes: confirmations are answered yes
+static bool command_failed = false;
+
+static const char *color(const char *code)
+{
+    return batch_mode ? "" : code;
+}
+
+#define COLOR_RESET color("\033[0m")
+#define COLOR_RED color("\033[31m")
+#define COLOR_GREEN color("\033[32m")
+#define COLOR_YELLOW color("\033[33m")
+#define COLOR_BLUE color("\033[34m")
+#define COLOR_CYAN color("\033[36m")
+#define COLOR_BOLD color("\033[1m")
 
 void print_usage()
 {
@@ -19,13 +36,34 @@ void print_usage()
     std::cout << COLOR_YELLOW << "  mkdir <path>" << COLOR_RESET << "      - Create a directory\n";
     std::cout << COLOR_YELLOW << "  rmdir <path>" << COLOR_RESET << "      - Remove a directory\n";
     std::cout << COLOR_YELLOW << "  copyto <virt_path> <sys_path>" << COLOR_RESET << " - Copy a file from virtual disk to system\n";
+    std::cout << COLOR_YELLOW << "  copyto -r <virt_dir> <sys_dir>" << COLOR_RESET << " - Copy a directory tree from virtual disk to system\n";
     std::cout << COLOR_YELLOW << "  copyfrom <sys_path> <virt_path>" << COLOR_RESET << " - Copy a file from system to virtual disk\n";
+    std::cout << COLOR_YELLOW << "  copyfrom -r <sys_dir> <virt_dir>" << COLOR_RESET << " - Copy a directory tree from system to virtual disk\n";
     std::cout << COLOR_YELLOW << "  ls <path>" << COLOR_RESET << "         - List directory contents\n";
     std::cout << COLOR_YELLOW << "  link <target> <link_path>" << COLOR_RESET << " - Create a hard link\n";
+    std::cout << COLOR_YELLOW << "  symlink <target> <link_path>" << COLOR_RESET << " - Create a symbolic link\n";
+    std::cout << COLOR_YELLOW << "  readlink <path>" << COLOR_RESET << "    - Show the target of a symbolic link\n";
+    std::cout << COLOR_YELLOW << "  mv <old_path> <new_path>" << COLOR_RESET << " - Rename or move a file or directory\n";
+    std::cout << COLOR_YELLOW << "  cp [--deep] <src> <dst>" << COLOR_RESET << " - Copy a file, sharing blocks until modified\n";
     std::cout << COLOR_YELLOW << "  rm <path>" << COLOR_RESET << "          - Remove a file or link\n";
     std::cout << COLOR_YELLOW << "  append <path> <bytes>" << COLOR_RESET << " - Add bytes to a file\n";
+    std::cout << COLOR_YELLOW << "  appendfrom <sys_path> <path>" << COLOR_RESET << " - Append a system file to a file ('-' for stdin)\n";
     std::cout << COLOR_YELLOW << "  truncate <path> <bytes>" << COLOR_RESET << " - Truncate a file by bytes\n";
+    std::cout << COLOR_YELLOW << "  resize <path> <size>" << COLOR_RESET << " - Set a file's size, growing it with holes\n";
+    std::cout << COLOR_YELLOW << "  holes <path>" << COLOR_RESET << "       - Show the data and hole ranges of a file\n";
+    std::cout << COLOR_YELLOW << "  dedup [on|off]" << COLOR_RESET << "     - Show or set deduplication of imported blocks\n";
+    std::cout << COLOR_YELLOW << "  dedup-stats" << COLOR_RESET << "        - Show deduplication savings\n";
+    std::cout << COLOR_YELLOW << "  compress [on|off]" << COLOR_RESET << "  - Show or set compression of imported files\n";
+    std::cout << COLOR_YELLOW << "  compstat <path>" << COLOR_RESET << "    - Show how well a file compressed\n";
     std::cout << COLOR_YELLOW << "  usage" << COLOR_RESET << "              - Show disk usage\n";
+    std::cout << COLOR_YELLOW << "  sync" << COLOR_RESET << "               - Write cached changes to the disk file\n";
+    std::cout << COLOR_YELLOW << "  snapshot create|delete <name>" << COLOR_RESET << " - Take or drop a snapshot of the whole disk\n";
+    std::cout << COLOR_YELLOW << "  snapshot list" << COLOR_RESET << "      - List snapshots\n";
+    std::cout << COLOR_YELLOW << "  export-delta [--full] <sys_path>" << COLOR_RESET << " - Write the blocks changed since the last export\n";
+    std::cout << COLOR_YELLOW << "  apply-delta <delta> <image>" << COLOR_RESET << " - Replay an exported delta onto a copy of an image\n";
+    std::cout << COLOR_YELLOW << "  begin" << COLOR_RESET << "              - Start a transaction\n";
+    std::cout << COLOR_YELLOW << "  commit" << COLOR_RESET << "             - Commit the transaction to the journal\n";
+    std::cout << COLOR_YELLOW << "  abort" << COLOR_RESET << "              - Undo everything since begin\n";
     std::cout << COLOR_YELLOW << "  clear" << COLOR_RESET << "              - Clear the screen\n";
     std::cout << COLOR_YELLOW << "  help" << COLOR_RESET << "               - Show this help\n";
     std::cout << COLOR_YELLOW << "  exit" << COLOR_RESET << "               - Exit the program\n";
@@ -33,6 +71,7 @@ void print_usage()
 
 void print_error(const std::string &msg)
 {
+    command_failed = true;
     std::cout << COLOR_RED << "Error: " << msg << COLOR_RESET << "\n";
 }
 
@@ -41,11 +80,61 @@ void print_success(const std::string &msg)
     std::cout << COLOR_GREEN << msg << COLOR_RESET << "\n";
 }
 
+// Progress chatter; a script only gets the commands' own output
 void print_info(const std::string &msg)
 {
+    if (batch_mode)
+    {
+        return;
+    }
     std::cout << COLOR_CYAN << msg << COLOR_RESET << "\n";
 }
 
+// Formats "<MB> MB (<MB/s> MB/s)" for progress lines
+std::string format_throughput(uint64_t bytes, double seconds)
+{
+    double mb = bytes / (1024.0 * 1024.0);
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1) << mb << " MB ("
+        << (seconds > 0 ? mb / seconds : 0.0) << " MB/s)";
+    return out.str();
+}
+
+// Rewrites the current line with recursive copy progress
+void print_tree_progress(const TreeCopyProgress &p)
+{
+    if (batch_mode)
+    {
+        return;
+    }
+    std::cout << "\r" << COLOR_CYAN << p.files_done << "/" << p.files_total << " files, "
+              << format_throughput(p.bytes_done, p.elapsed_seconds) << COLOR_RESET << std::flush;
+}
+
+// Asks before a destructive command. A script cannot answer, so batch
+// mode refuses unless --yes was given.
+bool confirm(const std::string &question)
+{
+    if (assume_yes)
+    {
+        return true;
+    }
+    if (batch_mode)
+    {
+        print_error("Confirmation required, pass --yes");
+        return false;
+    }
+
+    std::cout << COLOR_YELLOW << question << " (y/n): " << COLOR_RESET;
+    char answer;
+    if (!(std::cin >> answer))
+    {
+        return false;
+    }
+    std::cin.ignore();
+    return answer == 'y' || answer == 'Y';
+}
+
 bool execute_command(const std::string &input, FileSystem &fs)
 {
     std::istringstream iss(input);
@@ -63,8 +152,12 @@ bool execute_command(const std::string &input, FileSystem &fs)
     }
     else if (cmd == "clear")
     {
-        // Clear screen using ANSI escape sequence (works in most terminals)
-        std::cout << "\033[2J\033[1;1H";
+        // Clear screen using ANSI escape sequence (works in most terminals),
+        // unless the output is a script's
+        if (!batch_mode)
+        {
+            std::cout << "\033[2J\033[1;1H";
+        }
     }
     else if (cmd == "mkdir")
     {
@@ -99,12 +192,7 @@ bool execute_command(const std::string &input, FileSystem &fs)
             return true;
         }
 
-        std::cout << COLOR_YELLOW << "Are you sure you want to remove directory '" << path << "'? (y/n): " << COLOR_RESET;
-        char confirm;
-        std::cin >> confirm;
-        std::cin.ignore();
-
-        if (confirm != 'y' && confirm != 'Y')
+        if (!confirm("Are you sure you want to remove directory '" + path + "'?"))
         {
             print_info("Cancelled");
             return true;
@@ -122,7 +210,14 @@ bool execute_command(const std::string &input, FileSystem &fs)
     else if (cmd == "copyto")
     {
         std::string virt_path, sys_path;
-        iss >> virt_path >> sys_path;
+        iss >> virt_path;
+
+        bool recursive = virt_path == "-r";
+        if (recursive)
+        {
+            iss >> virt_path;
+        }
+        iss >> sys_path;
 
         if (virt_path.empty() || sys_path.empty())
         {
@@ -130,6 +225,32 @@ bool execute_command(const std::string &input, FileSystem &fs)
             return true;
         }
 
+        if (recursive)
+        {
+            print_info("Exporting tree '" + virt_path + "' to '" + sys_path + "'");
+
+            TreeCopyProgress result = {};
+            bool ok = fs.copy_tree_to_system(virt_path, sys_path, [&](const TreeCopyProgress &p)
+                                             { result = p; print_tree_progress(p); });
+            if (!batch_mode)
+            {
+                std::cout << "\n";
+            }
+
+            std::cout << COLOR_CYAN << result.directories << " directories, " << result.files_done
+                      << " files, " << result.hard_links << " hard links, " << std::fixed
+                      << std::setprecision(2) << result.elapsed_seconds << " s" << COLOR_RESET << "\n";
+            if (ok)
+            {
+                print_success("Tree exported successfully");
+            }
+            else
+            {
+                print_error("Failed to export " + std::to_string(result.files_failed) + " file(s) or directories");
+            }
+            return true;
+        }
+
         print_info("Copying from virtual disk to system...");
 
         if (fs.copy_to_system(virt_path, sys_path))
@@ -144,7 +265,14 @@ bool execute_command(const std::string &input, FileSystem &fs)
     else if (cmd == "copyfrom")
     {
         std::string sys_path, virt_path;
-        iss >> sys_path >> virt_path;
+        iss >> sys_path;
+
+        bool recursive = sys_path == "-r";
+        if (recursive)
+        {
+            iss >> sys_path;
+        }
+        iss >> virt_path;
 
         if (sys_path.empty() || virt_path.empty())
         {
@@ -152,6 +280,32 @@ bool execute_command(const std::string &input, FileSystem &fs)
             return true;
         }
 
+        if (recursive)
+        {
+            print_info("Importing tree '" + sys_path + "' into '" + virt_path + "'");
+
+            TreeCopyProgress result = {};
+            bool ok = fs.copy_tree_from_system(sys_path, virt_path, [&](const TreeCopyProgress &p)
+                                               { result = p; print_tree_progress(p); });
+            if (!batch_mode)
+            {
+                std::cout << "\n";
+            }
+
+            std::cout << COLOR_CYAN << result.directories << " directories, " << result.files_done
+                      << " files, " << std::fixed << std::setprecision(2) << result.elapsed_seconds
+                      << " s" << COLOR_RESET << "\n";
+            if (ok)
+            {
+                print_success("Tree imported successfully");
+            }
+            else
+            {
+                print_error("Failed to import " + std::to_string(result.files_failed) + " file(s) or directories");
+            }
+            return true;
+        }
+
         print_info("Trying to copy from '" + sys_path + "' to '" + virt_path + "'");
 
         std::ifstream file(sys_path);
@@ -184,7 +338,7 @@ bool execute_command(const std::string &input, FileSystem &fs)
 
         if (entries.empty())
         {
-            print_info("Directory is empty or does not exist");
+            std::cout << COLOR_CYAN << "Directory is empty or does not exist" << COLOR_RESET << "\n";
         }
         else
         {
@@ -224,6 +378,87 @@ bool execute_command(const std::string &input, FileSystem &fs)
             print_error("Failed to create link");
         }
     }
+    else if (cmd == "symlink")
+    {
+        std::string target, link_path;
+        iss >> target >> link_path;
+
+        if (target.empty() || link_path.empty())
+        {
+            print_error("Missing parameters");
+            return true;
+        }
+
+        if (fs.create_symlink(target, link_path))
+        {
+            print_success("Symbolic link created successfully");
+        }
+        else
+        {
+            print_error("Failed to create symbolic link");
+        }
+    }
+    else if (cmd == "readlink")
+    {
+        std::string path, target;
+        iss >> path;
+
+        if (fs.read_link(path, target))
+        {
+            std::cout << target << "\n";
+        }
+        else
+        {
+            print_error("Not a symbolic link: " + path);
+        }
+    }
+    else if (cmd == "mv")
+    {
+        std::string old_path, new_path;
+        iss >> old_path >> new_path;
+
+        if (old_path.empty() || new_path.empty())
+        {
+            print_error("Missing parameters");
+            return true;
+        }
+
+        if (fs.rename(old_path, new_path))
+        {
+            print_success("Renamed " + old_path + " to " + new_path);
+        }
+        else
+        {
+            print_error("Failed to rename");
+        }
+    }
+    else if (cmd == "cp")
+    {
+        std::string src, dst;
+        iss >> src;
+
+        bool deep = src == "--deep";
+        if (deep)
+        {
+            iss >> src;
+        }
+        iss >> dst;
+
+        if (src.empty() || dst.empty())
+        {
+            print_error("Missing parameters");
+            return true;
+        }
+
+        if (fs.copy_file(src, dst, !deep))
+        {
+            print_success("File copied successfully");
+        }
+        else
+        {
+            print_error("Failed to copy file");
+        }
+    }
     else if (cmd == "rm")
     {
         std::string path;
@@ -235,12 +470,7 @@ bool execute_command(const std::string &input, FileSystem &fs)
             return true;
         }
 
-        std::cout << COLOR_YELLOW << "Are you sure you want to remove file/link '" << path << "'? (y/n): " << COLOR_RESET;
-        char confirm;
-        std::cin >> confirm;
-        std::cin.ignore();
-
-        if (confirm != 'y' && confirm != 'Y')
+        if (!confirm("Are you sure you want to remove file/link '" + path + "'?"))
         {
             print_info("Cancelled");
             return true;
@@ -276,6 +506,39 @@ bool execute_command(const std::string &input, FileSystem &fs)
             print_error("Failed to append to file");
         }
     }
+    else if (cmd == "appendfrom")
+    {
+        std::string sys_path, path;
+        iss >> sys_path >> path;
+
+        if (sys_path.empty() || path.empty())
+        {
+            print_error("Missing parameters");
+            return true;
+        }
+
+        int fd = sys_path == "-" ? STDIN_FILENO : open(sys_path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            print_error("Cannot open " + sys_path);
+            return true;
+        }
+
+        bool appended = fs.append_from_fd(path, fd);
+        if (fd != STDIN_FILENO)
+        {
+            close(fd);
+        }
+
+        if (appended)
+        {
+            print_success("Appended " + sys_path + " to " + path);
+        }
+        else
+        {
+            print_error("Failed to append to file");
+        }
+    }
     else if (cmd == "truncate")
     {
         std::string path;
@@ -297,6 +560,140 @@ bool execute_command(const std::string &input, FileSystem &fs)
             print_error("Failed to truncate file");
         }
     }
+    else if (cmd == "resize")
+    {
+        std::string path;
+        size_t size;
+
+        if (!(iss >> path >> size))
+        {
+            print_error("Missing or invalid parameters");
+            return true;
+        }
+
+        if (fs.truncate_to_size(path, size))
+        {
+            print_success("File resized to " + std::to_string(size) + " bytes successfully");
+        }
+        else
+        {
+            print_error("Failed to resize file");
+        }
+    }
+    else if (cmd == "holes")
+    {
+        std::string path;
+        iss >> path;
+
+        if (path.empty())
+        {
+            print_error("Usage: holes <path>");
+            return true;
+        }
+
+        uint32_t size;
+        if (!fs.get_file_size(path, size))
+        {
+            print_error("Not a regular file: " + path);
+            return true;
+        }
+
+        // Walk the file the way SEEK_DATA / SEEK_HOLE would
+        uint32_t offset = 0;
+        while (offset < size)
+        {
+            uint32_t data_start, data_end;
+            if (!fs.seek_data(path, offset, data_start))
+            {
+                data_start = size;
+            }
+            if (data_start > offset)
+            {
+                std::cout << COLOR_CYAN << "hole  " << offset << "-" << data_start << COLOR_RESET << "\n";
+            }
+            if (data_start == size || !fs.seek_hole(path, data_start, data_end))
+            {
+                break;
+            }
+            std::cout << COLOR_GREEN << "data  " << data_start << "-" << data_end << COLOR_RESET << "\n";
+            offset = data_end;
+        }
+    }
+    else if (cmd == "dedup")
+    {
+        std::string mode;
+        iss >> mode;
+
+        if (mode == "on" || mode == "off")
+        {
+            fs.set_dedup(mode == "on");
+        }
+        else if (!mode.empty())
+        {
+            print_error("Expected 'on' or 'off'");
+            return true;
+        }
+
+        std::cout << COLOR_CYAN << "Deduplicating imports are " << (fs.get_dedup() ? "on" : "off") << COLOR_RESET << "\n";
+    }
+    else if (cmd == "dedup-stats")
+    {
+        DedupStats stats = fs.get_dedup_stats();
+
+        std::cout << COLOR_BOLD << "Deduplication:" << COLOR_RESET << "\n";
+        std::cout << COLOR_CYAN << "Index entries: " << stats.index_entries << " / " << stats.index_slots << "\n";
+        std::cout << "Blocks hashed on import: " << stats.blocks_hashed << "\n";
+        std::cout << "Duplicate blocks found: " << stats.dedup_hits << " ("
+                  << static_cast<uint64_t>(stats.dedup_hits) * BLOCK_SIZE << " bytes not written)\n";
+        std::cout << "Shared blocks: " << stats.shared_blocks << "\n";
+        std::cout << "Space saved: " << stats.saved_blocks << " blocks ("
+                  << static_cast<uint64_t>(stats.saved_blocks) * BLOCK_SIZE << " bytes)" << COLOR_RESET << "\n";
+    }
+    else if (cmd == "compress")
+    {
+        std::string mode;
+        iss >> mode;
+
+        if (mode == "on" || mode == "off")
+        {
+            fs.set_compress(mode == "on");
+        }
+        else if (!mode.empty())
+        {
+            print_error("Expected 'on' or 'off'");
+            return true;
+        }
+
+        std::cout << COLOR_CYAN << "Compressing imports are " << (fs.get_compress() ? "on" : "off") << COLOR_RESET << "\n";
+    }
+    else if (cmd == "compstat")
+    {
+        std::string path;
+        iss >> path;
+
+        CompressionInfo info;
+        if (path.empty())
+        {
+            print_error("Usage: compstat <path>");
+        }
+        else if (!fs.get_compression_info(path, info))
+        {
+            print_error("Not a regular file: " + path);
+        }
+        else
+        {
+            uint64_t stored = static_cast<uint64_t>(info.stored_blocks) * BLOCK_SIZE;
+            std::cout << COLOR_CYAN << "Size: " << info.logical_bytes << " bytes\n";
+            std::cout << "Stored: " << stored << " bytes (" << info.stored_blocks << " blocks)\n";
+            std::cout << "Compressed clusters: " << info.compressed_clusters << " / " << info.clusters << "\n";
+            if (stored > 0)
+            {
+                std::cout << "Ratio: " << std::fixed << std::setprecision(2)
+                          << static_cast<double>(info.logical_bytes) / stored << "x\n";
+            }
+            std::cout << COLOR_RESET;
+        }
+    }
     else if (cmd == "usage")
     {
         auto usage = fs.get_disk_usage();
@@ -311,8 +708,136 @@ bool execute_command(const std::string &input, FileSystem &fs)
         std::cout << "Usage: " << std::fixed << std::setprecision(2)
                   << (static_cast<double>(usage.first) / usage.second * 100) << "%" << COLOR_RESET << "\n";
     }
+    else if (cmd == "sync")
+    {
+        if (!fs.sync())
+        {
+            print_error("Failed to write cached blocks");
+            return true;
+        }
+
+        WritebackStats stats = fs.get_writeback_stats();
+        std::cout << COLOR_CYAN << "Blocks written back: " << stats.blocks_written
+                  << " in " << stats.host_writes << " writes\n";
+        std::cout << "Journal: " << stats.commits << " commits, " << stats.journaled_blocks
+                  << " blocks logged, " << stats.checkpoints << " checkpoints\n";
+        std::cout << "Writes throttled: " << stats.throttled_writes << COLOR_RESET << "\n";
+    }
+    else if (cmd == "snapshot")
+    {
+        std::string action, name;
+        iss >> action >> name;
+
+        if (action == "list")
+        {
+            auto snapshots = fs.list_snapshots();
+            std::cout << COLOR_BOLD << std::left << std::setw(48) << "Name" << "Created" << COLOR_RESET << "\n";
+            for (const auto &[snapshot_name, created] : snapshots)
+            {
+                std::time_t when = static_cast<std::time_t>(created);
+                std::cout << std::left << std::setw(48) << snapshot_name
+                          << std::put_time(std::localtime(&when), "%Y-%m-%d %H:%M:%S") << "\n";
+            }
+            std::cout << std::right << COLOR_CYAN << snapshots.size() << " snapshot(s)" << COLOR_RESET << "\n";
+        }
+        else if (action == "create" && !name.empty())
+        {
+            if (fs.create_snapshot(name))
+            {
+                print_success("Snapshot '" + name + "' created");
+            }
+            else
+            {
+                print_error("Failed to create snapshot (name taken or too long, table full, or disk full)");
+            }
+        }
+        else if (action == "delete" && !name.empty())
+        {
+            if (fs.delete_snapshot(name))
+            {
+                print_success("Snapshot '" + name + "' deleted");
+            }
+            else
+            {
+                print_error("No snapshot named '" + name + "'");
+            }
+        }
+        else
+        {
+            print_error("Usage: snapshot create <name> | snapshot delete <name> | snapshot list");
+        }
+    }
+    else if (cmd == "export-delta" || cmd == "apply-delta")
+    {
+        std::string first, second;
+        iss >> first;
+
+        bool full = cmd == "export-delta" && first == "--full";
+        if (full)
+        {
+            iss >> first;
+        }
+        iss >> second;
+
+        if (first.empty() || (cmd == "apply-delta" && second.empty()))
+        {
+            print_error("Missing parameters");
+            return true;
+        }
+
+        DeltaSummary summary;
+        if (cmd == "export-delta" && !fs.export_delta(first, full, summary))
+        {
+            print_error("Failed to export (read-only mount, open transaction, or write error)");
+            return true;
+        }
+        // The image is a separate file, usually a replica of another disk
+        if (cmd == "apply-delta" && !apply_delta(first, second, summary))
+        {
+            print_error("Failed to apply delta (corrupt file, or the image is not at its base generation)");
+            return true;
+        }
+
+        std::cout << COLOR_CYAN << "Generation " << summary.base_generation << " -> " << summary.generation
+                  << (summary.base_generation == 0 ? " (full)" : "") << ": " << summary.blocks << " blocks, "
+                  << summary.bytes << " bytes" << COLOR_RESET << "\n";
+    }
+    else if (cmd == "begin")
+    {
+        if (fs.begin_transaction())
+        {
+            print_success("Transaction started");
+        }
+        else
+        {
+            print_error("Failed to start a transaction (one is open, or the disk has no journal)");
+        }
+    }
+    else if (cmd == "commit")
+    {
+        if (fs.commit_transaction())
+        {
+            print_success("Transaction committed");
+        }
+        else
+        {
+            print_error("Failed to commit the transaction");
+        }
+    }
+    else if (cmd == "abort")
+    {
+        if (fs.abort_transaction())
+        {
+            print_success("Transaction aborted");
+        }
+        else
+        {
+            print_error("Failed to abort: no transaction is open");
+        }
+    }
     else
     {
+        command_failed = true;
         std::cout << COLOR_RED << "Unknown command: " << cmd << COLOR_RESET << "\n";
         print_usage();
     }
@@ -320,19 +845,164 @@ bool execute_command(const std::string &input, FileSystem &fs)
     return true;
 }
 
+static VfsServer *running_server = nullptr;
+
+static void stop_server(int)
+{
+    running_server->stop();
+}
+
+// vfs serve [--read-only] <disk_file> <socket_path>: mounts the disk once
+// and answers clients until SIGINT or SIGTERM
+int serve(int argc, char *argv[])
+{
+    bool read_only = argc == 5 && std::string(argv[2]) == "--read-only";
+    if (argc != 4 && !read_only)
+    {
+        std::cerr << "Usage: " << argv[0] << " serve [--read-only] <disk_file> <socket_path>\n";
+        return 1;
+    }
+
+    FileSystem fs(argv[argc - 2]);
+    if (!fs.mount_disk(read_only))
+    {
+        std::cerr << "Failed to mount virtual disk\n";
+        return 1;
+    }
+
+    VfsServer server(fs, argv[argc - 1]);
+    if (!server.listen())
+    {
+        std::cerr << "Cannot listen on " << argv[argc - 1] << "\n";
+        return 1;
+    }
+
+    running_server = &server;
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+    std::cout << "Serving " << argv[argc - 2] << (read_only ? " (read-only)" : "") << " on "
+              << argv[argc - 1] << std::endl;
+
+    server.run();
+    std::cout << "Unmounting disk and exiting..." << std::endl;
+    return 0;
+}
+
+// Runs each line of in as a command, timing it on stderr so stdout keeps
+// only the commands' own output. Blank lines and '#' comments are skipped.
+// Returns the exit status: nonzero if any command failed.
+int run_batch(std::istream &in, FileSystem &fs, bool keep_going)
+{
+    int status = 0;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#')
+        {
+            continue;
+        }
+        line = line.substr(start, line.find_last_not_of(" \t\r") + 1 - start);
+
+        command_failed = false;
+        auto began = std::chrono::steady_clock::now();
+        bool running = execute_command(line, fs);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - began).count();
+
+        std::cout << std::flush;
+        std::cerr << "[" << (command_failed ? "failed " : "ok ") << std::fixed << std::setprecision(3) << ms
+                  << " ms] " << line << std::endl;
+        if (command_failed)
+        {
+            status = 1;
+            if (!keep_going)
+            {
+                break;
+            }
+        }
+        if (!running)
+        {
+            break;
+        }
+    }
+    return status;
+}
+
+void print_command_line_usage(const char *program)
+{
+    std::cerr << "Usage: " << program << " [--read-only | --snapshot <name>] <disk_file>\n";
+    std::cerr << "       " << program << " [--read-only | --snapshot <name>] [--yes] [--keep-going]"
+              << " (-f <script> | -c <command>...) <disk_file>\n";
+    std::cerr << "       " << program << " serve [--read-only] <disk_file> <socket_path>\n";
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    if (argc >= 2 && std::string(argv[1]) == "serve")
+    {
+        return serve(argc, argv);
+    }
+
+    // A snapshot is always mounted read-only
+    std::string snapshot, script, disk_path;
+    std::vector<std::string> commands;
+    bool read_only = false, keep_going = false;
+    for (int i = 1; i < argc; i++)
     {
-        std::cerr << "Usage: " << argv[0] << " <disk_file>\n";
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--read-only")
+        {
+            read_only = true;
+        }
+        else if (arg == "--snapshot" && has_value)
+        {
+            snapshot = argv[++i];
+            read_only = true;
+        }
+        else if (arg == "-f" && has_value && script.empty())
+        {
+            script = argv[++i];
+        }
+        else if (arg == "-c" && has_value)
+        {
+            commands.push_back(argv[++i]);
+        }
+        else if (arg == "--yes")
+        {
+            assume_yes = true;
+        }
+        else if (arg == "--keep-going")
+        {
+            keep_going = true;
+        }
+        else if (disk_path.empty() && i == argc - 1)
+        {
+            disk_path = arg;
+        }
+        else
+        {
+            disk_path.clear();
+            break;
+        }
+    }
+    batch_mode = !script.empty() || !commands.empty();
+    if (disk_path.empty() || (!script.empty() && !commands.empty()) || (!batch_mode && (assume_yes || keep_going)))
+    {
+        print_command_line_usage(argv[0]);
         return 1;
     }
 
-    std::string disk_path = argv[1];
     FileSystem fs(disk_path);
 
-    // Check if the disk file exists
+    // Check if the disk file exists; a read-only mount never creates one,
+    // and neither does a script, which cannot answer the questions
     std::ifstream file(disk_path);
+    if (!file.good() && (read_only || batch_mode))
+    {
+        std::cerr << "Virtual disk file does not exist\n";
+        return 1;
+    }
     if (!file.good())
     {
         std::cout << "Virtual disk file does not exist. Create a new one? (y/n): ";
@@ -362,13 +1032,45 @@ int main(int argc, char *argv[])
     }
 
     // Mount the disk
-    if (!fs.mount_disk())
+    if (!fs.mount_disk(read_only))
     {
         std::cerr << "Failed to mount virtual disk\n";
         return 1;
     }
+    if (!snapshot.empty() && !fs.open_snapshot(snapshot))
+    {
+        std::cerr << "No snapshot named '" << snapshot << "'\n";
+        return 1;
+    }
+
+    if (batch_mode)
+    {
+        if (script.empty())
+        {
+            std::string joined;
+            for (const std::string &command : commands)
+            {
+                joined += command + "\n";
+            }
+            std::istringstream in(joined);
+            return run_batch(in, fs, keep_going);
+        }
+        if (script == "-")
+        {
+            return run_batch(std::cin, fs, keep_going);
+        }
+        std::ifstream in(script);
+        if (!in)
+        {
+            std::cerr << "Cannot open script '" << script << "'\n";
+            return 1;
+        }
+        return run_batch(in, fs, keep_going);
+    }
 
-    std::cout << COLOR_GREEN << "Virtual disk mounted successfully" << COLOR_RESET << "\n";
+    std::cout << COLOR_GREEN << "Virtual disk mounted successfully"
+              << (snapshot.empty() ? "" : " at snapshot '" + snapshot + "'") << (read_only ? " (read-only)" : "")
+              << COLOR_RESET << "\n";
     std::cout << COLOR_CYAN << "Type 'help' for available commands or 'exit' to quit" << COLOR_RESET << "\n";
 
     std::string input;
@@ -377,7 +1079,11 @@ int main(int argc, char *argv[])
     while (running)
     {
         std::cout << COLOR_BOLD << "> " << COLOR_RESET;
-        std::getline(std::cin, input);
+        if (!std::getline(std::cin, input))
+        {
+            std::cout << "\n";
+            break;
+        }
 
         if (!input.empty())
         {
@@ -0,0 +1,135 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// Wire protocol between `vfs serve` and its clients. Every message is a
+// fixed header followed by length payload bytes, in host byte order (both
+// ends share a machine). Clients may send any number of requests without
+// waiting; responses come back in completion order and carry the id of
+// their request.
+
+constexpr uint32_t PROTOCOL_MAX_PAYLOAD = 8 * 1024 * 1024; // Larger than any file
+
+enum class Op : uint8_t
+{
+    LOOKUP = 1, // path -> uint32_t inode number
+    CREATE,     // path
+    MKDIR,      // path
+    READ,       // path -> file contents
+    WRITE,      // path, data: replaces the contents
+    APPEND,     // path, data
+    LIST,       // path -> entries with their sizes
+    REMOVE,     // path
+    RMDIR,      // path
+    RENAME,     // path, new path
+    SYNC,       // -
+};
+
+struct RequestHeader
+{
+    uint32_t length; // Payload bytes after the header
+    uint32_t id;     // Chosen by the client, echoed in the response
+    uint8_t op;
+    uint8_t reserved[3];
+};
+
+struct ResponseHeader
+{
+    uint32_t length;
+    uint32_t id;
+    int32_t status; // 0 on success, -1 on failure
+};
+
+// Payload fields: strings are a uint16_t length and the bytes, data is the
+// rest of the payload. A listing is a sequence of uint32_t size + name.
+
+inline void put_u32(std::vector<char> &out, uint32_t value)
+{
+    out.insert(out.end(), reinterpret_cast<const char *>(&value), reinterpret_cast<const char *>(&value) + sizeof(value));
+}
+
+// False, adding nothing, if value is too long for its length field
+inline bool put_string(std::vector<char> &out, const std::string &value)
+{
+    if (value.size() > UINT16_MAX)
+    {
+        return false;
+    }
+    uint16_t length = static_cast<uint16_t>(value.size());
+    size_t at = out.size();
+    out.resize(at + sizeof(length) + length);
+    memcpy(out.data() + at, &length, sizeof(length));
+    memcpy(out.data() + at + sizeof(length), value.data(), length);
+    return true;
+}
+
+inline bool get_u32(const char *&in, const char *end, uint32_t &value)
+{
+    if (static_cast<size_t>(end - in) < sizeof(value))
+    {
+        return false;
+    }
+    memcpy(&value, in, sizeof(value));
+    in += sizeof(value);
+    return true;
+}
+
+inline bool get_string(const char *&in, const char *end, std::string &value)
+{
+    uint16_t length;
+    if (static_cast<size_t>(end - in) < sizeof(length))
+    {
+        return false;
+    }
+    memcpy(&length, in, sizeof(length));
+    in += sizeof(length);
+    if (static_cast<size_t>(end - in) < length)
+    {
+        return false;
+    }
+    value.assign(in, length);
+    in += length;
+    return true;
+}
+
+// Whole-buffer socket I/O; false on error or when the peer has gone
+inline bool recv_exact(int fd, void *buffer, size_t length)
+{
+    char *out = static_cast<char *>(buffer);
+    while (length > 0)
+    {
+        ssize_t got = recv(fd, out, length, 0);
+        if (got <= 0)
+        {
+            return false;
+        }
+        out += got;
+        length -= got;
+    }
+    return true;
+}
+
+inline bool send_exact(int fd, const void *buffer, size_t length)
+{
+    const char *in = static_cast<const char *>(buffer);
+    while (length > 0)
+    {
+        ssize_t put = send(fd, in, length, MSG_NOSIGNAL);
+        if (put <= 0)
+        {
+            return false;
+        }
+        in += put;
+        length -= put;
+    }
+    return true;
+}
+
+#endif // PROTOCOL_H
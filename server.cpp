@@ -0,0 +1,215 @@
+#include "server.h"
+#include "protocol.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct VfsServer::Connection
+{
+    int fd;
+    std::mutex send_mutex; // Responses from different workers must not interleave
+
+    explicit Connection(int fd) : fd(fd) {}
+    ~Connection() { close(fd); } // After the reader and every queued request are done
+
+    bool respond(uint32_t id, bool ok, const std::vector<char> &payload = {})
+    {
+        ResponseHeader header = {};
+        header.length = ok ? payload.size() : 0;
+        header.id = id;
+        header.status = ok ? 0 : -1;
+
+        std::lock_guard<std::mutex> lock(send_mutex);
+        return send_exact(fd, &header, sizeof(header)) &&
+               (header.length == 0 || send_exact(fd, payload.data(), payload.size()));
+    }
+};
+
+VfsServer::VfsServer(FileSystem &fs, const std::string &socket_path, size_t threads)
+    : fs(fs), socket_path(socket_path), listen_fd(-1), pool(threads), stopping(false)
+{
+}
+
+VfsServer::~VfsServer()
+{
+    stop();
+    reap_readers(true);
+    pool.wait_idle();
+    if (listen_fd >= 0)
+    {
+        close(listen_fd);
+        unlink(socket_path.c_str());
+    }
+}
+
+bool VfsServer::listen()
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+    {
+        return false;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+    {
+        return false;
+    }
+
+    // A socket file left by a server that died is in the way of bind
+    unlink(socket_path.c_str());
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        ::listen(listen_fd, SOMAXCONN) != 0)
+    {
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void VfsServer::run()
+{
+    while (!stopping)
+    {
+        // Wake up now and then to notice stop() and finished clients
+        pollfd waiting = {listen_fd, POLLIN, 0};
+        int ready = poll(&waiting, 1, 200);
+        reap_readers(false);
+        if (ready <= 0)
+        {
+            continue;
+        }
+
+        int client_fd = accept(listen_fd, nullptr, nullptr);
+        if (client_fd < 0)
+        {
+            continue;
+        }
+
+        readers.emplace_back();
+        Reader &reader = readers.back();
+        reader.connection = std::make_shared<Connection>(client_fd);
+        reader.thread = std::thread(&VfsServer::serve_connection, this, std::ref(reader));
+    }
+}
+
+// Joins readers whose client went away; with all, disconnects the rest first
+void VfsServer::reap_readers(bool all)
+{
+    for (auto it = readers.begin(); it != readers.end();)
+    {
+        if (all && !it->done)
+        {
+            shutdown(it->connection->fd, SHUT_RDWR);
+        }
+        if (all || it->done)
+        {
+            it->thread.join();
+            it = readers.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void VfsServer::serve_connection(Reader &reader)
+{
+    std::shared_ptr<Connection> connection = reader.connection;
+    while (!stopping)
+    {
+        RequestHeader header;
+        if (!recv_exact(connection->fd, &header, sizeof(header)) || header.length > PROTOCOL_MAX_PAYLOAD)
+        {
+            break;
+        }
+
+        auto payload = std::make_shared<std::vector<char>>(header.length);
+        if (header.length > 0 && !recv_exact(connection->fd, payload->data(), header.length))
+        {
+            break;
+        }
+
+        // The next request is read while this one runs
+        pool.submit([this, connection, header, payload]
+                    { handle_request(connection, header.id, header.op, *payload); });
+    }
+
+    // The connection stays open until it is reaped and queued requests
+    // have answered
+    reader.done = true;
+}
+
+void VfsServer::handle_request(const std::shared_ptr<Connection> &connection, uint32_t id, uint8_t op,
+                               const std::vector<char> &payload)
+{
+    const char *in = payload.data();
+    const char *end = in + payload.size();
+    std::string path;
+    if (static_cast<Op>(op) != Op::SYNC && !get_string(in, end, path))
+    {
+        connection->respond(id, false);
+        return;
+    }
+
+    std::vector<char> reply;
+    bool ok = false;
+    switch (static_cast<Op>(op))
+    {
+    case Op::LOOKUP:
+    {
+        uint32_t inode_num = fs.lookup(path);
+        ok = inode_num != 0;
+        put_u32(reply, inode_num);
+        break;
+    }
+    case Op::CREATE:
+        ok = fs.create_file(path);
+        break;
+    case Op::MKDIR:
+        ok = fs.create_directory(path);
+        break;
+    case Op::READ:
+        ok = fs.read_file(path, reply);
+        break;
+    case Op::WRITE:
+        ok = fs.write_file(path, in, end - in);
+        break;
+    case Op::APPEND:
+        ok = fs.append_to_file(path, in, end - in);
+        break;
+    case Op::LIST:
+    {
+        // An empty listing is a missing directory; . and .. are not listed
+        ok = fs.lookup(path) != 0;
+        for (const auto &[name, size] : fs.list_directory(path))
+        {
+            put_u32(reply, size);
+            ok = put_string(reply, name) && ok;
+        }
+        break;
+    }
+    case Op::REMOVE:
+        ok = fs.remove_file(path);
+        break;
+    case Op::RMDIR:
+        ok = fs.remove_directory(path);
+        break;
+    case Op::RENAME:
+    {
+        std::string new_path;
+        ok = get_string(in, end, new_path) && fs.rename(path, new_path);
+        break;
+    }
+    case Op::SYNC:
+        ok = fs.sync();
+        break;
+    }
+
+    connection->respond(id, ok, reply);
+}
@@ -0,0 +1,53 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "filesystem.h"
+#include "thread_pool.h"
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// `vfs serve`: one mounted FileSystem shared by any number of local clients
+// over a Unix domain socket. Each connection has a thread that reads
+// requests and queues them on a shared pool, so requests from one client
+// run concurrently and are answered as they finish.
+class VfsServer
+{
+private:
+    struct Connection;
+    struct Reader
+    {
+        std::thread thread;
+        std::shared_ptr<Connection> connection;
+        std::atomic<bool> done{false};
+    };
+
+    FileSystem &fs;
+    std::string socket_path;
+    int listen_fd;
+    ThreadPool pool;
+    std::atomic<bool> stopping;
+    std::list<Reader> readers; // Only touched by run()
+
+    void serve_connection(Reader &reader);
+    void handle_request(const std::shared_ptr<Connection> &connection, uint32_t id, uint8_t op,
+                        const std::vector<char> &payload);
+    void reap_readers(bool all);
+
+public:
+    // threads == 0 picks one worker per hardware thread
+    VfsServer(FileSystem &fs, const std::string &socket_path, size_t threads = 0);
+    ~VfsServer();
+
+    VfsServer(const VfsServer &) = delete;
+    VfsServer &operator=(const VfsServer &) = delete;
+
+    bool listen(); // Binds the socket, replacing a stale one
+    void run();    // Accepts clients until stop() is called
+    void stop() { stopping = true; } // Safe to call from a signal handler
+};
+
+#endif // SERVER_H
@@ -0,0 +1,319 @@
+#include "filesystem.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Multi-threaded stress test of one mounted FileSystem. Worker threads race
+// create, write, copy, rename, link, symlink, mkdir, rmdir, remove and read
+// on a small set of shared paths, so most operations collide. Every file
+// there holds a pattern that tells its own size, so any read can be checked,
+// however the races went. Each worker also keeps private files whose exact
+// contents it knows. Afterwards the tree is walked and checked, remounted
+// and compared, then torn down, after which every block must be free again.
+//
+// vfs_stress [--threads <n>] [--rounds <n>] [work_dir]
+
+static std::string work_dir = ".";
+static std::atomic<int> failures(0);
+static std::mutex report_mutex;
+
+static void expect(bool ok, const std::string &what)
+{
+    if (!ok)
+    {
+        std::lock_guard<std::mutex> lock(report_mutex);
+        std::cout << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+static std::string image_path()
+{
+    return work_dir + "/vfs_stress.img";
+}
+
+// Shared files are filled with one letter, and the letter sets the length.
+// The larger ones reach past the direct blocks.
+static std::vector<char> pattern(char letter)
+{
+    return std::vector<char>(512 + (letter - 'a') * 5003, letter);
+}
+
+// write_file creates a missing file empty before filling it, so an empty
+// file is a state others may see, and keep if the fill lost a race
+static bool is_pattern(const std::vector<char> &data)
+{
+    if (data.empty())
+    {
+        return true;
+    }
+    if (data[0] < 'a' || data[0] > 'p' || data.size() != pattern(data[0]).size())
+    {
+        return false;
+    }
+    return std::all_of(data.begin(), data.end(), [&](char c)
+                       { return c == data[0]; });
+}
+
+// One of the shared paths: a name in /shared/a or /shared/b, or one level
+// further down in one of their subdirectories
+static std::string shared_path(std::mt19937 &rng, bool directory = false)
+{
+    std::string path = std::string("/shared/") + "ab"[rng() % 2];
+    if (rng() % 3 == 0)
+    {
+        path += "/d" + std::to_string(rng() % 2);
+    }
+    return path + (directory ? "/d" + std::to_string(rng() % 2) : "/n" + std::to_string(rng() % 8));
+}
+
+static std::string own_dir(int thread)
+{
+    return "/own/t" + std::to_string(thread);
+}
+
+// Races the shared operations against the other workers and checks every
+// successful read. Private files are written, read back and kept in own.
+static void worker(FileSystem &fs, int thread, int rounds, std::map<std::string, std::vector<char>> &own)
+{
+    std::mt19937 rng(thread + 1);
+    std::string dir = own_dir(thread);
+    expect(fs.create_directory(dir), "create " + dir);
+
+    for (int round = 0; round < rounds; round++)
+    {
+        for (int step = 0; step < 8; step++)
+        {
+            std::string path = shared_path(rng);
+            std::vector<char> data;
+            switch (rng() % 10)
+            {
+            case 0:
+            case 1:
+            {
+                std::vector<char> contents = pattern('a' + rng() % 16);
+                fs.write_file(path, contents.data(), contents.size());
+                break;
+            }
+            case 2:
+                fs.copy_file(path, shared_path(rng));
+                break;
+            case 3:
+                fs.rename(path, rng() % 4 == 0 ? shared_path(rng, true) : shared_path(rng));
+                break;
+            case 4:
+                fs.create_link(path, shared_path(rng));
+                break;
+            case 5:
+                fs.create_symlink(path, shared_path(rng));
+                break;
+            case 6:
+                fs.create_directory(shared_path(rng, true));
+                fs.remove_directory(shared_path(rng, true));
+                break;
+            case 7:
+                fs.remove_file(path);
+                break;
+            default:
+                if (fs.read_file(path, data) && !is_pattern(data))
+                {
+                    expect(false, "read of " + path + " saw a torn or foreign file of " + std::to_string(data.size()) +
+                                      " bytes starting with " + std::to_string(data[0]));
+                }
+                fs.list_directory(path.substr(0, path.rfind('/')));
+                break;
+            }
+        }
+
+        // A private file: write, grow, read back, rename
+        std::string name = dir + "/f" + std::to_string(round);
+        std::vector<char> contents(rng() % 30000 + 1);
+        for (char &c : contents)
+        {
+            c = static_cast<char>(rng());
+        }
+        std::vector<char> more(rng() % 20000, static_cast<char>(round));
+        expect(fs.write_file(name, contents.data(), contents.size()), "write " + name);
+        expect(fs.append_to_file(name, more.data(), more.size()), "append " + name);
+        contents.insert(contents.end(), more.begin(), more.end());
+
+        std::vector<char> data;
+        expect(fs.read_file(name, data) && data == contents, "read back " + name);
+        std::string renamed = dir + "/g" + std::to_string(round);
+        expect(fs.rename(name, renamed), "rename " + name);
+        own[renamed] = contents;
+
+        if (round % 3 == 2)
+        {
+            std::string dropped = dir + "/g" + std::to_string(round - 1);
+            expect(fs.remove_file(dropped), "remove " + dropped);
+            own.erase(dropped);
+        }
+    }
+}
+
+// Walks the tree below path into entries ("path size" lines, symlinks with
+// their target) and checks every file: shared ones hold a pattern, private
+// ones what their worker wrote
+static void walk(FileSystem &fs, const std::string &path, const std::map<std::string, std::vector<char>> &own,
+                 std::set<uint32_t> &visited, std::vector<std::string> &entries)
+{
+    expect(visited.insert(fs.lookup(path)).second, "directory " + path + " reached twice");
+    for (const auto &[listed, size] : fs.list_directory(path))
+    {
+        // Symlinks are listed as "name -> target"
+        std::string name = listed.substr(0, listed.find(" -> "));
+        std::string child = path + (path == "/" ? "" : "/") + name;
+        bool symlink = name.size() < listed.size();
+        entries.push_back(child + " " + std::to_string(size) + listed.substr(name.size()));
+        expect(symlink || fs.lookup(child) != 0, "lookup of listed " + child);
+
+        std::string target;
+        std::vector<char> data;
+        uint32_t file_size;
+        if (fs.read_link(child, target))
+        {
+            continue;
+        }
+        if (fs.get_file_size(child, file_size))
+        {
+            expect(fs.read_file(child, data) && data.size() == file_size, "read " + child);
+            auto known = own.find(child);
+            expect(known != own.end() ? data == known->second : is_pattern(data), "contents of " + child);
+            continue;
+        }
+        walk(fs, child, own, visited, entries);
+    }
+}
+
+static std::vector<std::string> check_tree(FileSystem &fs, const std::map<std::string, std::vector<char>> &own)
+{
+    std::set<uint32_t> visited;
+    std::vector<std::string> entries;
+    walk(fs, "/", own, visited, entries);
+    std::sort(entries.begin(), entries.end());
+    return entries;
+}
+
+// Removes everything below path, and path itself
+static void remove_tree(FileSystem &fs, const std::string &path)
+{
+    for (const auto &[listed, size] : fs.list_directory(path))
+    {
+        std::string child = path + "/" + listed.substr(0, listed.find(" -> "));
+        std::string target;
+        uint32_t file_size;
+        if (fs.read_link(child, target) || fs.get_file_size(child, file_size))
+        {
+            expect(fs.remove_file(child), "remove " + child);
+        }
+        else
+        {
+            remove_tree(fs, child);
+        }
+    }
+    expect(fs.remove_directory(path), "remove directory " + path);
+}
+
+static std::unique_ptr<FileSystem> mount()
+{
+    std::unique_ptr<FileSystem> fs(new FileSystem(image_path()));
+    return fs->mount_disk() ? std::move(fs) : nullptr;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 8, rounds = 100;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc)
+        {
+            threads = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--rounds" && i + 1 < argc)
+        {
+            rounds = std::max(3, atoi(argv[++i]));
+        }
+        else if (i == argc - 1 && arg[0] != '-')
+        {
+            work_dir = arg;
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--threads <n>] [--rounds <n>] [work_dir]\n";
+            return 1;
+        }
+    }
+
+    std::unique_ptr<FileSystem> fs(new FileSystem(image_path()));
+    if (!fs->create_disk(256 << 20) || !fs->mount_disk())
+    {
+        std::cerr << "Cannot create " << image_path() << "\n";
+        return 1;
+    }
+
+    // A first copy sets up the block reference table, so that the baseline
+    // counts it
+    std::vector<char> seed = pattern('a');
+    expect(fs->write_file("/seed", seed.data(), seed.size()) && fs->copy_file("/seed", "/seed2") &&
+               fs->remove_file("/seed") && fs->remove_file("/seed2"),
+           "seed copy");
+    uint32_t baseline = fs->get_disk_usage().first;
+
+    for (const char *dir : {"/shared", "/shared/a", "/shared/b", "/own"})
+    {
+        expect(fs->create_directory(dir), std::string("create ") + dir);
+    }
+
+    std::cout << threads << " threads, " << rounds << " rounds" << std::endl;
+    std::vector<std::map<std::string, std::vector<char>>> own(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back(worker, std::ref(*fs), t, rounds, std::ref(own[t]));
+    }
+    for (std::thread &thread : workers)
+    {
+        thread.join();
+    }
+
+    std::map<std::string, std::vector<char>> all_own;
+    for (const auto &files : own)
+    {
+        all_own.insert(files.begin(), files.end());
+    }
+    std::vector<std::string> before = check_tree(*fs, all_own);
+    std::cout << "checked " << before.size() << " entries" << std::endl;
+
+    // What a fresh mount finds must be what the old one left
+    fs.reset();
+    fs = mount();
+    if (!fs)
+    {
+        std::cerr << "Cannot remount " << image_path() << "\n";
+        return 1;
+    }
+    expect(check_tree(*fs, all_own) == before, "the tree changed across a remount");
+
+    remove_tree(*fs, "/shared");
+    remove_tree(*fs, "/own");
+    uint32_t used = fs->get_disk_usage().first;
+    expect(used == baseline, "blocks in use after teardown: " + std::to_string(used) + ", expected " +
+                                 std::to_string(baseline));
+
+    fs.reset();
+    remove(image_path().c_str());
+    std::cout << (failures == 0 ? "OK" : std::to_string(failures) + " failures") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
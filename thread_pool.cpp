@@ -0,0 +1,83 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threads, size_t max_pending)
+    : max_pending(std::max<size_t>(max_pending, 1)), running(0), stopping(false)
+{
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    workers.reserve(threads);
+    for (size_t i = 0; i < threads; i++)
+    {
+        workers.emplace_back(&ThreadPool::worker_loop, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    job_ready.notify_all();
+
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> job)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        job_taken.wait(lock, [this] { return jobs.size() < max_pending; });
+        jobs.push_back(std::move(job));
+    }
+    job_ready.notify_one();
+}
+
+bool ThreadPool::wait_idle(std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto idle = [this] { return jobs.empty() && running == 0; };
+
+    if (timeout == std::chrono::milliseconds::max())
+    {
+        job_taken.wait(lock, idle);
+        return true;
+    }
+    return job_taken.wait_for(lock, timeout, idle);
+}
+
+void ThreadPool::worker_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true)
+    {
+        job_ready.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (jobs.empty())
+        {
+            return; // Stopping and drained
+        }
+
+        std::function<void()> job = std::move(jobs.front());
+        jobs.pop_front();
+        running++;
+        lock.unlock();
+        job_taken.notify_all();
+
+        job();
+
+        lock.lock();
+        running--;
+        if (jobs.empty() && running == 0)
+        {
+            job_taken.notify_all();
+        }
+    }
+}
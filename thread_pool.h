@@ -0,0 +1,46 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads draining a bounded FIFO of jobs
+class ThreadPool
+{
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable job_ready; // Signalled when a job is queued or on shutdown
+    std::condition_variable job_taken; // Signalled when the queue shrinks or a job finishes
+    size_t max_pending;
+    size_t running;
+    bool stopping;
+
+    void worker_loop();
+
+public:
+    // threads == 0 picks one worker per hardware thread
+    explicit ThreadPool(size_t threads = 0, size_t max_pending = 1024);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Queues a job, blocking while max_pending jobs are already waiting
+    void submit(std::function<void()> job);
+
+    // Waits until every queued job has finished, or until timeout expires.
+    // Returns true if the pool is idle.
+    bool wait_idle(std::chrono::milliseconds timeout = std::chrono::milliseconds::max());
+
+    size_t size() const { return workers.size(); }
+};
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,792 @@
+#include "writeback.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+
+constexpr size_t FLUSH_BATCH_BLOCKS = 256; // Blocks written per batch, so frees never wait long
+constexpr size_t OP_CREDITS = 16;          // Log blocks set aside for each running operation
+
+// Operations open on this thread; nested ones never wait for a commit
+static thread_local unsigned op_depth = 0;
+
+static bool pread_fully(int fd, char *buffer, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t got = pread(fd, buffer, length, offset);
+        if (got <= 0)
+        {
+            return false;
+        }
+        buffer += got;
+        length -= got;
+        offset += got;
+    }
+    return true;
+}
+
+static bool pwrite_fully(int fd, const char *buffer, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t put = pwrite(fd, buffer, length, offset);
+        if (put <= 0)
+        {
+            return false;
+        }
+        buffer += put;
+        length -= put;
+        offset += put;
+    }
+    return true;
+}
+
+WritebackCache::WritebackCache(const WritebackConfig &config)
+    : config(config), fd(-1), block_size(0), write_back(false), frozen(false), next_generation(0),
+      commits_started(0), commits_durable(0), stats(), journal(nullptr), uncommitted(0), transaction(false),
+      changes_start(0), changes_blocks(0), active_ops(0), quiescing(false), exclusive(false), stopping(false)
+{
+}
+
+WritebackCache::~WritebackCache()
+{
+    detach();
+}
+
+void WritebackCache::attach(int fd, size_t block_size, bool write_back, Journal *journal)
+{
+    detach();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    this->fd = fd;
+    this->block_size = block_size;
+    this->write_back = write_back;
+    this->journal = journal;
+    stopping = false;
+    if (write_back)
+    {
+        flusher = std::thread(&WritebackCache::flusher_loop, this);
+    }
+}
+
+bool WritebackCache::detach()
+{
+    // A transaction still open is dropped
+    abort_transaction();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    cleaned.notify_all();
+    if (flusher.joinable())
+    {
+        flusher.join();
+    }
+
+    // Blocks preloaded on a read-only mount are never written
+    bool ok = !write_back || flush();
+    std::lock_guard<std::mutex> lock(mutex);
+    write_back = false;
+    frozen = false;
+    fd = -1;
+    journal = nullptr;
+    dirty.clear();
+    uncommitted = 0;
+    logged.clear();
+    revoked.clear();
+    changes_start = changes_blocks = 0;
+    changed.clear();
+    return ok;
+}
+
+// A commit must always fit in the half of the log a checkpoint leaves free
+size_t WritebackCache::limit() const
+{
+    return journal ? std::min(config.dirty_limit, journal->capacity() * 2 / 5) : config.dirty_limit;
+}
+
+void WritebackCache::preload(uint32_t block_num, const char *data)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    DirtyBlock &block = dirty[block_num];
+    block.data.assign(data, data + block_size);
+    block.generation = block.committed = ++next_generation;
+    block.since = std::chrono::steady_clock::now();
+}
+
+bool WritebackCache::read(uint32_t block_num, size_t offset, void *buffer, size_t length)
+{
+    // A block missing from the map is either clean or already written
+    // back, so the image holds its current contents
+    {
+        std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+        if (!frozen)
+        {
+            lock.lock();
+        }
+        auto found = dirty.find(block_num);
+        if (found != dirty.end())
+        {
+            memcpy(buffer, found->second.data.data() + offset, length);
+            return true;
+        }
+    }
+    return pread_fully(fd, static_cast<char *>(buffer), length, static_cast<off_t>(block_num) * block_size + offset);
+}
+
+bool WritebackCache::write(uint32_t block_num, size_t offset, const void *data, size_t length)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!write_back)
+    {
+        lock.unlock();
+        return pwrite_fully(fd, static_cast<const char *>(data), length, static_cast<off_t>(block_num) * block_size + offset);
+    }
+
+    if (!put(block_num, offset, data, length) || !mark_changed(block_num))
+    {
+        return false;
+    }
+    if (dirty.size() >= limit() * config.background_ratio / 100)
+    {
+        wakeup.notify_one();
+    }
+    return true;
+}
+
+// Called with mutex held
+bool WritebackCache::put(uint32_t block_num, size_t offset, const void *data, size_t length)
+{
+    save_original(block_num);
+    auto found = dirty.find(block_num);
+    if (found == dirty.end())
+    {
+        // A partial write needs the rest of the block; it is loaded under
+        // the lock so two partial writes to one block cannot lose each other
+        DirtyBlock block;
+        block.data.resize(block_size);
+        if (length < block_size &&
+            !pread_fully(fd, block.data.data(), block_size, static_cast<off_t>(block_num) * block_size))
+        {
+            return false;
+        }
+        block.generation = block.committed = 0;
+        block.since = std::chrono::steady_clock::now();
+        found = dirty.emplace(block_num, std::move(block)).first;
+    }
+
+    memcpy(found->second.data.data() + offset, data, length);
+    if (journal && found->second.committed == found->second.generation)
+    {
+        uncommitted++;
+    }
+    found->second.generation = ++next_generation;
+    return true;
+}
+
+bool WritebackCache::read_blocks(uint32_t first, size_t count, char *buffer)
+{
+    // Cached copies are taken before the image is read: a block that is not
+    // cached by then is current on disk
+    std::vector<std::pair<uint32_t, std::vector<char>>> cached;
+    {
+        std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+        if (!frozen)
+        {
+            lock.lock();
+        }
+        for (auto it = dirty.lower_bound(first); it != dirty.end() && it->first < first + count; ++it)
+        {
+            cached.push_back({it->first, it->second.data});
+        }
+    }
+
+    if (!pread_fully(fd, buffer, count * block_size, static_cast<off_t>(first) * block_size))
+    {
+        return false;
+    }
+    for (const auto &[block_num, data] : cached)
+    {
+        memcpy(buffer + (block_num - first) * block_size, data.data(), block_size);
+    }
+    return true;
+}
+
+// Prepares blocks for a write that goes around the cache.
+bool WritebackCache::bypass(uint32_t first, size_t count)
+{
+    // Stale cached copies of these blocks, e.g. from before they were freed,
+    // must not be written back over the new data. Waiting for the batch in
+    // flight covers one that was copied out before this. Logged copies are
+    // revoked in the next commit so that replay skips them.
+    {
+        std::lock_guard<std::mutex> flush_lock(flush_mutex);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto end = dirty.lower_bound(first + count);
+        for (auto it = dirty.lower_bound(first); it != end; it = dirty.erase(it))
+        {
+            save_original(it->first);
+            if (journal && it->second.committed != it->second.generation)
+            {
+                uncommitted--;
+            }
+        }
+        for (uint32_t block_num = first; !logged.empty() && block_num < first + count; block_num++)
+        {
+            if (logged.erase(block_num) > 0)
+            {
+                revoked.push_back(block_num);
+            }
+        }
+        for (uint32_t block_num = first; block_num < first + count; block_num++)
+        {
+            if (!mark_changed(block_num))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool WritebackCache::write_blocks(uint32_t first, size_t count, const char *data)
+{
+    return bypass(first, count) && pwrite_fully(fd, data, count * block_size, static_cast<off_t>(first) * block_size);
+}
+
+bool WritebackCache::copy_blocks(int src_fd, off_t offset, size_t length, uint32_t first, bool &refused)
+{
+    refused = false;
+    size_t count = (length + block_size - 1) / block_size;
+    if (!bypass(first, count))
+    {
+        return false;
+    }
+
+    off_t dst_offset = static_cast<off_t>(first) * block_size;
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t moved = copy_file_range(src_fd, &offset, fd, &dst_offset, length - done, 0);
+        if (moved < 0)
+        {
+            // Cross-device, unsupported file system or old kernel
+            refused = errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP || errno == EBADF;
+            return false;
+        }
+        if (moved == 0)
+        {
+            return false; // The source shrank underneath us
+        }
+        done += moved;
+    }
+
+    // Zero the tail of a final partial block, as a full block write would
+    std::vector<char> zeros(count * block_size - length, 0);
+    return pwrite_fully(fd, zeros.data(), zeros.size(), dst_offset);
+}
+
+void WritebackCache::begin_op(bool detached)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    // New operations wait for a commit to copy its blocks, and for the
+    // flusher when the cache is full. With a journal each running operation
+    // also counts for OP_CREDITS blocks, so the next commit fits the log.
+    auto full = [this]
+    {
+        size_t pending = uncommitted + (active_ops + 1) * OP_CREDITS;
+        return dirty.size() >= limit() ||
+               (journal && (active_ops > 0 || uncommitted > 0) && pending > limit());
+    };
+    bool throttled = false;
+    while (op_depth == 0 && !stopping && (quiescing || exclusive || (write_back && !transaction && full())))
+    {
+        if (!quiescing && !exclusive)
+        {
+            throttled = true;
+            wakeup.notify_one();
+        }
+        cleaned.wait_for(lock, config.interval);
+    }
+    if (throttled)
+    {
+        stats.throttled_writes++;
+    }
+
+    active_ops++;
+    if (!detached)
+    {
+        op_depth++;
+    }
+}
+
+void WritebackCache::end_op(bool detached)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!detached)
+    {
+        op_depth--;
+    }
+    // A commit from inside an exclusive operation waits for all but one
+    active_ops--;
+    ops_idle.notify_all();
+    cleaned.notify_all();
+}
+
+void WritebackCache::begin_exclusive()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cleaned.wait(lock, [this]
+                 { return !exclusive || stopping; });
+    exclusive = true;
+    ops_idle.notify_all(); // A commit waiting for operations steps aside
+    ops_idle.wait(lock, [this]
+                  { return active_ops == 0; });
+    active_ops++;
+    op_depth++;
+}
+
+void WritebackCache::end_exclusive()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    exclusive = false;
+    op_depth--;
+    active_ops--;
+    ops_idle.notify_all();
+    cleaned.notify_all();
+}
+
+// Called with mutex held
+void WritebackCache::save_original(uint32_t block_num)
+{
+    if (!transaction || originals.count(block_num) > 0)
+    {
+        return;
+    }
+    auto found = dirty.find(block_num);
+    originals.emplace(block_num, found != dirty.end() ? found->second : DirtyBlock());
+}
+
+// Earlier changes are committed first, so the transaction holds only its own
+bool WritebackCache::begin_transaction()
+{
+    if (!journal || !commit(false))
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (transaction)
+    {
+        return false;
+    }
+    transaction = true;
+    return true;
+}
+
+bool WritebackCache::commit_transaction()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!transaction)
+        {
+            return false;
+        }
+        transaction = false;
+        originals.clear();
+    }
+    return commit(false);
+}
+
+// Nothing written in the transaction has reached the log or the image
+// except file data in freshly allocated blocks, which become free again
+bool WritebackCache::abort_transaction()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!transaction)
+    {
+        return false;
+    }
+
+    std::vector<uint32_t> map_blocks;
+    for (auto &[block_num, original] : originals)
+    {
+        if (original.data.empty())
+        {
+            dirty.erase(block_num);
+        }
+        else
+        {
+            dirty[block_num] = std::move(original);
+        }
+        if (changes_start != 0 && block_num >= changes_start && block_num < changes_start + changes_blocks)
+        {
+            map_blocks.push_back(block_num);
+        }
+    }
+    originals.clear();
+
+    // Marks of dropped changes go with them
+    for (uint32_t map_block : map_blocks)
+    {
+        load_changes(map_block);
+    }
+    transaction = false;
+    uncommitted = std::count_if(dirty.begin(), dirty.end(), [](const std::pair<const uint32_t, DirtyBlock> &entry)
+                                { return entry.second.committed != entry.second.generation; });
+    cleaned.notify_all();
+    return true;
+}
+
+// Operations are running, so the next commit to copy blocks takes theirs
+uint64_t WritebackCache::commit_ticket()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return commits_started + 1;
+}
+
+bool WritebackCache::is_committed(uint64_t ticket)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return !journal || commits_durable >= ticket;
+}
+
+// Called with mutex held. The mark is cached like any other write.
+bool WritebackCache::mark_changed(uint32_t block_num)
+{
+    if (changes_start == 0 || block_num >= changed.size() || changed[block_num] ||
+        (block_num >= changes_start && block_num < changes_start + changes_blocks))
+    {
+        return true;
+    }
+
+    changed[block_num] = true;
+    size_t byte = block_num / 8;
+    uint8_t value = 0;
+    for (size_t bit = 0; bit < 8 && byte * 8 + bit < changed.size(); bit++)
+    {
+        value |= changed[byte * 8 + bit] ? 1 << bit : 0;
+    }
+    if (!put(changes_start + byte / block_size, byte % block_size, &value, 1))
+    {
+        changed[block_num] = false;
+        return false;
+    }
+    return true;
+}
+
+// Called with mutex held. Reloads the marks one block of the map holds.
+bool WritebackCache::load_changes(uint32_t map_block)
+{
+    std::vector<char> data(block_size);
+    auto found = dirty.find(map_block);
+    if (found != dirty.end())
+    {
+        data = found->second.data;
+    }
+    else if (!pread_fully(fd, data.data(), block_size, static_cast<off_t>(map_block) * block_size))
+    {
+        return false;
+    }
+
+    size_t first = static_cast<size_t>(map_block - changes_start) * block_size * 8;
+    for (size_t i = 0; i < block_size * 8 && first + i < changed.size(); i++)
+    {
+        changed[first + i] = (data[i / 8] >> (i % 8)) & 1;
+    }
+    return true;
+}
+
+bool WritebackCache::track_changes(uint32_t start, uint32_t blocks, uint32_t blocks_count)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!write_back || start == 0)
+    {
+        return false;
+    }
+
+    changes_start = start;
+    changes_blocks = blocks;
+    changed.assign(blocks_count, false);
+    for (uint32_t b = 0; b < blocks; b++)
+    {
+        if (!load_changes(start + b))
+        {
+            changes_start = changes_blocks = 0;
+            changed.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<bool> WritebackCache::take_changes()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<bool> marks(changed.size(), false);
+    marks.swap(changed);
+
+    std::vector<char> zeros(block_size, 0);
+    for (uint32_t b = 0; b < changes_blocks; b++)
+    {
+        put(changes_start + b, 0, zeros.data(), block_size);
+    }
+    return marks;
+}
+
+void WritebackCache::restore_changes(const std::vector<bool> &marks)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (uint32_t block_num = 0; block_num < marks.size(); block_num++)
+    {
+        if (marks[block_num])
+        {
+            mark_changed(block_num);
+        }
+    }
+}
+
+bool WritebackCache::flush()
+{
+    return journal ? commit(true) : write_out(true);
+}
+
+WritebackStats WritebackCache::get_stats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    WritebackStats result = stats;
+    result.dirty_blocks = dirty.size();
+    return result;
+}
+
+void WritebackCache::flusher_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping)
+    {
+        wakeup.wait_for(lock, config.interval, [this]
+                        { return stopping || (!transaction && dirty.size() >= limit() * config.background_ratio / 100); });
+        if (stopping)
+        {
+            break;
+        }
+
+        lock.unlock();
+        commit(false);
+        write_out(false);
+        lock.lock();
+    }
+}
+
+// Group commit: every block changed since the last commit goes to the log
+// in one transaction. Operations are held back only while the blocks are
+// copied, unless the log needs a checkpoint afterwards (asked for, or more
+// than half full), which writes every block home, flushes and empties the
+// log before they continue. A transaction too big for the free part of the
+// log is preceded by a checkpoint; one too big for the whole log, which
+// only a huge explicit transaction can produce, is written home unlogged.
+bool WritebackCache::commit(bool checkpoint)
+{
+    if (!journal)
+    {
+        return true;
+    }
+
+    std::unique_lock<std::mutex> commit_lock(commit_mutex);
+    std::unique_lock<std::mutex> lock(mutex);
+    auto changed = [](const std::pair<const uint32_t, DirtyBlock> &entry)
+    { return entry.second.committed != entry.second.generation; };
+    if (transaction || (!checkpoint && revoked.empty() && std::none_of(dirty.begin(), dirty.end(), changed)))
+    {
+        return true;
+    }
+
+    // An exclusive operation may commit from inside; it waits for the rest.
+    // Any other commit steps aside until that operation ends, as it may be
+    // waiting for commit_mutex.
+    quiescing = true;
+    ops_idle.wait(lock, [this]
+                  { return active_ops == op_depth || (exclusive && op_depth == 0); });
+    if (active_ops != op_depth)
+    {
+        quiescing = false;
+        cleaned.notify_all();
+        commit_lock.unlock();
+        cleaned.wait(lock, [this]
+                     { return !exclusive; });
+        lock.unlock();
+        return commit(checkpoint);
+    }
+
+    std::vector<uint32_t> block_nums;
+    std::vector<uint64_t> generations;
+    std::vector<char> data;
+    for (const auto &entry : dirty)
+    {
+        if (changed(entry))
+        {
+            block_nums.push_back(entry.first);
+            generations.push_back(entry.second.generation);
+            data.insert(data.end(), entry.second.data.begin(), entry.second.data.end());
+        }
+    }
+    std::vector<uint32_t> revokes = std::move(revoked);
+    revoked.clear();
+    uint64_t ticket = ++commits_started;
+
+    size_t needed = journal->transaction_blocks(block_nums.size(), revokes.size());
+    if (needed > journal->free_blocks() && needed <= journal->capacity())
+    {
+        // Room is made by writing home what is already committed; an empty
+        // log needs no revokes
+        lock.unlock();
+        bool emptied = write_out(true) && fdatasync(fd) == 0 && journal->reset();
+        lock.lock();
+        if (emptied)
+        {
+            logged.clear();
+            revokes.clear();
+            stats.checkpoints++;
+            needed = journal->transaction_blocks(block_nums.size(), 0);
+        }
+    }
+    bool fits = needed <= journal->free_blocks();
+    checkpoint = checkpoint || !fits || journal->free_blocks() - needed < journal->capacity() / 2;
+    if (fits)
+    {
+        // Before operations resume, so a block rewritten as data right
+        // after this is revoked in the next transaction
+        logged.insert(block_nums.begin(), block_nums.end());
+    }
+    if (!checkpoint)
+    {
+        quiescing = false;
+        cleaned.notify_all();
+    }
+    lock.unlock();
+
+    bool ok = !fits || (block_nums.empty() && revokes.empty()) || journal->commit(block_nums, data.data(), revokes);
+
+    lock.lock();
+    if (ok)
+    {
+        for (size_t i = 0; i < block_nums.size(); i++)
+        {
+            auto it = dirty.find(block_nums[i]);
+            if (it == dirty.end() || it->second.generation < generations[i])
+            {
+                continue;
+            }
+            it->second.committed = fits ? generations[i] : it->second.generation;
+            if (it->second.committed == it->second.generation)
+            {
+                uncommitted--;
+            }
+        }
+        if (fits && !block_nums.empty())
+        {
+            stats.commits++;
+            stats.journaled_blocks += block_nums.size();
+        }
+        if (fits)
+        {
+            commits_durable = std::max(commits_durable, ticket);
+        }
+    }
+    else
+    {
+        revoked.insert(revoked.end(), revokes.begin(), revokes.end());
+    }
+
+    if (ok && checkpoint)
+    {
+        lock.unlock();
+        ok = write_out(true) && fdatasync(fd) == 0 && journal->reset();
+        lock.lock();
+        if (ok)
+        {
+            logged.clear();
+            stats.checkpoints++;
+            commits_durable = std::max(commits_durable, ticket);
+        }
+    }
+    quiescing = false;
+    cleaned.notify_all();
+    return ok;
+}
+
+// Writes dirty blocks back in block order, FLUSH_BATCH_BLOCKS at a time,
+// one pwrite per contiguous run. Everything goes when asked to or when the
+// background threshold is reached; otherwise only blocks older than the
+// expiry age. With a journal only committed blocks are eligible.
+bool WritebackCache::write_out(bool everything)
+{
+    std::lock_guard<std::mutex> flush_lock(flush_mutex);
+    std::unique_lock<std::mutex> lock(mutex);
+    if (fd < 0)
+    {
+        return true;
+    }
+    everything = everything || dirty.size() >= limit() * config.background_ratio / 100;
+
+    bool ok = true;
+    uint32_t next = 0;
+    while (ok)
+    {
+        // Copy the next batch out, so writers can keep going meanwhile
+        auto now = std::chrono::steady_clock::now();
+        std::vector<std::pair<uint32_t, uint64_t>> batch; // <block, generation written>
+        std::vector<char> buffer;
+        for (auto it = dirty.lower_bound(next); it != dirty.end() && batch.size() < FLUSH_BATCH_BLOCKS; ++it)
+        {
+            bool committed = !journal || it->second.committed == it->second.generation;
+            if (committed && (everything || now - it->second.since >= config.expire))
+            {
+                batch.push_back({it->first, it->second.generation});
+                buffer.insert(buffer.end(), it->second.data.begin(), it->second.data.end());
+            }
+        }
+        if (batch.empty())
+        {
+            break;
+        }
+        next = batch.back().first + 1;
+        lock.unlock();
+
+        uint64_t writes = 0;
+        for (size_t i = 0; ok && i < batch.size();)
+        {
+            size_t run = 1;
+            while (i + run < batch.size() && batch[i + run].first == batch[i].first + run)
+            {
+                run++;
+            }
+            ok = pwrite_fully(fd, buffer.data() + i * block_size, run * block_size,
+                              static_cast<off_t>(batch[i].first) * block_size);
+            writes++;
+            i += run;
+        }
+
+        // Blocks written again in the meantime stay dirty
+        lock.lock();
+        if (ok)
+        {
+            for (const auto &[block_num, generation] : batch)
+            {
+                auto it = dirty.find(block_num);
+                if (it != dirty.end() && it->second.generation == generation)
+                {
+                    dirty.erase(it);
+                }
+            }
+            stats.blocks_written += batch.size();
+        }
+        stats.host_writes += writes;
+        cleaned.notify_all();
+    }
+
+    return ok;
+}
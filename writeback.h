@@ -0,0 +1,198 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include "journal.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <sys/types.h>
+
+// Thresholds of the writeback cache, after the kernel's dirty_* knobs
+struct WritebackConfig
+{
+    size_t dirty_limit = 16384;              // Dirty blocks at which new operations wait for the flusher
+    unsigned background_ratio = 25;          // Percent of dirty_limit at which the flusher starts writing
+    std::chrono::milliseconds expire{1000};  // Age after which a dirty block is written regardless
+    std::chrono::milliseconds interval{200}; // How often the flusher wakes up (and commits) on its own
+};
+
+struct WritebackStats
+{
+    uint64_t dirty_blocks;     // Blocks waiting to be written
+    uint64_t blocks_written;   // Blocks written back so far
+    uint64_t host_writes;      // pwrite calls those took
+    uint64_t throttled_writes; // Operations that had to wait for the flusher
+    uint64_t commits;          // Journal transactions
+    uint64_t journaled_blocks; // Blocks logged by them
+    uint64_t checkpoints;      // Times the log was emptied
+};
+
+// Block writes of the image are kept in memory and written back by a
+// background thread, in block order and coalesced into contiguous runs.
+// Reads see the cached copy of a dirty block. Bulk data goes around the
+// cache through read_blocks / write_blocks, which keep it coherent.
+//
+// With a journal, the flusher first commits every block changed since the
+// last commit as one transaction (group commit), and a block only goes
+// home once its latest contents are in the log. Callers bracket each
+// operation with begin_op / end_op so that a commit never sees half of
+// one: the commit waits for running operations and holds new ones back
+// while it copies the blocks.
+//
+// An explicit transaction suspends group commits: everything written until
+// commit_transaction goes to the log as one transaction, and
+// abort_transaction puts back what every touched block held before.
+class WritebackCache
+{
+private:
+    struct DirtyBlock
+    {
+        std::vector<char> data;
+        uint64_t generation; // Bumped on every write, so a flush only cleans what it wrote
+        uint64_t committed;  // Generation last written to the journal
+        std::chrono::steady_clock::time_point since;
+    };
+
+    WritebackConfig config;
+    int fd;
+    size_t block_size;
+    bool write_back; // False: writes go straight to fd
+    bool frozen;     // Read-only mount: the map no longer changes and reads take no lock
+    std::map<uint32_t, DirtyBlock> dirty;
+    uint64_t next_generation;
+    uint64_t commits_started; // Commits that have copied their blocks
+    uint64_t commits_durable; // Last of those known to be in the log or home
+    WritebackStats stats;
+    Journal *journal;                 // Null without a journal
+    size_t uncommitted;               // Dirty blocks changed since their last commit
+    std::unordered_set<uint32_t> logged; // Blocks with a copy in the log
+    std::vector<uint32_t> revoked;       // Logged blocks since rewritten as file data
+    bool transaction;                    // An explicit transaction is open
+    std::map<uint32_t, DirtyBlock> originals; // Entries as the transaction found them; no data = not cached
+    uint32_t changes_start;       // First block of the change map, 0 when changes are not tracked
+    uint32_t changes_blocks;      // Its length
+    std::vector<bool> changed;    // In-memory copy of the change map
+    size_t active_ops;
+    bool quiescing; // A commit is waiting for, or holding back, operations
+    bool exclusive; // One operation runs alone and holds the others back
+    std::mutex mutex;          // Guards everything above
+    std::mutex flush_mutex;    // Held while a batch is in flight
+    std::mutex commit_mutex;   // One commit at a time
+    std::condition_variable wakeup;  // Flusher: work to do or shutdown
+    std::condition_variable cleaned; // Operations held back: dirty blocks went out or a commit finished
+    std::condition_variable ops_idle; // Commit: the last running operation ended
+    std::thread flusher;
+    bool stopping;
+
+    size_t limit() const;
+    void flusher_loop();
+    bool write_out(bool everything);
+    bool commit(bool checkpoint);
+    void save_original(uint32_t block_num);
+    bool put(uint32_t block_num, size_t offset, const void *data, size_t length);
+    bool mark_changed(uint32_t block_num);
+    bool load_changes(uint32_t map_block);
+    bool bypass(uint32_t first, size_t count);
+
+public:
+    explicit WritebackCache(const WritebackConfig &config = WritebackConfig());
+    ~WritebackCache();
+
+    WritebackCache(const WritebackCache &) = delete;
+    WritebackCache &operator=(const WritebackCache &) = delete;
+
+    // Starts serving fd. Without write_back every write is synchronous.
+    // A journal, when given, must stay open until detach.
+    void attach(int fd, size_t block_size, bool write_back, Journal *journal = nullptr);
+    // Commits and writes everything back, then stops the flusher
+    bool detach();
+
+    // Read-only mounts: blocks replayed from the journal are kept in memory
+    // instead of being written home, then the map is frozen
+    void preload(uint32_t block_num, const char *data);
+    void freeze() { frozen = true; }
+
+    // length bytes at offset inside one block
+    bool read(uint32_t block_num, size_t offset, void *buffer, size_t length);
+    bool write(uint32_t block_num, size_t offset, const void *data, size_t length);
+
+    // count whole blocks starting at first, bypassing the cache
+    bool read_blocks(uint32_t first, size_t count, char *buffer);
+    bool write_blocks(uint32_t first, size_t count, const char *data);
+
+    // length bytes of src_fd at offset into the blocks from first on, with
+    // copy_file_range so the data never passes through user space. When the
+    // kernel cannot do it, refused is set and the caller copies some other way.
+    bool copy_blocks(int src_fd, off_t offset, size_t length, uint32_t first, bool &refused);
+
+    // An operation may span threads when detached: begun on one, ended on
+    // another. Otherwise operations nest on one thread.
+    void begin_op(bool detached = false);
+    void end_op(bool detached = false);
+
+    // Starts an operation that runs alone: it waits for the running ones
+    // to end and holds new ones back until end_exclusive. Operations nested
+    // in it on the same thread are not held back.
+    void begin_exclusive();
+    void end_exclusive();
+
+    // Changes made meanwhile, by any caller, are committed or dropped
+    // together. Writers are not throttled inside a transaction.
+    bool begin_transaction();
+    bool commit_transaction();
+    bool abort_transaction();
+
+    // Changed-block tracking on a write-back cache. Every block written from
+    // now on gets its bit set in a bitmap of blocks_count bits that the
+    // image holds at start. The bitmap's blocks go through the cache like
+    // any other, so with a journal a mark commits together with the change
+    // it records. The bitmap's own blocks are never marked.
+    bool track_changes(uint32_t start, uint32_t blocks, uint32_t blocks_count);
+    std::vector<bool> take_changes();                    // Returns the marks and clears them
+    void restore_changes(const std::vector<bool> &marks); // Puts marks back after a failed export
+
+    // Commits are numbered. A change made inside an operation is carried by
+    // commit_ticket(), and is safe from a crash once is_committed says so.
+    // Without a journal nothing is ever waited for.
+    uint64_t commit_ticket();
+    bool is_committed(uint64_t ticket);
+
+    bool flush(); // Commits and writes every dirty block home now
+    WritebackStats get_stats();
+};
+
+// Brackets one FileSystem operation
+class CacheOp
+{
+private:
+    WritebackCache &cache;
+
+public:
+    explicit CacheOp(WritebackCache &cache) : cache(cache) { cache.begin_op(); }
+    ~CacheOp() { cache.end_op(); }
+
+    CacheOp(const CacheOp &) = delete;
+    CacheOp &operator=(const CacheOp &) = delete;
+};
+
+// Brackets one FileSystem operation that must see no other running
+class ExclusiveCacheOp
+{
+private:
+    WritebackCache &cache;
+
+public:
+    explicit ExclusiveCacheOp(WritebackCache &cache) : cache(cache) { cache.begin_exclusive(); }
+    ~ExclusiveCacheOp() { cache.end_exclusive(); }
+
+    ExclusiveCacheOp(const ExclusiveCacheOp &) = delete;
+    ExclusiveCacheOp &operator=(const ExclusiveCacheOp &) = delete;
+};
+
+#endif // WRITEBACK_H